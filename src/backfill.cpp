@@ -0,0 +1,120 @@
+// Runtime estimation & reservations for backfill scheduling
+// Author: Max Schwarz <max.schwarz@ais.uni-bonn.de>
+
+#include "backfill.h"
+
+#include <algorithm>
+#include <functional>
+#include <queue>
+
+namespace
+{
+    // Weight of a new sample in the moving average
+    constexpr double SMOOTHING = 0.2;
+}
+
+void RuntimeEstimator::Average::add(double value)
+{
+    if(samples == 0)
+        seconds = value;
+    else
+        seconds = (1.0 - SMOOTHING) * seconds + SMOOTHING * value;
+
+    samples++;
+}
+
+void RuntimeEstimator::record(std::int64_t uid, const Duration& runtime)
+{
+    double seconds = std::chrono::duration<double>{runtime}.count();
+
+    m_perUser[uid].add(seconds);
+    m_global.add(seconds);
+}
+
+std::optional<RuntimeEstimator::Duration> RuntimeEstimator::estimate(std::int64_t uid) const
+{
+    const Average* avg = &m_global;
+
+    auto it = m_perUser.find(uid);
+    if(it != m_perUser.end())
+        avg = &it->second;
+
+    if(avg->samples == 0)
+        return {};
+
+    return std::chrono::duration_cast<Duration>(std::chrono::duration<double>{avg->seconds});
+}
+
+Reservation reserve(std::size_t neededCards, std::size_t freeCards,
+    std::vector<Reservation::TimePoint> releaseTimes)
+{
+    Reservation res;
+
+    if(freeCards >= neededCards)
+    {
+        res.start = Reservation::TimePoint::min();
+        res.spareCards = freeCards - neededCards;
+        return res;
+    }
+
+    std::size_t missing = neededCards - freeCards;
+    if(missing > releaseTimes.size())
+        return res; // can never run
+
+    std::ranges::sort(releaseTimes);
+    res.start = releaseTimes[missing - 1];
+
+    if(res.start == Reservation::TimePoint::max())
+        return res;
+
+    // Other cards released no later than the reserved start are spare
+    auto freeAtStart = freeCards + std::ranges::count_if(releaseTimes, [&](auto& t){
+        return t <= res.start;
+    });
+
+    res.spareCards = freeAtStart - neededCards;
+
+    return res;
+}
+
+std::vector<Reservation::TimePoint> estimateStarts(Reservation::TimePoint now, std::size_t freeCards,
+    const std::vector<Reservation::TimePoint>& releaseTimes, const std::vector<PlannedJob>& jobs)
+{
+    using TimePoint = Reservation::TimePoint;
+
+    // Time at which each card becomes available, earliest first
+    std::priority_queue<TimePoint, std::vector<TimePoint>, std::greater<>> available{
+        std::greater<>{}, releaseTimes
+    };
+    for(std::size_t i = 0; i < freeCards; ++i)
+        available.push(now);
+
+    std::vector<TimePoint> starts;
+    starts.reserve(jobs.size());
+
+    std::vector<TimePoint> taken;
+    for(auto& job : jobs)
+    {
+        if(job.cards == 0 || job.cards > available.size())
+        {
+            starts.push_back(TimePoint::max());
+            continue;
+        }
+
+        taken.clear();
+        for(std::size_t i = 0; i < job.cards; ++i)
+        {
+            taken.push_back(available.top());
+            available.pop();
+        }
+
+        TimePoint start = taken.back();
+        starts.push_back(start);
+
+        TimePoint end = (start == TimePoint::max() || !job.runtime) ? TimePoint::max() : start + *job.runtime;
+        for(std::size_t i = 0; i < job.cards; ++i)
+            available.push(end);
+    }
+
+    return starts;
+}
@@ -0,0 +1,84 @@
+// Runtime estimation & reservations for backfill scheduling
+// Author: Max Schwarz <max.schwarz@ais.uni-bonn.de>
+
+#ifndef BACKFILL_H
+#define BACKFILL_H
+
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+// Keeps an exponentially weighted moving average of past job runtimes,
+// per user and globally.
+class RuntimeEstimator
+{
+public:
+    using Duration = std::chrono::steady_clock::duration;
+
+    void record(std::int64_t uid, const Duration& runtime);
+
+    // Expected runtime of the next job of this user. Falls back to the global
+    // average for users without history, nullopt if nothing is known yet.
+    [[nodiscard]] std::optional<Duration> estimate(std::int64_t uid) const;
+
+    struct Average
+    {
+        double seconds = 0.0;
+        std::size_t samples = 0;
+
+        void add(double value);
+    };
+
+    // For persisting the estimates across restarts
+    [[nodiscard]] const std::unordered_map<std::int64_t, Average>& perUser() const
+    { return m_perUser; }
+    [[nodiscard]] const Average& global() const
+    { return m_global; }
+
+    void restore(std::int64_t uid, const Average& avg)
+    { m_perUser[uid] = avg; }
+    void restoreGlobal(const Average& avg)
+    { m_global = avg; }
+
+private:
+    std::unordered_map<std::int64_t, Average> m_perUser;
+    Average m_global;
+};
+
+// Start time reserved for the head of the queue
+struct Reservation
+{
+    using TimePoint = std::chrono::steady_clock::time_point;
+
+    // Estimated time at which enough cards are free for the head job.
+    // TimePoint::max() if that cannot be estimated.
+    TimePoint start = TimePoint::max();
+
+    // Cards that will be free at that time on top of what the head job needs.
+    // Backfilled jobs may occupy these regardless of their runtime.
+    std::size_t spareCards = 0;
+};
+
+// Compute the reservation for a job needing neededCards, given the number of
+// currently free cards and the estimated release times of all claimed cards
+// (TimePoint::max() for unknown).
+[[nodiscard]] Reservation reserve(std::size_t neededCards, std::size_t freeCards,
+    std::vector<Reservation::TimePoint> releaseTimes);
+
+// A queued job for estimateStarts()
+struct PlannedJob
+{
+    std::size_t cards = 0; // 0: not modelled (shared or MIG)
+    std::optional<RuntimeEstimator::Duration> runtime; // nullopt: unknown
+};
+
+// Estimated start of each job if they are started in the given order
+// (greedy list scheduling on the same inputs as reserve()). A started job
+// holds its cards for its expected runtime. TimePoint::max() if the start
+// cannot be estimated.
+[[nodiscard]] std::vector<Reservation::TimePoint> estimateStarts(Reservation::TimePoint now, std::size_t freeCards,
+    const std::vector<Reservation::TimePoint>& releaseTimes, const std::vector<PlannedJob>& jobs);
+
+#endif
@@ -0,0 +1,439 @@
+// Benchmarks and load generator
+// Author: Max Schwarz <max.schwarz@ais.uni-bonn.de>
+
+#include <nvml.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <cstring>
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <zpp_bits.h>
+
+#include <boost/program_options.hpp>
+
+#include "latency.h"
+#include "mock_nvml.h"
+#include "packet.h"
+#include "protocol.h"
+#include "sampler.h"
+
+using namespace std::chrono_literals;
+
+namespace
+{
+    void printStats(const std::vector<LatencyStat>& stats)
+    {
+        printf("%-40s %10s %10s %10s %10s %10s\n", "", "count", "mean [us]", "p50 [us]", "p99 [us]", "max [us]");
+        for(auto& stat : stats)
+        {
+            if(stat.count == 0)
+                continue;
+
+            printf("%-40s %10lu %10.1f %10.1f %10.1f %10.1f\n",
+                stat.name.c_str(), stat.count, 1e6 * stat.mean, 1e6 * stat.p50, 1e6 * stat.p99, 1e6 * stat.max
+            );
+        }
+    }
+
+    // VmRSS and VmHWM of a process in kB
+    std::pair<long, long> memoryUsage(pid_t pid)
+    {
+        std::ifstream status{"/proc/" + std::to_string(pid) + "/status"};
+        long rss = 0;
+        long peak = 0;
+        for(std::string line; std::getline(status, line);)
+        {
+            if(line.starts_with("VmRSS:"))
+                rss = strtol(line.c_str() + 6, nullptr, 10);
+            else if(line.starts_with("VmHWM:"))
+                peak = strtol(line.c_str() + 6, nullptr, 10);
+        }
+        return {rss, peak};
+    }
+
+    void raiseFileLimit()
+    {
+        rlimit limit{};
+        if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+        {
+            limit.rlim_cur = limit.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &limit);
+        }
+    }
+
+    // Sampling passes over synthetic cards, in-process
+    int benchSampler(unsigned int cards, unsigned int processes, unsigned int passes)
+    {
+        mockNvmlConfigure(cards, processes);
+        if(auto err = nvmlInitWithFlags(0))
+        {
+            fprintf(stderr, "Could not initialize NVML: %s\n", nvmlErrorString(err));
+            return 1;
+        }
+
+        {
+            // Passes are timed by the sampler itself (sampler.pass)
+            Sampler sampler{cards, 0ms};
+
+            while(true)
+            {
+                pollfd pfd{sampler.eventFD(), POLLIN, 0};
+                poll(&pfd, 1, 1000);
+
+                std::uint64_t count = 0;
+                if(read(sampler.eventFD(), &count, sizeof(count)) < 0 && errno != EAGAIN)
+                {
+                    perror("Could not read from sampler eventfd");
+                    return 1;
+                }
+
+                auto snapshot = sampler.snapshot();
+                if(snapshot && snapshot->generation >= passes)
+                    break;
+            }
+        }
+
+        nvmlShutdown();
+
+        printf("%u cards, %u processes, %u passes\n\n", cards, processes, passes);
+        printStats(latencyStats());
+
+        rusage usage{};
+        getrusage(RUSAGE_SELF, &usage);
+        printf("\nPeak memory: %ld kB\n", usage.ru_maxrss);
+
+        return 0;
+    }
+
+    struct SimClient
+    {
+        int fd = -1;
+        bool claim = false;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    struct LoadOptions
+    {
+        std::string socket;
+        unsigned int clients = 0;
+        std::chrono::steady_clock::duration duration;
+        double claimFraction = 0.0;
+        std::chrono::steady_clock::duration hold;
+    };
+
+    // Closed loop: each simulated client starts a new request as soon as
+    // its previous one is done
+    class LoadGenerator
+    {
+    public:
+        explicit LoadGenerator(const LoadOptions& options)
+         : m_options{options}
+         , m_clients(options.clients)
+        {
+            m_epollFD = epoll_create1(EPOLL_CLOEXEC);
+            if(m_epollFD < 0)
+            {
+                perror("Could not create epoll fd");
+                std::exit(1);
+            }
+        }
+
+        int run()
+        {
+            auto begin = std::chrono::steady_clock::now();
+            for(auto& client : m_clients)
+                start(client);
+
+            std::vector<epoll_event> events(256);
+            auto end = begin + m_options.duration;
+            while(true)
+            {
+                auto now = std::chrono::steady_clock::now();
+                if(now >= end)
+                    break;
+
+                // Jobs end in the order they started, all hold equally long
+                while(!m_delayed.empty() && m_delayed.front().first <= now)
+                {
+                    auto* client = m_delayed.front().second;
+                    m_delayed.pop_front();
+                    finish(*client);
+                    start(*client);
+                }
+
+                auto timeout = end - now;
+                if(!m_delayed.empty())
+                    timeout = std::min(timeout, m_delayed.front().first - now);
+
+                int nfds = epoll_wait(m_epollFD, events.data(), events.size(),
+                    std::chrono::duration_cast<std::chrono::milliseconds>(timeout).count() + 1
+                );
+                if(nfds < 0 && errno != EINTR)
+                {
+                    perror("epoll_wait() failed");
+                    return 1;
+                }
+
+                for(int i = 0; i < nfds; ++i)
+                    receive(*static_cast<SimClient*>(events[i].data.ptr));
+            }
+
+            double seconds = std::chrono::duration<double>{std::chrono::steady_clock::now() - begin}.count();
+
+            printf("%u clients, %.0f%% claims, %.1fs\n\n", m_options.clients, 100.0 * m_options.claimFraction, seconds);
+            printStats(latencyStats());
+
+            printf("\nJobs started: %lu (%.1f/s)\n", m_jobs, m_jobs / seconds);
+            printf("Failed requests: %lu\n", m_errors);
+
+            if(m_serverPID > 0)
+            {
+                auto [rss, peak] = memoryUsage(m_serverPID);
+                printf("Server memory: %ld kB (peak %ld kB)\n", rss, peak);
+            }
+
+            // Where the server spent its time
+            SimClient query;
+            if(connect(query) && sendRequest(query, Request{DebugStatsRequest{}}))
+            {
+                DebugStatsResponse resp;
+                if(receiveResponse(query, resp, true))
+                {
+                    printf("\nServer:\n");
+                    printStats(resp.stats);
+                }
+            }
+            finish(query);
+
+            return 0;
+        }
+
+    private:
+        bool connect(SimClient& client)
+        {
+            client.fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+            if(client.fd < 0)
+                return false;
+
+            sockaddr_un addr{};
+            addr.sun_family = AF_UNIX;
+            strncpy(addr.sun_path, m_options.socket.c_str(), sizeof(addr.sun_path) - 1);
+            if(::connect(client.fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+            {
+                close(client.fd);
+                client.fd = -1;
+                return false;
+            }
+
+            if(m_serverPID == 0)
+            {
+                ucred cred{};
+                socklen_t len = sizeof(cred);
+                if(getsockopt(client.fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0)
+                    m_serverPID = cred.pid;
+            }
+
+            return true;
+        }
+
+        bool sendRequest(SimClient& client, const Request& req)
+        {
+            m_sendBuffer.clear();
+            zpp::bits::out out{m_sendBuffer};
+            out(req).or_throw();
+
+            return ::send(client.fd, m_sendBuffer.data(), m_sendBuffer.size(), MSG_EOR | MSG_NOSIGNAL) == static_cast<ssize_t>(m_sendBuffer.size());
+        }
+
+        bool receiveResponse(SimClient& client, auto& resp, bool blocking = false)
+        {
+            ssize_t ret = receivePacket(client.fd, m_recvBuffer, blocking ? 0 : MSG_DONTWAIT);
+            if(ret <= 0)
+                return false;
+
+            zpp::bits::in in{std::span{m_recvBuffer.data(), static_cast<std::size_t>(ret)}};
+            return !zpp::bits::failure(in(resp));
+        }
+
+        void start(SimClient& client)
+        {
+            client.claim = std::bernoulli_distribution{m_options.claimFraction}(m_rng);
+            client.start = std::chrono::steady_clock::now();
+
+            ClaimRequest claim;
+            claim.numGPUs = 1;
+            claim.wait = true;
+            claim.releaseOnClose = true;
+
+            Request req = client.claim ? Request{claim} : Request{StatusRequest{}};
+            if(!connect(client) || !sendRequest(client, req))
+            {
+                // Try again later
+                m_errors++;
+                m_delayed.emplace_back(client.start + m_options.hold, &client);
+                return;
+            }
+
+            fcntl(client.fd, F_SETFL, fcntl(client.fd, F_GETFL) | O_NONBLOCK);
+
+            epoll_event ev{};
+            ev.events = EPOLLIN;
+            ev.data.ptr = &client;
+            epoll_ctl(m_epollFD, EPOLL_CTL_ADD, client.fd, &ev);
+        }
+
+        void finish(SimClient& client)
+        {
+            if(client.fd >= 0)
+                close(client.fd);
+            client.fd = -1;
+        }
+
+        void receive(SimClient& client)
+        {
+            static auto& s_status = latencyHistogram("load.status");
+            static auto& s_claim = latencyHistogram("load.claim");
+
+            auto latency = std::chrono::steady_clock::now() - client.start;
+            bool ok = false;
+            if(client.claim)
+            {
+                ClaimResponse resp;
+                ok = receiveResponse(client, resp) && !resp.claimedCards.empty();
+                if(ok)
+                {
+                    s_claim.observe(latency);
+                    m_jobs++;
+
+                    // Keep the connection open, closing it releases the card
+                    epoll_ctl(m_epollFD, EPOLL_CTL_DEL, client.fd, nullptr);
+                    m_delayed.emplace_back(std::chrono::steady_clock::now() + m_options.hold, &client);
+                    return;
+                }
+            }
+            else
+            {
+                StatusResponse resp;
+                ok = receiveResponse(client, resp);
+                if(ok)
+                    s_status.observe(latency);
+            }
+
+            if(!ok)
+                m_errors++;
+
+            finish(client);
+            start(client);
+        }
+
+        LoadOptions m_options;
+        std::vector<SimClient> m_clients;
+        // Clients holding a card, or waiting to retry
+        std::deque<std::pair<std::chrono::steady_clock::time_point, SimClient*>> m_delayed;
+
+        int m_epollFD = -1;
+        pid_t m_serverPID = 0;
+        std::mt19937 m_rng{42};
+        std::vector<std::byte> m_sendBuffer;
+        std::vector<std::byte> m_recvBuffer;
+
+        std::uint64_t m_jobs = 0;
+        std::uint64_t m_errors = 0;
+    };
+}
+
+int main(int argc, char** argv)
+{
+    namespace po = boost::program_options;
+
+    po::options_description desc{"Options"};
+    desc.add_options()
+        ("help,h", "Help")
+        ("cards", po::value<unsigned int>()->default_value(64)->value_name("N"), "sampler: Number of synthetic cards")
+        ("processes", po::value<unsigned int>()->default_value(512)->value_name("N"), "sampler: Number of GPU processes, spread over the cards")
+        ("passes", po::value<unsigned int>()->default_value(200)->value_name("N"), "sampler: Number of sampling passes")
+        ("socket", po::value<std::string>()->default_value("/var/run/gpu_server.sock")->value_name("PATH"), "load: Server socket")
+        ("clients", po::value<unsigned int>()->default_value(1000)->value_name("N"), "load: Number of concurrent clients")
+        ("duration", po::value<double>()->default_value(10.0)->value_name("S"), "load: Duration of the run")
+        ("claim-fraction", po::value<double>()->default_value(0.1)->value_name("F"), "load: Fraction of requests that claim a card instead of querying the status")
+        ("hold", po::value<unsigned int>()->default_value(100)->value_name("MS"), "load: How long claimed cards are held")
+    ;
+
+    po::options_description hidden{"Hidden"};
+    hidden.add_options()
+        ("command", po::value<std::string>()->default_value("sampler"), "Command")
+    ;
+
+    po::options_description allOptions;
+    allOptions.add(desc).add(hidden);
+
+    po::positional_options_description p;
+    p.add("command", 1);
+
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv).options(allOptions).positional(p).run(), vm);
+
+    if(vm.count("help"))
+    {
+        std::cerr << "Usage: gpu_bench <command> [options]\n"
+            "Available commands:\n"
+            "  gpu_bench sampler [--cards N] [--processes N]:\n"
+            "    Time NVML sampling passes over synthetic cards (no GPUs needed)\n"
+            "  gpu_bench load [--socket PATH] [--clients N]:\n"
+            "    Run status and claim clients against a gpu_server (e.g. gpu_server_mock).\n"
+            "    Run this as a regular user, the claims are made under its UID.\n"
+            "\n"
+            << desc << "\n";
+        return 1;
+    }
+
+    po::notify(vm);
+
+    auto command = vm["command"].as<std::string>();
+    if(command == "sampler")
+    {
+        return benchSampler(vm["cards"].as<unsigned int>(), vm["processes"].as<unsigned int>(), vm["passes"].as<unsigned int>());
+    }
+    else if(command == "load")
+    {
+        if(getuid() == 0)
+        {
+            fprintf(stderr, "Claims by root are not possible, run the load generator as a regular user.\n");
+            return 1;
+        }
+
+        raiseFileLimit();
+
+        LoadOptions options;
+        options.socket = vm["socket"].as<std::string>();
+        options.clients = vm["clients"].as<unsigned int>();
+        options.duration = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>{vm["duration"].as<double>()}
+        );
+        options.claimFraction = vm["claim-fraction"].as<double>();
+        options.hold = std::chrono::milliseconds{vm["hold"].as<unsigned int>()};
+
+        return LoadGenerator{options}.run();
+    }
+    else
+    {
+        fprintf(stderr, "Unknown command '%s'. Try --help.\n", command.c_str());
+        return 1;
+    }
+}
@@ -2,28 +2,53 @@
 // Author: Max Schwarz <max.schwarz@ais.uni-bonn.de>
 
 #include "protocol.h"
+#include "compact.h"
+#include "delta.h"
+#include "packet.h"
+#include "status_segment.h"
+#include "tcp.h"
 
 #include <boost/program_options.hpp>
 
+#include <algorithm>
 #include <cstdio>
 #include <iostream>
+#include <limits>
 #include <filesystem>
+#include <span>
+#include <sstream>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
 
 #include <sys/types.h>
 #include <sys/un.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/signalfd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
 
 #include <pwd.h>
 
 using namespace std::chrono_literals;
 
+// Seconds to wait for a restarting gpu_server
+constexpr int RECONNECT_ATTEMPTS = 60;
+
 class Connection
 {
 public:
-    Connection()
+    // If required is false, check connected() instead of exiting on failure
+    explicit Connection(bool required = true)
     {
-        m_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+        // CLOEXEC: jobs started by gpu run must not inherit the connection
+        // (gpu exec passes it on explicitly)
+        m_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
         if(m_fd < 0)
         {
             fprintf(stderr, "Could not connect to gpu_server. Please contact the system administrators.\n");
@@ -35,6 +60,13 @@ public:
         strcpy(addr.sun_path, "/var/run/gpu_server.sock");
         if(connect(m_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
         {
+            if(!required)
+            {
+                close(m_fd);
+                m_fd = -1;
+                return;
+            }
+
             fprintf(stderr, "Could not connect to gpu_server. Please contact the system administrators.\n");
             std::exit(1);
         }
@@ -49,12 +81,15 @@ public:
     Connection(const Connection&) = delete;
     Connection& operator=(const Connection&) = delete;
 
+    [[nodiscard]] bool connected() const
+    { return m_fd >= 0; }
+
+    [[nodiscard]] int fd() const
+    { return m_fd; }
+
     void send(const Request& req)
     {
-        auto [data, out] = zpp::bits::data_out();
-        out(req).or_throw();
-
-        if(::send(m_fd, data.data(), data.size(), MSG_EOR) != data.size())
+        if(!trySend(req))
         {
             perror("Could not send data to gpu_server");
             fprintf(stderr, "Please contact the system adminstrator.\n");
@@ -64,34 +99,33 @@ public:
 
     void receive(auto& resp)
     {
-        std::vector<uint8_t> data(4096);
-
-        iovec iov{};
-        iov.iov_base = data.data();
-        iov.iov_len = data.size();
-
-        msghdr msg{};
-        msg.msg_iov = &iov;
-        msg.msg_iovlen = 1;
-
-        int ret = recvmsg(m_fd, &msg, 0);
-        if(ret <= 0)
+        if(!tryReceive(resp))
         {
             perror("Could not receive data from gpu_server");
             fprintf(stderr, "Please contact the system adminstrator.\n");
             std::exit(1);
         }
+    }
 
-        if(msg.msg_flags & MSG_TRUNC)
-        {
-            fprintf(stderr, "Message was truncated on receive.\n");
-            fprintf(stderr, "Please contact the system adminstrator.\n");
-            std::exit(1);
-        }
+    // Return false if the server went away (e.g. restarted)
+    [[nodiscard]] bool trySend(const Request& req)
+    {
+        m_sendBuffer.clear();
+        zpp::bits::out out{m_sendBuffer};
+        out(req).or_throw();
 
-        data.resize(ret);
-        zpp::bits::in in{data};
+        return ::send(m_fd, m_sendBuffer.data(), m_sendBuffer.size(), MSG_EOR | MSG_NOSIGNAL) == static_cast<ssize_t>(m_sendBuffer.size());
+    }
+
+    [[nodiscard]] bool tryReceive(auto& resp)
+    {
+        ssize_t ret = receivePacket(m_fd, m_recvBuffer);
+        if(ret <= 0)
+            return false;
+
+        zpp::bits::in in{std::span{m_recvBuffer.data(), static_cast<std::size_t>(ret)}};
         in(resp).or_throw();
+        return true;
     }
 
     bool waitForReply(const std::chrono::steady_clock::duration& timeout)
@@ -120,8 +154,534 @@ public:
 
 private:
     int m_fd = -1;
+
+    // Reused across messages to avoid allocations
+    std::vector<std::byte> m_sendBuffer;
+    std::vector<std::byte> m_recvBuffer;
+};
+
+// Static card info is cached on disk, keyed by the server generation
+struct CardInfoCache
+{
+    std::uint64_t generation = 0;
+    std::vector<CardInfo> info;
 };
 
+// Home directories are often shared between nodes, so include the hostname
+std::filesystem::path cardInfoCachePath()
+{
+    char host[256]{};
+    if(gethostname(host, sizeof(host) - 1) != 0)
+        return {};
+
+    std::string name = std::string{"gpu_claim_cards."} + host;
+
+    if(const char* cache = getenv("XDG_CACHE_HOME"); cache && cache[0])
+        return std::filesystem::path{cache} / name;
+    if(const char* home = getenv("HOME"); home && home[0])
+        return std::filesystem::path{home} / ".cache" / name;
+
+    return {};
+}
+
+CardInfoCache loadCardInfoCache()
+{
+    auto path = cardInfoCachePath();
+    if(path.empty())
+        return {};
+
+    FILE* f = fopen(path.c_str(), "rb");
+    if(!f)
+        return {};
+
+    std::vector<std::byte> data;
+    std::byte buf[4096];
+    while(std::size_t n = fread(buf, 1, sizeof(buf), f))
+        data.insert(data.end(), buf, buf + n);
+    fclose(f);
+
+    CardInfoCache cache;
+    zpp::bits::in in{data};
+    if(zpp::bits::failure(in(cache)))
+        return {};
+
+    return cache;
+}
+
+void storeCardInfoCache(const CardInfoCache& cache)
+{
+    namespace fs = std::filesystem;
+
+    auto path = cardInfoCachePath();
+    if(path.empty())
+        return;
+
+    std::error_code ec;
+    fs::create_directories(path.parent_path(), ec);
+
+    std::vector<std::byte> data;
+    zpp::bits::out out{data};
+    if(zpp::bits::failure(out(cache)))
+        return;
+
+    // Write & rename, so that concurrent readers never see a partial file
+    auto tmpPath = path;
+    tmpPath += "." + std::to_string(getpid());
+
+    FILE* f = fopen(tmpPath.c_str(), "wb");
+    if(!f)
+        return;
+
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+    ok = (fclose(f) == 0) && ok;
+
+    if(!ok || rename(tmpPath.c_str(), path.c_str()) != 0)
+        unlink(tmpPath.c_str());
+}
+
+// Read the status from the server's shared memory segment, or query it through
+// the compact protocol, using cached card info if possible
+std::vector<Card> queryStatus()
+{
+    if(auto cards = readStatusSegment())
+        return std::move(*cards);
+
+    auto cache = loadCardInfoCache();
+
+    for(int attempt = 0; attempt < 2; ++attempt)
+    {
+        Connection conn;
+        conn.send(Request{CompactStatusRequest{cache.generation}});
+
+        CompactStatusResponse resp;
+        conn.receive(resp);
+
+        if(!resp.info.empty())
+        {
+            cache.generation = resp.generation;
+            cache.info = std::move(resp.info);
+            storeCardInfoCache(cache);
+        }
+
+        // Stale or damaged cache, ask again for everything
+        if(cache.info.size() != resp.cards.size())
+        {
+            cache = {};
+            continue;
+        }
+
+        std::vector<Card> cards;
+        cards.reserve(resp.cards.size());
+        for(std::size_t i = 0; i < resp.cards.size(); ++i)
+            cards.push_back(expandCard(cache.info[i], resp.cards[i]));
+
+        return cards;
+    }
+
+    fprintf(stderr, "gpu_server sent inconsistent card information.\n");
+    std::exit(1);
+}
+
+// One line per card with a utilization sparkline over the whole history
+void printHistory(const HistoryResponse& resp, const std::vector<Card>& cards)
+{
+    static const char* BARS[] = {" ", "▁", "▂", "▃", "▄", "▅", "▆", "▇", "█"};
+    constexpr std::size_t COLUMNS = 60;
+
+    for(auto& hist : resp.cards)
+    {
+        std::string name = hist.index < cards.size() ? cards[hist.index].name : "";
+
+        std::size_t n = hist.utilization.size();
+        if(n == 0)
+        {
+            printf("[%u] %s | no data\n", hist.index, name.c_str());
+            continue;
+        }
+
+        std::uint64_t minutes = std::uint64_t{hist.samples} * resp.intervalMs / 60000;
+        printf("[%u] %s | last %3lumin: avg %3u%% max %3u%% | peak %6u MB | ",
+            hist.index, name.c_str(), minutes, hist.averageUtilization, hist.maxUtilization, hist.peakMemoryUsage
+        );
+
+        // Average each bucket of points into one bar
+        std::size_t columns = std::min(COLUMNS, n);
+        for(std::size_t col = 0; col < columns; ++col)
+        {
+            std::size_t begin = col * n / columns;
+            std::size_t end = (col + 1) * n / columns;
+
+            unsigned int bucketSum = 0;
+            for(std::size_t i = begin; i < end; ++i)
+                bucketSum += hist.utilization[i];
+
+            unsigned int avg = bucketSum / std::max<std::size_t>(end - begin, 1);
+            fputs(BARS[(avg * 8 + 50) / 100], stdout);
+        }
+        printf("\n");
+    }
+}
+
+// Parse sizes like 2G, 500M or 1.5G (decimal units). Plain numbers are MB.
+std::uint64_t parseMemory(const std::string& str)
+{
+    std::size_t end = 0;
+    double value = 0.0;
+    try
+    {
+        value = std::stod(str, &end);
+    }
+    catch(std::logic_error&)
+    {
+        fprintf(stderr, "Invalid memory size '%s'\n", str.c_str());
+        std::exit(1);
+    }
+
+    std::string unit = str.substr(end);
+    double factor = 0;
+    if(unit.empty() || unit == "M" || unit == "MB")
+        factor = 1e6;
+    else if(unit == "G" || unit == "GB")
+        factor = 1e9;
+    else if(unit == "K" || unit == "KB")
+        factor = 1e3;
+
+    if(factor == 0 || value <= 0)
+    {
+        fprintf(stderr, "Invalid memory size '%s'\n", str.c_str());
+        std::exit(1);
+    }
+
+    return static_cast<std::uint64_t>(value * factor);
+}
+
+// Walltime like 90m, 2h or 1d in seconds. Plain numbers are minutes.
+std::uint32_t parseDuration(const std::string& str)
+{
+    std::size_t end = 0;
+    double value = 0.0;
+    try
+    {
+        value = std::stod(str, &end);
+    }
+    catch(std::logic_error&)
+    {
+        fprintf(stderr, "Invalid time limit '%s'\n", str.c_str());
+        std::exit(1);
+    }
+
+    std::string unit = str.substr(end);
+    double factor = 0;
+    if(unit.empty() || unit == "m" || unit == "min")
+        factor = 60;
+    else if(unit == "s")
+        factor = 1;
+    else if(unit == "h")
+        factor = 3600;
+    else if(unit == "d")
+        factor = 86400;
+
+    if(factor == 0 || value <= 0 || value * factor > std::numeric_limits<std::uint32_t>::max())
+    {
+        fprintf(stderr, "Invalid time limit '%s'\n", str.c_str());
+        std::exit(1);
+    }
+
+    return std::max<std::uint32_t>(1, value * factor);
+}
+
+// Print one line per card. clearLines erases leftovers when redrawing in place.
+void printStatus(const std::vector<Card>& cards, bool clearLines = false)
+{
+    auto now = std::chrono::steady_clock::now();
+
+    for(std::size_t i = 0; i < cards.size(); ++i)
+    {
+        auto& card = cards[i];
+
+        printf("[%lu] %s | %2d%% | %6lu / %6lu MB |",
+            i, card.name.c_str(),
+            card.computeUsagePercent,
+            card.memoryUsage / 1000000UL, card.memoryTotal / 1000000UL
+        );
+
+        struct passwd *pws;
+        pws = getpwuid(card.reservedByUID);
+        if(!card.healthy)
+            printf("%22s |", "unavailable");
+        else if(!card.migSlices.empty())
+        {
+            auto free = std::ranges::count_if(card.migSlices, [](auto& slice){ return slice.reservedByUID == 0; });
+
+            char buf[64];
+            snprintf(buf, sizeof(buf), "MIG, %ld/%lu free", free, card.migSlices.size());
+            printf("%22s |", buf);
+
+            for(auto& slice : card.migSlices)
+            {
+                struct passwd* owner = slice.reservedByUID ? getpwuid(slice.reservedByUID) : nullptr;
+                printf(" %s:%s", slice.profile.c_str(), owner ? owner->pw_name : "free");
+            }
+        }
+        else if(!card.tenants.empty())
+        {
+            std::uint64_t reserved = 0;
+            for(auto& tenant : card.tenants)
+                reserved += tenant.memory;
+
+            char buf[64];
+            snprintf(buf, sizeof(buf), "shared, %lu MB left", (card.memoryTotal - std::min(reserved, card.memoryTotal)) / 1000000UL);
+            printf("%22s |", buf);
+        }
+        else if(card.reservedByUID == 0 || !pws)
+            printf("%22s |", "free");
+        else
+        {
+            auto idleTime = now - card.lastUsageTime;
+            auto minutes = std::chrono::duration_cast<std::chrono::minutes>(idleTime);
+
+            bool used = std::ranges::any_of(card.processes, [&](auto& proc){
+                return proc.uid == card.reservedByUID;
+            });
+
+            if(used)
+                printf("%10s   (running) |", pws->pw_name);
+            else
+                printf("%10s (idle %ldmin) |", pws->pw_name, minutes.count());
+        }
+
+        for(auto& proc : card.processes)
+        {
+            struct passwd *pws;
+            pws = getpwuid(proc.uid);
+
+            printf(" %s(%luM)",
+                pws->pw_name, proc.memory / 1000000UL
+            );
+        }
+        printf(clearLines ? "\033[K\n" : "\n");
+    }
+}
+
+// Look up name in PATH like execvp(): names containing a slash are used as
+// they are, otherwise the first executable match wins. Returns name if there
+// is none, so that the exec error is reported.
+std::string findExecutable(const std::string& name)
+{
+    if(name.find('/') != std::string::npos)
+        return name;
+
+    const char* env = getenv("PATH");
+    std::string_view path = env ? env : "/usr/local/bin:/usr/bin:/bin";
+
+    std::string candidate;
+    while(true)
+    {
+        auto end = path.find(':');
+        auto dir = path.substr(0, end);
+
+        // An empty entry means the current directory
+        candidate.assign(dir.empty() ? "." : dir);
+        candidate += '/';
+        candidate += name;
+
+        struct stat st{};
+        if(access(candidate.c_str(), X_OK) == 0 && stat(candidate.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+            return candidate;
+
+        if(end == std::string_view::npos)
+            return name;
+        path.remove_prefix(end + 1);
+    }
+}
+
+// Value for CUDA_VISIBLE_DEVICES
+std::string visibleDevices(const std::vector<Card>& cards)
+{
+    std::stringstream ss;
+    for(std::size_t i = 0; i < cards.size(); ++i)
+    {
+        ss << cards[i].uuid;
+        if(i != cards.size()-1)
+            ss << ",";
+    }
+
+    return ss.str();
+}
+
+// Print a ClaimResponse progress message, unless it says the same as the last one
+void printQueueProgress(const ClaimResponse& resp, std::string& last)
+{
+    char eta[64];
+    if(resp.etaSeconds < 0)
+        snprintf(eta, sizeof(eta), "start time unknown");
+    else if(resp.etaSeconds < 60)
+        snprintf(eta, sizeof(eta), "estimated start in less than a minute");
+    else if(resp.etaSeconds < 3600)
+        snprintf(eta, sizeof(eta), "estimated start in %ld min", static_cast<long>(resp.etaSeconds / 60));
+    else
+        snprintf(eta, sizeof(eta), "estimated start in %ld h %ld min", static_cast<long>(resp.etaSeconds / 3600), static_cast<long>(resp.etaSeconds % 3600 / 60));
+
+    char text[128];
+    snprintf(text, sizeof(text), "gpu: Position %u of %u in the queue, %s\n", resp.queuePosition, resp.queueLength, eta);
+
+    if(text == last)
+        return;
+
+    fputs(text, stdout);
+    fflush(stdout);
+    last = text;
+}
+
+// Cluster mode: queue with the coordinator, which picks a node for us
+std::string placeOnCluster(const std::string& coordinator, std::uint32_t numGPUs)
+{
+    int fd = connectTCP(coordinator, 5000ms);
+    if(fd < 0)
+    {
+        fprintf(stderr, "gpu: Could not reach the cluster coordinator. Please contact the system administrators.\n");
+        std::exit(1);
+    }
+
+    std::vector<std::byte> buffer;
+    if(!sendMessage(fd, CoordinatorMessage{ClusterClaimRequest{static_cast<std::uint32_t>(getuid()), numGPUs}}, buffer))
+    {
+        perror("Could not send data to the coordinator");
+        std::exit(1);
+    }
+
+    pollfd pfd{fd, POLLIN, 0};
+    if(poll(&pfd, 1, 500) == 0)
+        printf("gpu: Waiting for free cards in the cluster...\n");
+
+    // The coordinator drops our queue entry if we disconnect
+    FrameReader reader;
+    ClusterClaimResponse resp;
+    if(!receiveMessage(fd, resp, reader))
+    {
+        fprintf(stderr, "gpu: Lost connection to the cluster coordinator.\n");
+        std::exit(1);
+    }
+    close(fd);
+
+    if(!resp.error.empty())
+    {
+        fprintf(stderr, "Could not claim GPUs: %s\n", resp.error.c_str());
+        std::exit(1);
+    }
+
+    return resp.node;
+}
+
+std::string shellQuote(const std::string& str)
+{
+    std::string quoted = "'";
+    for(char c : str)
+    {
+        if(c == '\'')
+            quoted += "'\\''";
+        else
+            quoted += c;
+    }
+    quoted += "'";
+
+    return quoted;
+}
+
+// Continue on another node. The local gpu_server there does the actual claim.
+[[noreturn]] void runOnNode(const std::string& node, std::uint32_t numGPUs, std::uint32_t walltime, bool bestEffort,
+    const std::string& command, int argc, char** argv, int startOfRunArgs)
+{
+    std::error_code ec;
+    auto cwd = std::filesystem::current_path(ec);
+
+    // Do not ask the coordinator again on the other side
+    std::stringstream ss;
+    ss << "cd " << shellQuote(cwd.string()) << " && GPU_CLAIM_COORDINATOR= exec gpu -n " << numGPUs;
+    if(walltime != 0)
+        ss << " --time " << walltime << "s";
+    if(bestEffort)
+        ss << " --best-effort";
+    ss << " " << command;
+    for(int i = startOfRunArgs; i < argc; ++i)
+        ss << " " << shellQuote(argv[i]);
+    std::string remote = ss.str();
+
+    printf("gpu: Running on %s\n", node.c_str());
+    fflush(stdout);
+
+    std::vector<const char*> args{"ssh"};
+    if(isatty(STDIN_FILENO))
+        args.push_back("-t");
+    args.push_back(node.c_str());
+    args.push_back(remote.c_str());
+    args.push_back(nullptr);
+
+    execvp("ssh", const_cast<char**>(args.data()));
+    perror("Could not execute ssh");
+    std::exit(1);
+}
+
+// Claim cards for gpu run and gpu exec. The claim is held by the connection.
+// If the server restarts while we wait, reconnect and keep our place in the
+// queue. Exits on failure.
+ClaimResponse waitForClaim(std::unique_ptr<Connection>& conn, const Request& req)
+{
+    ClaimResponse resp;
+    bool hadToWait = false;
+    std::string lastProgress;
+    for(int attempt = 0;; ++attempt)
+    {
+        if(conn->connected() && conn->trySend(req))
+        {
+            if(!hadToWait && !conn->waitForReply(500ms))
+            {
+                printf("gpu: Waiting for free cards...\n");
+                hadToWait = true;
+            }
+
+            bool received = false;
+            while((received = conn->tryReceive(resp)) && resp.queuePosition != 0)
+                printQueueProgress(resp, lastProgress);
+
+            if(received)
+                break;
+        }
+
+        if(attempt == RECONNECT_ATTEMPTS)
+        {
+            fprintf(stderr, "gpu: Lost connection to gpu_server. Please contact the system administrators.\n");
+            std::exit(1);
+        }
+
+        if(attempt == 0)
+            printf("gpu: Lost connection to gpu_server, reconnecting...\n");
+
+        std::this_thread::sleep_for(1s);
+        conn = std::make_unique<Connection>(false);
+    }
+
+    if(resp.claimedCards.empty())
+    {
+        fprintf(stderr, "Could not claim GPUs: %s\n", resp.error.c_str());
+        std::exit(1);
+    }
+
+    if(hadToWait)
+        printf("gpu: Success! Starting user command.\n");
+
+    return resp;
+}
+
+// Environment of gpu run and gpu exec jobs
+void setJobEnvironment(const std::vector<Card>& cards)
+{
+    setenv("CUDA_VISIBLE_DEVICES", visibleDevices(cards).c_str(), 1);
+
+    // This shows up in the standard Debian/Ubuntu shell prompt
+    setenv("debian_chroot", "GPU shell", 1);
+}
+
 int main(int argc, char** argv)
 {
     namespace po = boost::program_options;
@@ -130,11 +690,22 @@ int main(int argc, char** argv)
     desc.add_options()
         ("help,h", "Help")
         ("num-cards,n", po::value<unsigned int>()->default_value(1)->value_name("N"), "Number of GPUs to claim")
+        ("memory,m", po::value<std::string>()->value_name("SIZE"), "Only reserve SIZE (e.g. 4G) of GPU memory, sharing the card with other small jobs")
+        ("mig", po::value<std::string>()->value_name("PROFILE"), "Claim a MIG slice (e.g. 1g.10gb) instead of a whole card")
+        ("time,t", po::value<std::string>()->value_name("TIME"), "Time limit (e.g. 90m, 2h, 1d; plain numbers are minutes). The job is terminated afterwards.")
+        ("best-effort", "Use idle cards beyond the per-user limit, but give them up (SIGTERM) when others need them")
+        ("tasks,k", po::value<unsigned int>()->default_value(1)->value_name("K"), "gpu array: Number of tasks")
+        ("parallel,j", po::value<unsigned int>()->default_value(0)->value_name("J"), "gpu array: Maximum number of tasks running at the same time (0: no limit)")
+        ("watch,w", "gpu status: Keep running and update the display on changes")
+        ("history", "gpu status: Show utilization history")
+        ("cluster", "gpu status: Show all nodes of the cluster")
+        ("coordinator", po::value<std::string>()->value_name("HOST:PORT"), "Cluster coordinator (default: $GPU_CLAIM_COORDINATOR). gpu run then starts the job on any node with free cards.")
     ;
 
     po::options_description hidden{"Hidden"};
     hidden.add_options()
         ("command", po::value<std::string>()->default_value("status"), "Command")
+        ("subcommand", po::value<std::string>()->default_value(""), "Subcommand")
     ;
 
     po::options_description allOptions;
@@ -142,6 +713,7 @@ int main(int argc, char** argv)
 
     po::positional_options_description p;
     p.add("command", 1);
+    p.add("subcommand", 1);
 
     po::variables_map vm;
 
@@ -151,7 +723,7 @@ int main(int argc, char** argv)
     {
         for(int i = 1; i < argc; ++i)
         {
-            if(strcmp(argv[i], "run") == 0)
+            if(strcmp(argv[i], "run") == 0 || strcmp(argv[i], "exec") == 0 || strcmp(argv[i], "array") == 0)
             {
                 startOfRunArgs = i + 1;
                 break;
@@ -165,12 +737,25 @@ int main(int argc, char** argv)
     {
         fprintf(stderr, "Usage: gpu <command> [options]\n"
             "Available commands:\n"
-            "  gpu status:\n"
+            "  gpu status [--watch|--history]:\n"
             "    List current GPU allocation & status\n"
             "  gpu claim:\n"
             "    Claim one or more GPUs\n"
             "  gpu run [options] <cmd>:\n"
             "    Run cmd one or more GPUs. Use gpu run -nX <cmd> to use multiple GPUs.\n"
+            "    Use gpu run -m 4G <cmd> for small jobs that can share a card,\n"
+            "    or gpu run --mig 1g.10gb <cmd> for a MIG slice.\n"
+            "    gpu run --best-effort <cmd> uses idle cards beyond your limit, but\n"
+            "    is terminated when others need them. --time limits the runtime.\n"
+            "    With a coordinator, the job runs on any node of the cluster.\n"
+            "  gpu exec [options] <cmd>:\n"
+            "    Like gpu run, but replace the gpu process with cmd. The cards are\n"
+            "    released when cmd exits.\n"
+            "  gpu array -k K [-j J] [-n N] <cmd>:\n"
+            "    Run K instances of cmd with N GPUs each, at most J at a time.\n"
+            "    {} in the arguments and $GPU_ARRAY_TASK_ID are replaced by the task number.\n"
+            "  gpu debug stats:\n"
+            "    Show where the server spends its time\n"
             "\n"
             "Available options:\n"
         );
@@ -181,68 +766,145 @@ int main(int argc, char** argv)
     po::notify(vm);
 
     std::string command = vm["command"].as<std::string>();
+
+    std::uint64_t memory = 0;
+    if(vm.count("memory"))
+        memory = parseMemory(vm["memory"].as<std::string>());
+
+    std::string migProfile;
+    if(vm.count("mig"))
+        migProfile = vm["mig"].as<std::string>();
+
+    std::uint32_t walltime = 0;
+    if(vm.count("time"))
+        walltime = parseDuration(vm["time"].as<std::string>());
+
+    bool bestEffort = vm.count("best-effort") != 0;
+
+    std::string coordinator;
+    if(vm.count("coordinator"))
+        coordinator = vm["coordinator"].as<std::string>();
+    else if(const char* env = getenv("GPU_CLAIM_COORDINATOR"))
+        coordinator = env;
+
     if(command == "status")
     {
-        Connection conn;
+        if(vm.count("cluster"))
+        {
+            if(coordinator.empty())
+            {
+                fprintf(stderr, "No coordinator configured, use --coordinator.\n");
+                return 1;
+            }
 
-        Request req{StatusRequest{}};
-        conn.send(req);
+            int fd = connectTCP(coordinator, 5000ms);
+            if(fd < 0)
+                return 1;
 
-        StatusResponse resp;
-        conn.receive(resp);
+            std::vector<std::byte> buffer;
+            FrameReader reader;
+            ClusterStatusResponse resp;
+            if(!sendMessage(fd, CoordinatorMessage{ClusterStatusRequest{}}, buffer) || !receiveMessage(fd, resp, reader))
+            {
+                fprintf(stderr, "Could not query the cluster coordinator.\n");
+                return 1;
+            }
+            close(fd);
 
-        auto now = std::chrono::steady_clock::now();
+            // Idle times are relative to the coordinator clock
+            auto offset = std::chrono::steady_clock::now() - resp.now;
+            for(auto& node : resp.nodes)
+            {
+                printf("%s:\n", node.name.c_str());
+                for(auto& card : node.cards)
+                    card.lastUsageTime += offset;
+                printStatus(node.cards);
+                printf("\n");
+            }
+            printf("%u jobs waiting in the cluster queue.\n", resp.queueLength);
+            return 0;
+        }
 
-        for(std::size_t i = 0; i < resp.cards.size(); ++i)
+        if(vm.count("history"))
         {
-            auto& card = resp.cards[i];
+            auto cards = queryStatus();
 
-            printf("[%lu] %s | %2d%% | %6lu / %6lu MB |",
-                i, card.name.c_str(),
-                card.computeUsagePercent,
-                card.memoryUsage / 1000000UL, card.memoryTotal / 1000000UL
-            );
+            Connection conn;
+            conn.send(Request{HistoryRequest{}});
 
-            struct passwd *pws;
-            pws = getpwuid(card.reservedByUID);
-            if(card.reservedByUID == 0 || !pws)
-                printf("%22s |", "free");
-            else
-            {
-                auto idleTime = now - card.lastUsageTime;
-                auto minutes = std::chrono::duration_cast<std::chrono::minutes>(idleTime);
+            HistoryResponse resp;
+            conn.receive(resp);
 
-                bool used = std::ranges::any_of(card.processes, [&](auto& proc){
-                    return proc.uid == card.reservedByUID;
-                });
+            printHistory(resp, cards);
+            return 0;
+        }
 
-                if(used)
-                    printf("%10s   (running) |", pws->pw_name);
-                else
-                    printf("%10s (idle %ldmin) |", pws->pw_name, minutes.count());
-            }
+        if(!vm.count("watch"))
+        {
+            printStatus(queryStatus());
+            return 0;
+        }
 
-            for(auto& proc : card.processes)
+        auto conn = std::make_unique<Connection>();
+        std::vector<Card> cards;
+        bool drawn = false;
+
+        // Stay subscribed and redraw in place on every update. The server
+        // drops subscribers which fall behind (or restarts), then we
+        // resubscribe to get a fresh snapshot.
+        for(int attempt = 0; ; ++attempt)
+        {
+            StatusResponse resp;
+            if(conn->connected() && conn->trySend(Request{SubscribeRequest{}}) && conn->tryReceive(resp))
             {
-                struct passwd *pws;
-                pws = getpwuid(proc.uid);
+                attempt = 0;
+                if(drawn)
+                    printf("\033[%zuA", cards.size());
+
+                cards = std::move(resp.cards);
+                printStatus(cards, true);
+                fflush(stdout);
+                drawn = true;
+
+                StatusUpdate update;
+                while(conn->tryReceive(update))
+                {
+                    for(auto& delta : update.changes)
+                        applyDelta(cards, delta);
+
+                    // Move cursor back up to the first card
+                    printf("\033[%zuA", cards.size());
+                    printStatus(cards, true);
+                    fflush(stdout);
+                }
+            }
 
-                printf(" %s(%luM)",
-                    pws->pw_name, proc.memory / 1000000UL
-                );
+            if(attempt == RECONNECT_ATTEMPTS)
+            {
+                fprintf(stderr, "gpu: Lost connection to gpu_server. Please contact the system administrators.\n");
+                return 1;
             }
-            printf("\n");
+
+            if(attempt != 0)
+                std::this_thread::sleep_for(1s);
+            conn = std::make_unique<Connection>(false);
         }
     }
     else if(command == "claim")
     {
         Connection conn;
 
-        Request req{ClaimRequest{vm["num-cards"].as<unsigned int>(), true}};
+        Request req{ClaimRequest{vm["num-cards"].as<unsigned int>(), true, false, memory, migProfile, true, walltime, bestEffort}};
         conn.send(req);
 
         ClaimResponse resp;
+        std::string lastProgress;
         conn.receive(resp);
+        while(resp.queuePosition != 0)
+        {
+            printQueueProgress(resp, lastProgress);
+            conn.receive(resp);
+        }
 
         if(resp.claimedCards.empty())
         {
@@ -265,126 +927,291 @@ int main(int argc, char** argv)
         }
         printf("\n");
     }
-    else if(command == "run")
+    else if(command == "run" || command == "exec")
     {
-        namespace fs = std::filesystem;
-
         if(startOfRunArgs == argc)
         {
             fprintf(stderr, "Need command to run.\n");
             return 1;
         }
 
-        std::string executable = argv[startOfRunArgs];
+        std::string executable = findExecutable(argv[startOfRunArgs]);
 
-        // If the executable is not absolute, look it up
-        if(executable[0] != '/')
-        {
-            char* path = strdup(getenv("PATH"));
+        std::uint32_t nGPUs = vm["num-cards"].as<unsigned int>();
 
-            for(char* dir = strtok(path, ":"); dir; dir = strtok(NULL, ":"))
+        if(!coordinator.empty())
+        {
+            if(memory != 0 || !migProfile.empty())
             {
-                fs::path p = fs::path(dir) / executable;
-                if(fs::exists(p))
-                    executable = p.string();
+                fprintf(stderr, "--memory and --mig are not supported in cluster mode.\n");
+                return 1;
             }
 
-            free(path);
-        }
-
-        std::uint32_t nGPUs = vm["num-cards"].as<unsigned int>();
-
-        ClaimResponse resp;
-        {
-            Connection conn;
+            std::string node = placeOnCluster(coordinator, nGPUs);
 
-            Request req{ClaimRequest{nGPUs, true}};
-            conn.send(req);
+            char host[256]{};
+            gethostname(host, sizeof(host) - 1);
+            if(node != host)
+                runOnNode(node, nGPUs, walltime, bestEffort, command, argc, argv, startOfRunArgs);
+        }
 
-            bool hadToWait = false;
-            if(!conn.waitForReply(500ms))
-            {
-                printf("gpu: Waiting for free cards...\n");
-                hadToWait = true;
-            }
+        // This connection stays open until the job has finished. If we die,
+        // the server notices and releases the cards right away.
+        auto conn = std::make_unique<Connection>();
+        auto resp = waitForClaim(conn, Request{ClaimRequest{nGPUs, true, true, memory, migProfile, true, walltime, bestEffort}});
 
-            conn.receive(resp);
+        setJobEnvironment(resp.claimedCards);
+        fflush(stdout);
 
-            if(resp.claimedCards.empty())
+        // Become the job. It inherits the connection, so the server releases
+        // the cards once the job (and anything that kept the fd) has exited.
+        if(command == "exec")
+        {
+            int flags = fcntl(conn->fd(), F_GETFD);
+            if(flags < 0 || fcntl(conn->fd(), F_SETFD, flags & ~FD_CLOEXEC) != 0)
             {
-                fprintf(stderr, "Could not claim GPUs: %s\n", resp.error.c_str());
+                perror("Could not pass on the gpu_server connection");
                 return 1;
             }
 
-            if(hadToWait)
-                printf("gpu: Success! Starting user command.\n");
+            execv(executable.c_str(), argv + startOfRunArgs);
+            perror("Could not execute command");
+            return 1;
         }
 
-        std::stringstream ss;
-        for(std::size_t i = 0; i < resp.claimedCards.size(); ++i)
+        // argv is null-terminated, so the command line can be passed as is.
+        // posix_spawn() uses vfork semantics, nothing is copied.
+        pid_t pid = 0;
+        if(int err = posix_spawn(&pid, executable.c_str(), nullptr, nullptr, argv + startOfRunArgs, environ))
         {
-            ss << resp.claimedCards[i].uuid;
-            if(i != resp.claimedCards.size()-1)
-                ss << ",";
+            fprintf(stderr, "Could not execute command: %s\n", strerror(err));
+            return 1;
         }
-        std::string devicesString = ss.str();
-
-
 
-        int pid = fork();
-        if(pid < 0)
+        int status = 0;
+        if(waitpid(pid, &status, 0) < 0)
         {
-            perror("Could not fork");
-            std::abort();
+            perror("Could not wait for child process");
+            std::exit(1);
         }
 
-        if(pid == 0)
         {
-            setenv("CUDA_VISIBLE_DEVICES", devicesString.c_str(), 1);
-
-            // This shows up in the standard Debian/Ubuntu shell prompt
-            setenv("debian_chroot", "GPU shell", 1);
+            ReleaseRequest params;
+            for(auto& card : resp.claimedCards)
+            {
+                if(card.migSlices.empty())
+                    params.gpus.push_back(card.index);
+                else
+                    params.migSlices.push_back(card.uuid);
+            }
 
-            std::vector<char*> args;
-            for(int i = startOfRunArgs; i < argc; ++i)
-                args.push_back(strdup(argv[i]));
-            args.push_back(nullptr);
+            Request req{params};
 
-            if(execv(executable.c_str(), args.data()) != 0)
+            // A restarted server releases the cards by itself once our
+            // processes are gone, so errors do not matter after reconnecting.
+            ReleaseResponse resp;
+            bool reconnected = false;
+            while(!conn->trySend(req) || !conn->tryReceive(resp))
             {
-                perror("Could not execute command");
-                std::exit(1);
+                if(reconnected)
+                    return 0;
+
+                std::this_thread::sleep_for(1s);
+                conn = std::make_unique<Connection>(false);
+                if(!conn->connected())
+                    return 0;
+                reconnected = true;
             }
 
-            // Should not reach here
-            std::abort();
+            if(!resp.errors.empty() && !reconnected)
+            {
+                fprintf(stderr, "Could not release GPUs:\n%s\n", resp.errors.c_str());
+                return 1;
+            }
+        }
+    }
+    else if(command == "array")
+    {
+        if(startOfRunArgs == argc)
+        {
+            fprintf(stderr, "Need command to run.\n");
+            return 1;
         }
 
-        int status = 0;
-        if(waitpid(pid, &status, 0) < 0)
+        std::string executable = findExecutable(argv[startOfRunArgs]);
+        std::uint32_t numTasks = vm["tasks"].as<unsigned int>();
+        std::uint32_t nGPUs = vm["num-cards"].as<unsigned int>();
+
+        if(memory != 0 || !migProfile.empty())
         {
-            perror("Could not wait for child process");
-            std::exit(1);
+            fprintf(stderr, "--memory and --mig are not supported for gpu array.\n");
+            return 1;
         }
 
+        // Child exits arrive through a signalfd next to the server connection
+        sigset_t mask;
+        sigset_t oldMask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGCHLD);
+        sigprocmask(SIG_BLOCK, &mask, &oldMask);
+        int sigFD = signalfd(-1, &mask, SFD_CLOEXEC);
+        if(sigFD < 0)
         {
-            Connection conn;
+            perror("Could not create signalfd");
+            return 1;
+        }
 
-            ReleaseRequest params;
-            for(auto& card : resp.claimedCards)
-                params.gpus.push_back(card.index);
+        // Tasks start with the original signal mask
+        posix_spawnattr_t spawnAttr;
+        posix_spawnattr_init(&spawnAttr);
+        posix_spawnattr_setsigmask(&spawnAttr, &oldMask);
+        posix_spawnattr_setflags(&spawnAttr, POSIX_SPAWN_SETSIGMASK);
 
-            Request req{params};
-            conn.send(req);
+        // Reused for every task
+        std::vector<std::string> args;
+        std::vector<char*> argPointers;
 
-            ReleaseResponse resp;
-            conn.receive(resp);
+        // One connection for all tasks. If we die, the server releases
+        // all of their cards.
+        Connection conn;
+        conn.send(Request{ArrayClaimRequest{numTasks, nGPUs, vm["parallel"].as<unsigned int>()}});
 
-            if(!resp.errors.empty())
+        std::unordered_map<pid_t, std::uint32_t> running; // pid -> task
+        std::uint32_t finished = 0;
+        std::uint32_t failed = 0;
+        bool connected = true;
+        bool starting = true; // the server may start further tasks
+
+        while(finished < numTasks && ((connected && starting) || !running.empty()))
+        {
+            pollfd fds[2] = {
+                {connected ? conn.fd() : -1, POLLIN, 0},
+                {sigFD, POLLIN, 0}
+            };
+            if(poll(fds, 2, -1) < 0)
             {
-                fprintf(stderr, "Could not release GPUs:\n%s\n", resp.errors.c_str());
+                if(errno == EINTR)
+                    continue;
+                perror("Could not poll()");
                 return 1;
             }
+
+            if(fds[0].revents)
+            {
+                ArrayTaskStart start;
+                if(!conn.tryReceive(start))
+                {
+                    fprintf(stderr, "gpu: Lost connection to gpu_server, no further tasks will be started.\n");
+                    connected = false;
+                }
+                else if(!start.error.empty())
+                {
+                    fprintf(stderr, "Could not claim GPUs: %s\n", start.error.c_str());
+                    starting = false;
+                }
+                else
+                {
+                    std::string devicesString = visibleDevices(start.claimedCards);
+                    std::string taskID = std::to_string(start.task);
+
+                    // Inherited by the task, we do not need them ourselves
+                    setenv("CUDA_VISIBLE_DEVICES", devicesString.c_str(), 1);
+                    setenv("GPU_ARRAY_TASK_ID", taskID.c_str(), 1);
+
+                    args.clear();
+                    for(int i = startOfRunArgs; i < argc; ++i)
+                    {
+                        std::string& arg = args.emplace_back(argv[i]);
+                        for(std::size_t pos; (pos = arg.find("{}")) != std::string::npos;)
+                            arg.replace(pos, 2, taskID);
+                    }
+
+                    argPointers.clear();
+                    for(auto& arg : args)
+                        argPointers.push_back(arg.data());
+                    argPointers.push_back(nullptr);
+
+                    fflush(stdout);
+
+                    pid_t pid = 0;
+                    if(int err = posix_spawn(&pid, executable.c_str(), nullptr, &spawnAttr, argPointers.data(), environ))
+                    {
+                        fprintf(stderr, "gpu: Could not execute task %u: %s\n", start.task, strerror(err));
+                        ++finished;
+                        ++failed;
+
+                        if(connected && !conn.trySend(Request{ArrayTaskDone{start.task}}))
+                        {
+                            fprintf(stderr, "gpu: Lost connection to gpu_server, no further tasks will be started.\n");
+                            connected = false;
+                        }
+                    }
+                    else
+                    {
+                        printf("gpu: Task %u started on %s\n", start.task, devicesString.c_str());
+                        running[pid] = start.task;
+                    }
+                }
+            }
+
+            if(fds[1].revents)
+            {
+                signalfd_siginfo info;
+                if(read(sigFD, &info, sizeof(info)) < 0)
+                {
+                    perror("Could not read from signalfd");
+                    return 1;
+                }
+
+                // Signals coalesce, so collect everything that exited
+                int status = 0;
+                while(pid_t pid = waitpid(-1, &status, WNOHANG))
+                {
+                    if(pid < 0)
+                        break;
+
+                    auto it = running.find(pid);
+                    if(it == running.end())
+                        continue;
+
+                    std::uint32_t task = it->second;
+                    running.erase(it);
+                    ++finished;
+
+                    if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                    {
+                        printf("gpu: Task %u failed\n", task);
+                        ++failed;
+                    }
+
+                    if(connected && !conn.trySend(Request{ArrayTaskDone{task}}))
+                    {
+                        fprintf(stderr, "gpu: Lost connection to gpu_server, no further tasks will be started.\n");
+                        connected = false;
+                    }
+                }
+            }
+        }
+
+        posix_spawnattr_destroy(&spawnAttr);
+
+        printf("gpu: %u of %u tasks finished, %u failed.\n", finished, numTasks, failed);
+        return (finished == numTasks && failed == 0) ? 0 : 1;
+    }
+    else if(command == "debug" && vm["subcommand"].as<std::string>() == "stats")
+    {
+        Connection conn;
+        conn.send(Request{DebugStatsRequest{}});
+
+        DebugStatsResponse resp;
+        conn.receive(resp);
+
+        printf("%-40s %10s %10s %10s %10s %10s\n", "", "count", "mean [us]", "p50 [us]", "p99 [us]", "max [us]");
+        for(auto& stat : resp.stats)
+        {
+            printf("%-40s %10lu %10.1f %10.1f %10.1f %10.1f\n",
+                stat.name.c_str(), stat.count, 1e6 * stat.mean, 1e6 * stat.p50, 1e6 * stat.p99, 1e6 * stat.max
+            );
         }
     }
     else
@@ -0,0 +1,85 @@
+// Conversion between Card and the compact status representation
+// Author: Max Schwarz <max.schwarz@ais.uni-bonn.de>
+
+#ifndef COMPACT_H
+#define COMPACT_H
+
+#include "protocol.h"
+
+inline CardInfo cardInfo(const Card& card)
+{
+    return CardInfo{card.index, card.minorID, card.name, card.uuid, card.memoryTotal};
+}
+
+inline CardState cardState(const Card& card)
+{
+    CardState state;
+    state.computeUsagePercent = card.computeUsagePercent;
+    state.memoryUsage = card.memoryUsage;
+    state.reservedByUID = card.reservedByUID;
+    state.lastUsageTime = std::chrono::duration_cast<std::chrono::milliseconds>(
+        card.lastUsageTime.time_since_epoch()
+    ).count();
+
+    state.processes.reserve(card.processes.size());
+    for(auto& proc : card.processes)
+    {
+        state.processes.push_back(CompactProcess{
+            static_cast<std::uint32_t>(proc.uid),
+            static_cast<std::uint32_t>(proc.pid),
+            proc.memory
+        });
+    }
+
+    state.tenants.reserve(card.tenants.size());
+    for(auto& tenant : card.tenants)
+        state.tenants.push_back(CompactTenant{static_cast<std::uint32_t>(tenant.uid), tenant.memory});
+
+    state.migSlices.reserve(card.migSlices.size());
+    for(auto& slice : card.migSlices)
+        state.migSlices.push_back(CompactSlice{slice.profile, static_cast<std::uint32_t>(slice.reservedByUID)});
+
+    state.healthy = card.healthy;
+
+    return state;
+}
+
+inline Card expandCard(const CardInfo& info, const CardState& state)
+{
+    Card card;
+    card.index = info.index;
+    card.minorID = info.minorID;
+    card.name = info.name;
+    card.uuid = info.uuid;
+    card.memoryTotal = info.memoryTotal;
+
+    card.computeUsagePercent = state.computeUsagePercent;
+    card.memoryUsage = state.memoryUsage;
+    card.reservedByUID = static_cast<std::uint32_t>(state.reservedByUID);
+    card.lastUsageTime = std::chrono::steady_clock::time_point{
+        std::chrono::milliseconds{static_cast<std::uint64_t>(state.lastUsageTime)}
+    };
+
+    card.processes.reserve(state.processes.size());
+    for(auto& proc : state.processes)
+    {
+        auto& p = card.processes.emplace_back();
+        p.uid = static_cast<std::uint32_t>(proc.uid);
+        p.pid = static_cast<std::uint32_t>(proc.pid);
+        p.memory = proc.memory;
+    }
+
+    card.tenants.reserve(state.tenants.size());
+    for(auto& tenant : state.tenants)
+        card.tenants.push_back(Tenant{static_cast<int>(static_cast<std::uint32_t>(tenant.uid)), tenant.memory});
+
+    card.migSlices.reserve(state.migSlices.size());
+    for(auto& slice : state.migSlices)
+        card.migSlices.push_back(MigSlice{slice.profile, {}, static_cast<int>(static_cast<std::uint32_t>(slice.reservedByUID))});
+
+    card.healthy = state.healthy;
+
+    return card;
+}
+
+#endif
@@ -0,0 +1,548 @@
+// Central scheduler for cluster mode
+// Author: Max Schwarz <max.schwarz@ais.uni-bonn.de>
+
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <array>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <iostream>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include <zpp_bits.h>
+
+#include <boost/program_options.hpp>
+
+#include "protocol.h"
+#include "compact.h"
+#include "priority_queue.h"
+#include "tcp.h"
+
+namespace
+{
+    template<class... Ts> struct overloaded : Ts... { using Ts::operator()...; };
+    template<class... Ts> overloaded(Ts...) -> overloaded<Ts...>;
+}
+
+struct Connection
+{
+    int fd = -1;
+    FrameReader reader;
+    std::vector<std::byte> sendBuffer;
+
+    std::string peer; // numeric address
+    std::string node; // non-empty for node agents
+    std::int64_t jobID = -1; // queued ClusterClaimRequest
+
+    bool pendingDelete = false;
+
+    explicit Connection(int fd)
+     : fd{fd}
+    {}
+
+    ~Connection()
+    {
+        if(fd >= 0)
+            close(fd);
+    }
+
+    void send(auto&& msg)
+    {
+        if(!sendMessage(fd, msg, sendBuffer))
+            perror("Could not send response");
+    }
+};
+
+struct Node
+{
+    Connection* connection = nullptr;
+    std::uint64_t generation = 0;
+    std::vector<CardInfo> info;
+    std::vector<Card> cards;
+
+    // Jobs sent to the node which have not claimed their cards yet
+    struct Placement
+    {
+        int uid = 0;
+        std::size_t claimedBefore = 0; // cards of uid at placement time
+        std::size_t numGPUs = 0;
+        std::chrono::steady_clock::time_point time;
+    };
+    std::vector<Placement> placements;
+};
+
+std::vector<std::unique_ptr<Connection>> g_connections;
+std::map<std::string, Node> g_nodes;
+PriorityQueue g_queue;
+std::unordered_map<std::int64_t, Connection*> g_waiting; // job ID -> client
+std::int64_t g_nextJobID = 1;
+std::chrono::steady_clock::duration g_placementTimeout = std::chrono::seconds{30};
+std::string g_secret; // required in NodeHello, empty: anybody may register nodes
+
+// Does not leak the position of the first mismatch through timing
+bool secretMatches(const std::string& secret)
+{
+    if(secret.size() != g_secret.size())
+        return false;
+
+    unsigned char diff = 0;
+    for(std::size_t i = 0; i < secret.size(); ++i)
+        diff |= secret[i] ^ g_secret[i];
+
+    return diff == 0;
+}
+
+std::size_t claimedBy(const Node& node, int uid)
+{
+    return std::ranges::count_if(node.cards, [&](auto& card){ return card.reservedByUID == uid; });
+}
+
+// Free cards minus the ones promised to placed jobs
+std::size_t availableCards(const Node& node)
+{
+    std::size_t free = std::ranges::count_if(node.cards, [](auto& card){
+        return card.healthy && card.reservedByUID == 0 && card.tenants.empty() && card.migSlices.empty();
+    });
+
+    std::size_t pending = 0;
+    for(auto& placement : node.placements)
+        pending += placement.numGPUs;
+
+    return free > pending ? free - pending : 0;
+}
+
+void expirePlacements(Node& node, const std::chrono::steady_clock::time_point& now)
+{
+    std::erase_if(node.placements, [&](auto& placement){
+        return now - placement.time > g_placementTimeout
+            || claimedBy(node, placement.uid) >= placement.claimedBefore + placement.numGPUs;
+    });
+}
+
+void scheduleDelete(Connection* connection)
+{
+    connection->pendingDelete = true;
+}
+
+// Some connected node has enough cards, even if they are busy right now
+bool fitsAnyNode(std::size_t numGPUs)
+{
+    return std::ranges::any_of(g_nodes, [&](auto& entry){
+        return entry.second.info.size() >= numGPUs;
+    });
+}
+
+// Answer the client of a queued job and forget it
+void finishJob(std::int64_t jobID, const ClusterClaimResponse& resp)
+{
+    auto it = g_waiting.find(jobID);
+    if(it == g_waiting.end())
+        return;
+
+    it->second->send(resp);
+    it->second->jobID = -1;
+    scheduleDelete(it->second);
+    g_waiting.erase(it);
+}
+
+void schedule()
+{
+    g_queue.update();
+
+    // Strict priority order: the head blocks everything behind it, the
+    // nodes do backfilling locally.
+    while(!g_queue.empty())
+    {
+        const Job& job = g_queue.front();
+
+        // The large node it was queued for went away. Without any nodes,
+        // wait for them to come back.
+        if(!g_nodes.empty() && !fitsAnyNode(job.numGPUs))
+        {
+            printf("Rejecting job %ld of UID %ld: no node has %ld GPUs\n", job.pid, job.uid, job.numGPUs);
+            finishJob(job.pid, ClusterClaimResponse{{}, "No node has " + std::to_string(job.numGPUs) + " GPUs"});
+            g_queue.pop_front();
+            continue;
+        }
+
+        // Best fit, keeps larger nodes free for larger jobs
+        Node* best = nullptr;
+        std::string bestName;
+        std::size_t bestAvailable = 0;
+        for(auto& [name, node] : g_nodes)
+        {
+            std::size_t available = availableCards(node);
+            if(available < static_cast<std::size_t>(job.numGPUs))
+                continue;
+
+            if(!best || available < bestAvailable)
+            {
+                best = &node;
+                bestName = name;
+                bestAvailable = available;
+            }
+        }
+
+        if(!best)
+            break;
+
+        best->placements.push_back(Node::Placement{
+            static_cast<int>(job.uid),
+            claimedBy(*best, job.uid),
+            static_cast<std::size_t>(job.numGPUs),
+            std::chrono::steady_clock::now()
+        });
+
+        printf("Placing job %ld of UID %ld (%ld GPUs) on %s\n", job.pid, job.uid, job.numGPUs, bestName.c_str());
+
+        finishJob(job.pid, ClusterClaimResponse{bestName, {}});
+        g_queue.pop_front();
+    }
+}
+
+// Charge claimed cards to their users, like gpu_server does locally
+void accountUsage(double hours)
+{
+    for(auto& [name, node] : g_nodes)
+    {
+        for(auto& card : node.cards)
+        {
+            if(card.reservedByUID != 0)
+                g_queue.accountUsage(card.reservedByUID, hours);
+            for(auto& tenant : card.tenants)
+                g_queue.accountUsage(tenant.uid, hours * tenant.memory / std::max<std::uint64_t>(card.memoryTotal, 1));
+        }
+    }
+}
+
+// Return false if the connection should be closed
+bool handle(Connection& connection, const CoordinatorMessage& msg)
+{
+    return std::visit(overloaded{
+        [&](const NodeHello& hello){
+            if(hello.name.empty() || !connection.node.empty())
+                return false;
+
+            if(!g_secret.empty() && !secretMatches(hello.secret))
+            {
+                fprintf(stderr, "Rejecting node %s from %s: wrong secret\n", hello.name.c_str(), connection.peer.c_str());
+                return false;
+            }
+
+            // A restarted gpu_server replaces its old connection, but nobody
+            // else may take over a connected node
+            auto it = g_nodes.find(hello.name);
+            if(it != g_nodes.end() && it->second.connection && it->second.connection != &connection)
+            {
+                auto* old = it->second.connection;
+                if(old->peer != connection.peer)
+                {
+                    fprintf(stderr, "Rejecting node %s from %s: already connected from %s\n",
+                        hello.name.c_str(), connection.peer.c_str(), old->peer.c_str()
+                    );
+                    return false;
+                }
+
+                printf("Node %s reconnected, dropping old connection\n", hello.name.c_str());
+                old->node.clear();
+                scheduleDelete(old);
+            }
+
+            auto& node = g_nodes[hello.name];
+
+            if(node.generation != hello.generation)
+                node.placements.clear();
+
+            node.connection = &connection;
+            node.generation = hello.generation;
+            node.info = hello.info;
+            node.cards.clear();
+            connection.node = hello.name;
+
+            printf("Node %s connected from %s with %lu cards\n", hello.name.c_str(), connection.peer.c_str(), hello.info.size());
+            return true;
+        },
+        [&](const NodeUpdate& update){
+            auto it = g_nodes.find(connection.node);
+            if(it == g_nodes.end())
+                return false;
+
+            auto& node = it->second;
+            if(update.cards.size() != node.info.size())
+            {
+                fprintf(stderr, "Node %s sent %lu cards, expected %lu\n", connection.node.c_str(), update.cards.size(), node.info.size());
+                return false;
+            }
+
+            // Node clocks are unrelated to ours
+            auto now = std::chrono::steady_clock::now();
+            auto offset = now - std::chrono::steady_clock::time_point{std::chrono::milliseconds{update.now}};
+
+            node.cards.clear();
+            for(std::size_t i = 0; i < update.cards.size(); ++i)
+            {
+                auto& card = node.cards.emplace_back(expandCard(node.info[i], update.cards[i]));
+                card.lastUsageTime += offset;
+            }
+
+            expirePlacements(node, now);
+            return true;
+        },
+        [&](const ClusterClaimRequest& req){
+            if(connection.jobID >= 0 || !connection.node.empty())
+                return false;
+
+            if(req.numGPUs == 0)
+            {
+                connection.send(ClusterClaimResponse{{}, "Need at least one GPU"});
+                return true;
+            }
+
+            if(g_nodes.empty())
+            {
+                connection.send(ClusterClaimResponse{{}, "No nodes are connected to the coordinator"});
+                return true;
+            }
+
+            if(!fitsAnyNode(req.numGPUs))
+            {
+                connection.send(ClusterClaimResponse{{}, "No node has " + std::to_string(req.numGPUs) + " GPUs"});
+                return true;
+            }
+
+            Job job;
+            job.uid = req.uid;
+            job.pid = g_nextJobID++;
+            job.numGPUs = req.numGPUs;
+            job.submissionTime = std::chrono::system_clock::now();
+
+            connection.jobID = job.pid;
+            g_waiting[job.pid] = &connection;
+            g_queue.enqueue(std::move(job));
+            return true;
+        },
+        [&](const ClusterStatusRequest&){
+            ClusterStatusResponse resp;
+            for(auto& [name, node] : g_nodes)
+                resp.nodes.push_back(NodeStatus{name, node.cards});
+            resp.queueLength = g_queue.size();
+            resp.now = std::chrono::steady_clock::now();
+
+            connection.send(resp);
+            return true;
+        },
+    }, msg);
+}
+
+// Return false if the connection should be closed
+bool communicate(Connection& connection)
+{
+    ssize_t ret = connection.reader.fill(connection.fd);
+    if(ret <= 0)
+        return false;
+
+    while(auto frame = connection.reader.next())
+    {
+        CoordinatorMessage msg;
+        zpp::bits::in in{*frame};
+        if(zpp::bits::failure(in(msg)))
+        {
+            fprintf(stderr, "Could not decode message\n");
+            return false;
+        }
+
+        if(!handle(connection, msg))
+            return false;
+    }
+
+    return true;
+}
+
+void processDeleteList(int epollfd)
+{
+    for(std::size_t i = 0; i < g_connections.size();)
+    {
+        auto& connection = g_connections[i];
+        if(!connection->pendingDelete)
+        {
+            ++i;
+            continue;
+        }
+
+        if(epoll_ctl(epollfd, EPOLL_CTL_DEL, connection->fd, nullptr) != 0)
+            perror("Could not remove connection from epoll");
+
+        if(!connection->node.empty())
+        {
+            auto it = g_nodes.find(connection->node);
+            if(it != g_nodes.end() && it->second.connection == connection.get())
+            {
+                printf("Node %s disconnected\n", connection->node.c_str());
+                g_nodes.erase(it);
+            }
+        }
+
+        if(connection->jobID >= 0)
+        {
+            g_queue.remove(connection->jobID);
+            g_waiting.erase(connection->jobID);
+        }
+
+        std::swap(connection, g_connections.back());
+        g_connections.pop_back();
+    }
+}
+
+int main(int argc, char** argv)
+{
+    namespace po = boost::program_options;
+
+    po::options_description desc{"Options"};
+    desc.add_options()
+        ("help,h", "Help")
+        ("port", po::value<unsigned int>()->default_value(7777)->value_name("PORT"), "TCP port for node agents and clients")
+        ("listen-address", po::value<std::string>()->value_name("ADDR"), "Only listen on this address (default: all interfaces)")
+        ("secret-file", po::value<std::string>()->value_name("PATH"), "Nodes have to present the secret in this file (gpu_server --coordinator-secret-file)")
+        ("placement-timeout", po::value<unsigned int>()->default_value(30)->value_name("S"), "How long cards stay reserved for a placed job which has not claimed them yet")
+        ("fairshare-half-life", po::value<double>()->default_value(24.0)->value_name("HOURS"), "Half-life of GPU usage in the fair-share priority")
+    ;
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+
+    if(vm.count("help"))
+    {
+        std::cerr << "Usage: gpu_coordinator [options]\n" << desc << "\n";
+        return 1;
+    }
+
+    po::notify(vm);
+
+    g_placementTimeout = std::chrono::seconds{vm["placement-timeout"].as<unsigned int>()};
+    g_queue.setHalfLife(std::chrono::duration_cast<std::chrono::system_clock::duration>(
+        std::chrono::duration<double, std::ratio<3600>>{vm["fairshare-half-life"].as<double>()}
+    ));
+
+    if(vm.count("secret-file"))
+    {
+        auto secret = readSecret(vm["secret-file"].as<std::string>());
+        if(!secret)
+            return 1;
+
+        g_secret = *secret;
+    }
+    else
+        fprintf(stderr, "Warning: No --secret-file given, any host can register as a node.\n");
+
+    signal(SIGPIPE, SIG_IGN);
+
+    std::string listenAddress = vm.count("listen-address") ? vm["listen-address"].as<std::string>() : std::string{};
+    int sock = listenTCP(vm["port"].as<unsigned int>(), 128, listenAddress);
+    if(sock < 0)
+        return 1;
+
+    int epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if(epollfd < 0)
+    {
+        perror("Could not create epoll fd");
+        return 1;
+    }
+
+    {
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.ptr = &sock;
+        if(epoll_ctl(epollfd, EPOLL_CTL_ADD, sock, &ev) != 0)
+        {
+            perror("Could not add socket to epoll");
+            return 1;
+        }
+    }
+
+    printf("Listening on %s port %u.\n", listenAddress.empty() ? "all addresses" : listenAddress.c_str(), vm["port"].as<unsigned int>());
+
+    auto lastTick = std::chrono::steady_clock::now();
+
+    std::array<epoll_event, 20> events;
+    while(1)
+    {
+        int nfds = epoll_wait(epollfd, events.data(), events.size(), 1000);
+        if(nfds < 0)
+        {
+            if(errno == EINTR)
+                continue;
+
+            perror("epoll_wait() failed");
+            return 1;
+        }
+
+        for(int i = 0; i < nfds; ++i)
+        {
+            auto& ev = events[i];
+
+            if(ev.data.ptr == &sock)
+            {
+                int fd = accept4(sock, nullptr, nullptr, SOCK_CLOEXEC);
+                if(fd < 0)
+                {
+                    perror("Could not accept connection");
+                    continue;
+                }
+
+                // A stuck peer must not block the scheduler
+                timeval tv{};
+                tv.tv_sec = 5;
+                setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+                // We never send to nodes, a dead one is only noticed this way
+                enableKeepAlive(fd);
+
+                auto connection = std::make_unique<Connection>(fd);
+                connection->peer = peerAddress(fd);
+
+                epoll_event ev{};
+                ev.events = EPOLLIN;
+                ev.data.ptr = connection.get();
+                if(epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+                {
+                    perror("Could not add connection to epoll");
+                    continue;
+                }
+
+                g_connections.push_back(std::move(connection));
+            }
+            else
+            {
+                auto* connection = reinterpret_cast<Connection*>(ev.data.ptr);
+                if(!connection->pendingDelete && !communicate(*connection))
+                    scheduleDelete(connection);
+            }
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if(now - lastTick > std::chrono::seconds{1})
+        {
+            accountUsage(std::chrono::duration<double, std::ratio<3600>>{now - lastTick}.count());
+            for(auto& [name, node] : g_nodes)
+                expirePlacements(node, now);
+            lastTick = now;
+        }
+
+        processDeleteList(epollfd);
+        schedule();
+        processDeleteList(epollfd);
+    }
+
+    return 0;
+}
@@ -0,0 +1,120 @@
+// Connection of a node to gpu_coordinator
+// Author: Max Schwarz <max.schwarz@ais.uni-bonn.de>
+
+#include "coordinator_link.h"
+#include "log.h"
+#include "tcp.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace
+{
+    using namespace std::chrono_literals;
+
+    constexpr auto CONNECT_TIMEOUT = 2000ms;
+    constexpr auto RETRY_INTERVAL = 10s;
+
+    // How often an idle connection is checked for EOF
+    constexpr auto CHECK_INTERVAL = 1s;
+
+    // The coordinator never sends anything, so readable means closed
+    bool closedByPeer(int fd)
+    {
+        pollfd pfd{fd, POLLIN, 0};
+        if(poll(&pfd, 1, 0) <= 0)
+            return false;
+
+        char buf[256];
+        ssize_t ret = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+        return ret == 0 || (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
+    }
+}
+
+CoordinatorLink::CoordinatorLink(const std::string& address, const NodeHello& hello, NodeUpdate&& initial)
+ : m_address{address}
+ , m_hello{hello}
+ , m_latest{std::move(initial)}
+{
+    m_thread = std::jthread{[this](std::stop_token stop){ run(stop); }};
+}
+
+CoordinatorLink::~CoordinatorLink()
+{
+    m_thread.request_stop();
+    if(m_thread.joinable())
+        m_thread.join();
+}
+
+void CoordinatorLink::publish(NodeUpdate&& update)
+{
+    {
+        std::scoped_lock lock{m_mutex};
+        m_latest = std::move(update);
+        m_pending = true;
+    }
+    m_cond.notify_one();
+}
+
+void CoordinatorLink::run(std::stop_token stop)
+{
+    while(!stop.stop_requested())
+    {
+        int fd = connectTCP(m_address, CONNECT_TIMEOUT);
+        if(fd >= 0)
+        {
+            logInfo("Connected to coordinator %s as %s", m_address.c_str(), m_hello.name.c_str());
+            serve(fd, stop);
+            close(fd);
+        }
+
+        std::unique_lock lock{m_mutex};
+        m_cond.wait_for(lock, stop, RETRY_INTERVAL, []{ return false; });
+    }
+}
+
+void CoordinatorLink::serve(int fd, std::stop_token& stop)
+{
+    std::vector<std::byte> buffer;
+    if(!sendMessage(fd, CoordinatorMessage{m_hello}, buffer))
+    {
+        logError("Could not send to coordinator: %s", strerror(errno));
+        return;
+    }
+
+    // After (re)connecting, the coordinator does not know any card state
+    bool resend = true;
+    while(!stop.stop_requested())
+    {
+        NodeUpdate update;
+        {
+            std::unique_lock lock{m_mutex};
+            if(!resend && !m_cond.wait_for(lock, stop, CHECK_INTERVAL, [&]{ return m_pending; }))
+            {
+                lock.unlock();
+                if(closedByPeer(fd))
+                {
+                    logWarning("Lost connection to coordinator");
+                    return;
+                }
+                continue;
+            }
+
+            update = m_latest;
+            m_pending = false;
+        }
+        resend = false;
+
+        if(!sendMessage(fd, CoordinatorMessage{std::move(update)}, buffer))
+        {
+            logError("Lost connection to coordinator: %s", strerror(errno));
+            return;
+        }
+    }
+}
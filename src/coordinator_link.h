@@ -0,0 +1,48 @@
+// Connection of a node to gpu_coordinator
+// Author: Max Schwarz <max.schwarz@ais.uni-bonn.de>
+
+#ifndef COORDINATOR_LINK_H
+#define COORDINATOR_LINK_H
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "protocol.h"
+
+// Resolving, connecting and sending can all block on an unreachable or stuck
+// coordinator, so they happen in a background thread. The event loop only
+// hands over the latest card state and never waits for the network.
+class CoordinatorLink
+{
+public:
+    // address is host:port. The hello is sent on every (re)connect, followed
+    // by the latest update.
+    CoordinatorLink(const std::string& address, const NodeHello& hello, NodeUpdate&& initial);
+    ~CoordinatorLink();
+
+    CoordinatorLink(const CoordinatorLink&) = delete;
+    CoordinatorLink& operator=(const CoordinatorLink&) = delete;
+
+    // Replaces an update which has not been sent yet
+    void publish(NodeUpdate&& update);
+
+private:
+    void run(std::stop_token stop);
+
+    // Send updates until the connection fails or we are stopped
+    void serve(int fd, std::stop_token& stop);
+
+    std::string m_address;
+    NodeHello m_hello;
+
+    std::mutex m_mutex;
+    std::condition_variable_any m_cond;
+    NodeUpdate m_latest;
+    bool m_pending = false;
+
+    std::jthread m_thread;
+};
+
+#endif
@@ -0,0 +1,72 @@
+// Delta encoding of card state for status subscriptions
+// Author: Max Schwarz <max.schwarz@ais.uni-bonn.de>
+
+#ifndef DELTA_H
+#define DELTA_H
+
+#include "protocol.h"
+
+// Compute the changes from prev to cur. Cards are matched by position.
+inline std::vector<CardDelta> diffCards(const std::vector<Card>& prev, const std::vector<Card>& cur)
+{
+    std::vector<CardDelta> changes;
+
+    for(std::size_t i = 0; i < cur.size(); ++i)
+    {
+        const Card& c = cur[i];
+        const Card* p = i < prev.size() ? &prev[i] : nullptr;
+
+        CardDelta delta;
+        delta.index = c.index;
+        bool changed = false;
+
+        auto update = [&](auto& field, auto member){
+            if(!p || p->*member != c.*member)
+            {
+                field = c.*member;
+                changed = true;
+            }
+        };
+
+        update(delta.computeUsagePercent, &Card::computeUsagePercent);
+        update(delta.memoryUsage, &Card::memoryUsage);
+        update(delta.reservedByUID, &Card::reservedByUID);
+        update(delta.processes, &Card::processes);
+        update(delta.tenants, &Card::tenants);
+        update(delta.migSlices, &Card::migSlices);
+        update(delta.healthy, &Card::healthy);
+        update(delta.lastUsageTime, &Card::lastUsageTime);
+
+        if(changed)
+            changes.push_back(std::move(delta));
+    }
+
+    return changes;
+}
+
+inline void applyDelta(std::vector<Card>& cards, const CardDelta& delta)
+{
+    if(delta.index >= cards.size())
+        return;
+
+    Card& card = cards[delta.index];
+
+    if(delta.computeUsagePercent)
+        card.computeUsagePercent = *delta.computeUsagePercent;
+    if(delta.memoryUsage)
+        card.memoryUsage = *delta.memoryUsage;
+    if(delta.reservedByUID)
+        card.reservedByUID = *delta.reservedByUID;
+    if(delta.processes)
+        card.processes = *delta.processes;
+    if(delta.tenants)
+        card.tenants = *delta.tenants;
+    if(delta.migSlices)
+        card.migSlices = *delta.migSlices;
+    if(delta.healthy)
+        card.healthy = *delta.healthy;
+    if(delta.lastUsageTime)
+        card.lastUsageTime = *delta.lastUsageTime;
+}
+
+#endif
@@ -0,0 +1,109 @@
+// Latency histograms
+// Author: Max Schwarz <max.schwarz@ais.uni-bonn.de>
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Counts observations in buckets with exponentially growing upper bounds
+// (start, start*factor, ...) plus an overflow bucket, like a Prometheus
+// histogram. observe() is lock-free and may be called from any thread.
+class Histogram
+{
+public:
+    Histogram(double start, double factor, std::size_t numBounds)
+     : m_counts{std::make_unique<std::atomic<std::uint64_t>[]>(numBounds + 1)}
+    {
+        double bound = start;
+        for(std::size_t i = 0; i < numBounds; ++i, bound *= factor)
+            m_bounds.push_back(bound);
+    }
+
+    void observe(double value)
+    {
+        auto bucket = std::lower_bound(m_bounds.begin(), m_bounds.end(), value) - m_bounds.begin();
+        m_counts[bucket].fetch_add(1, std::memory_order_relaxed);
+        m_count.fetch_add(1, std::memory_order_relaxed);
+        m_sum.fetch_add(value, std::memory_order_relaxed);
+
+        double max = m_max.load(std::memory_order_relaxed);
+        while(value > max && !m_max.compare_exchange_weak(max, value, std::memory_order_relaxed))
+            ;
+    }
+
+    template<class Rep, class Period>
+    void observe(const std::chrono::duration<Rep, Period>& duration)
+    { observe(std::chrono::duration<double>{duration}.count()); }
+
+    // Upper bounds, the last bucket has no bound
+    [[nodiscard]] const std::vector<double>& bounds() const
+    { return m_bounds; }
+
+    // Observations in bucket idx (not cumulative), idx <= bounds().size()
+    [[nodiscard]] std::uint64_t bucket(std::size_t idx) const
+    { return m_counts[idx].load(std::memory_order_relaxed); }
+
+    [[nodiscard]] std::uint64_t count() const
+    { return m_count.load(std::memory_order_relaxed); }
+
+    [[nodiscard]] double sum() const
+    { return m_sum.load(std::memory_order_relaxed); }
+
+    [[nodiscard]] double max() const
+    { return m_max.load(std::memory_order_relaxed); }
+
+    // Upper bound of the bucket containing the q-quantile (0 <= q <= 1), so
+    // the error is at most the bucket growth factor.
+    [[nodiscard]] double quantile(double q) const
+    {
+        std::uint64_t total = count();
+        if(total == 0)
+            return 0.0;
+
+        auto rank = static_cast<std::uint64_t>(q * (total - 1)) + 1;
+        std::uint64_t cumulative = 0;
+        for(std::size_t i = 0; i < m_bounds.size(); ++i)
+        {
+            cumulative += bucket(i);
+            if(cumulative >= rank)
+                return std::min(m_bounds[i], max());
+        }
+
+        return max();
+    }
+
+private:
+    std::vector<double> m_bounds;
+    std::unique_ptr<std::atomic<std::uint64_t>[]> m_counts;
+    std::atomic<std::uint64_t> m_count{0};
+    std::atomic<double> m_sum{0.0};
+    std::atomic<double> m_max{0.0};
+};
+
+// Observes the lifetime of the scope in seconds
+class ScopedTimer
+{
+public:
+    explicit ScopedTimer(Histogram& histogram)
+     : m_histogram{histogram}
+     , m_start{std::chrono::steady_clock::now()}
+    {}
+
+    ~ScopedTimer()
+    { m_histogram.observe(std::chrono::steady_clock::now() - m_start); }
+
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+private:
+    Histogram& m_histogram;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+#endif
@@ -0,0 +1,329 @@
+// Crash-safe persistence of scheduler state
+// Author: Max Schwarz <max.schwarz@ais.uni-bonn.de>
+
+#include "journal.h"
+#include "log.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace
+{
+    using TimePoint = PersistentState::TimePoint;
+
+    std::int64_t toMs(const TimePoint& tp)
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(tp.time_since_epoch()).count();
+    }
+
+    TimePoint fromMs(std::int64_t ms)
+    {
+        return TimePoint{std::chrono::duration_cast<TimePoint::duration>(std::chrono::milliseconds{ms})};
+    }
+
+    // Apply one snapshot or event line. Returns false if it cannot be parsed.
+    bool applyLine(PersistentState& state, const std::string& line)
+    {
+        std::istringstream ss{line};
+        std::string kind;
+        if(!(ss >> kind) || kind.starts_with("#"))
+            return true;
+
+        if(kind == "claim" || kind == "tenant")
+        {
+            unsigned int card = 0;
+            PersistentState::Claim claim;
+            std::int64_t start = 0, used = 0;
+
+            if(!(ss >> card >> claim.uid))
+                return false;
+            if(kind == "tenant" && !(ss >> claim.memory))
+                return false;
+            if(!(ss >> start >> used >> claim.held))
+                return false;
+
+            // Written since time limits were introduced
+            if(kind == "claim" && !(ss >> claim.walltime >> claim.bestEffort))
+            {
+                claim.walltime = 0;
+                claim.bestEffort = false;
+            }
+
+            claim.claimStart = fromMs(start);
+            claim.lastUsage = fromMs(used);
+
+            if(kind == "claim")
+                state.claims[card] = claim;
+            else
+                state.tenants.emplace(card, claim);
+        }
+        else if(kind == "release")
+        {
+            unsigned int card = 0;
+            if(!(ss >> card))
+                return false;
+
+            state.claims.erase(card);
+        }
+        else if(kind == "untenant")
+        {
+            unsigned int card = 0;
+            int uid = 0;
+            if(!(ss >> card >> uid))
+                return false;
+
+            auto [begin, end] = state.tenants.equal_range(card);
+            for(auto it = begin; it != end; ++it)
+            {
+                if(it->second.uid == uid)
+                {
+                    state.tenants.erase(it);
+                    break;
+                }
+            }
+        }
+        else if(kind == "job")
+        {
+            Job job;
+            std::int64_t submission = 0;
+            std::string profile;
+            if(!(ss >> job.pid >> job.uid >> job.numGPUs >> job.memory >> submission >> profile))
+                return false;
+
+            job.submissionTime = fromMs(submission);
+            if(profile != "-")
+                job.migProfile = profile;
+
+            if(!(ss >> job.walltime >> job.bestEffort))
+            {
+                job.walltime = 0;
+                job.bestEffort = false;
+            }
+
+            state.queue[job.pid] = job;
+        }
+        else if(kind == "dequeue")
+        {
+            std::int64_t pid = 0;
+            if(!(ss >> pid))
+                return false;
+
+            state.queue.erase(pid);
+        }
+        else if(kind == "usage")
+        {
+            std::int64_t uid = 0;
+            double hours = 0.0;
+            if(!(ss >> uid >> hours))
+                return false;
+
+            state.usage[uid] = hours;
+        }
+        else if(kind == "runtime")
+        {
+            std::string who;
+            RuntimeEstimator::Average avg;
+            if(!(ss >> who >> avg.seconds >> avg.samples))
+                return false;
+
+            if(who == "global")
+                state.globalRuntime = avg;
+            else
+            {
+                try
+                {
+                    state.runtimes[std::stoll(who)] = avg;
+                }
+                catch(std::logic_error&)
+                {
+                    return false;
+                }
+            }
+        }
+        else
+            return false;
+
+        return true;
+    }
+
+    std::string claimLine(const char* kind, unsigned int card, const PersistentState::Claim& claim)
+    {
+        std::stringstream ss;
+        ss << kind << " " << card << " " << claim.uid;
+        if(std::string_view{kind} == "tenant")
+            ss << " " << claim.memory;
+        ss << " " << toMs(claim.claimStart) << " " << toMs(claim.lastUsage) << " " << claim.held;
+        if(std::string_view{kind} == "claim")
+            ss << " " << claim.walltime << " " << claim.bestEffort;
+        ss << "\n";
+        return ss.str();
+    }
+
+    std::string jobLine(const Job& job)
+    {
+        std::stringstream ss;
+        ss << "job " << job.pid << " " << job.uid << " " << job.numGPUs << " " << job.memory
+            << " " << toMs(job.submissionTime) << " " << (job.migProfile.empty() ? "-" : job.migProfile)
+            << " " << job.walltime << " " << job.bestEffort << "\n";
+        return ss.str();
+    }
+
+    bool writeAll(int fd, const std::string& data)
+    {
+        std::size_t written = 0;
+        while(written < data.size())
+        {
+            ssize_t ret = write(fd, data.data() + written, data.size() - written);
+            if(ret < 0)
+            {
+                if(errno == EINTR)
+                    continue;
+                return false;
+            }
+            written += ret;
+        }
+
+        return true;
+    }
+}
+
+Journal::Journal(const std::string& path)
+ : m_path{path}
+{
+    {
+        std::ifstream file{path};
+        std::string line;
+        for(int lineNo = 1; std::getline(file, line); ++lineNo)
+        {
+            if(!applyLine(m_recovered, line))
+                logWarning("%s:%d: ignoring invalid line", path.c_str(), lineNo);
+        }
+    }
+
+    m_fd = open(path.c_str(), O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if(m_fd < 0)
+        throw std::runtime_error{"Could not open state file " + path + ": " + strerror(errno)};
+
+    // Terminate a line torn by a crash, so that it does not swallow the next event
+    off_t size = lseek(m_fd, 0, SEEK_END);
+    char last = '\n';
+    if(size > 0 && pread(m_fd, &last, 1, size - 1) == 1 && last != '\n')
+        append("\n");
+}
+
+Journal::~Journal()
+{
+    if(m_fd >= 0)
+        close(m_fd);
+}
+
+void Journal::append(const std::string& line)
+{
+    // One write() per event, so that a crash cannot interleave lines
+    if(write(m_fd, line.data(), line.size()) != static_cast<ssize_t>(line.size()))
+        logError("Could not append to state file %s: %s", m_path.c_str(), strerror(errno));
+}
+
+void Journal::claim(unsigned int card, int uid, const TimePoint& start, bool held, std::uint32_t walltime, bool bestEffort)
+{
+    append(claimLine("claim", card, PersistentState::Claim{uid, 0, start, start, held, walltime, bestEffort}));
+}
+
+void Journal::release(unsigned int card)
+{
+    append("release " + std::to_string(card) + "\n");
+}
+
+void Journal::addTenant(unsigned int card, int uid, std::uint64_t memory, const TimePoint& start, bool held)
+{
+    append(claimLine("tenant", card, PersistentState::Claim{uid, memory, start, start, held}));
+}
+
+void Journal::removeTenant(unsigned int card, int uid)
+{
+    append("untenant " + std::to_string(card) + " " + std::to_string(uid) + "\n");
+}
+
+void Journal::enqueue(const Job& job)
+{
+    append(jobLine(job));
+}
+
+void Journal::dequeue(std::int64_t pid)
+{
+    append("dequeue " + std::to_string(pid) + "\n");
+}
+
+void Journal::compact(const PersistentState& state)
+{
+    std::stringstream ss;
+    ss << "# gpu_server state\n";
+
+    for(auto& [card, claim] : state.claims)
+        ss << claimLine("claim", card, claim);
+    for(auto& [card, tenant] : state.tenants)
+        ss << claimLine("tenant", card, tenant);
+
+    for(auto& [pid, job] : state.queue)
+        ss << jobLine(job);
+
+    // Full precision, these are accumulated over a long time
+    ss.precision(17);
+    for(auto& [uid, hours] : state.usage)
+        ss << "usage " << uid << " " << hours << "\n";
+    for(auto& [uid, avg] : state.runtimes)
+        ss << "runtime " << uid << " " << avg.seconds << " " << avg.samples << "\n";
+    if(state.globalRuntime)
+        ss << "runtime global " << state.globalRuntime->seconds << " " << state.globalRuntime->samples << "\n";
+
+    std::string tmpPath = m_path + ".tmp";
+    int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(fd < 0)
+    {
+        logError("Could not create %s: %s", tmpPath.c_str(), strerror(errno));
+        return;
+    }
+
+    if(!writeAll(fd, ss.str()) || fsync(fd) != 0)
+    {
+        logError("Could not write %s: %s", tmpPath.c_str(), strerror(errno));
+        close(fd);
+        unlink(tmpPath.c_str());
+        return;
+    }
+    close(fd);
+
+    if(rename(tmpPath.c_str(), m_path.c_str()) != 0)
+    {
+        logError("Could not replace %s: %s", m_path.c_str(), strerror(errno));
+        unlink(tmpPath.c_str());
+        return;
+    }
+
+    // The rename itself only survives a crash once the directory is synced
+    std::string dir = std::filesystem::path{m_path}.parent_path().string();
+    int dirFD = open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(dirFD < 0 || fsync(dirFD) != 0)
+        logWarning("Could not sync directory of %s: %s", m_path.c_str(), strerror(errno));
+    if(dirFD >= 0)
+        close(dirFD);
+
+    // Keep appending to the new file
+    int newFD = open(m_path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    if(newFD < 0)
+    {
+        logError("Could not open state file %s: %s", m_path.c_str(), strerror(errno));
+        return;
+    }
+
+    close(m_fd);
+    m_fd = newFD;
+}
@@ -0,0 +1,83 @@
+// Crash-safe persistence of scheduler state
+// Author: Max Schwarz <max.schwarz@ais.uni-bonn.de>
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+
+#include "backfill.h"
+#include "protocol.h"
+
+// Everything needed to continue where a previous server instance stopped.
+// Times are wall clock, so that they can be compared across processes.
+struct PersistentState
+{
+    using TimePoint = std::chrono::system_clock::time_point;
+
+    struct Claim
+    {
+        int uid = 0;
+        std::uint64_t memory = 0; // only for tenants of shared cards
+        TimePoint claimStart;
+        TimePoint lastUsage;
+        bool held = false; // by a connection, see ClaimRequest::releaseOnClose
+        std::uint32_t walltime = 0; // see ClaimRequest::walltime
+        bool bestEffort = false;
+    };
+
+    std::map<unsigned int, Claim> claims; // card -> exclusive claim
+    std::multimap<unsigned int, Claim> tenants; // card -> tenants of a shared card
+    std::map<std::int64_t, Job> queue; // pid -> waiting job
+    std::map<std::int64_t, double> usage; // uid -> fair-share GPU-hours
+    std::map<std::int64_t, RuntimeEstimator::Average> runtimes; // uid -> runtime average
+    std::optional<RuntimeEstimator::Average> globalRuntime;
+};
+
+// State file consisting of a snapshot followed by an append-only event log.
+//
+// Events are written with a single write() each, so they survive a crash of
+// the server (but not necessarily of the machine). Timers like lastUsage only
+// change in snapshots, which compact() writes to a temporary file and renames
+// over the old one. A torn last line is ignored when reading.
+class Journal
+{
+public:
+    using TimePoint = PersistentState::TimePoint;
+
+    // Read the file (if it exists) and open it for appending.
+    // Throws std::runtime_error.
+    explicit Journal(const std::string& path);
+    ~Journal();
+
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+
+    [[nodiscard]] const PersistentState& recovered() const
+    { return m_recovered; }
+
+    void claim(unsigned int card, int uid, const TimePoint& start, bool held, std::uint32_t walltime, bool bestEffort);
+    void release(unsigned int card);
+
+    void addTenant(unsigned int card, int uid, std::uint64_t memory, const TimePoint& start, bool held);
+    void removeTenant(unsigned int card, int uid);
+
+    void enqueue(const Job& job);
+    void dequeue(std::int64_t pid);
+
+    // Replace the file with a snapshot of the state
+    void compact(const PersistentState& state);
+
+private:
+    void append(const std::string& line);
+
+    std::string m_path;
+    int m_fd = -1;
+    PersistentState m_recovered;
+};
+
+#endif
@@ -0,0 +1,48 @@
+// Named latency histograms for gpu debug stats
+// Author: Max Schwarz <max.schwarz@ais.uni-bonn.de>
+
+#include "latency.h"
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace
+{
+    std::mutex g_mutex;
+    std::map<std::string, std::unique_ptr<Histogram>> g_histograms;
+}
+
+Histogram& latencyHistogram(const char* name)
+{
+    std::scoped_lock lock{g_mutex};
+
+    auto& hist = g_histograms[name];
+    if(!hist)
+    {
+        // 2^(1/4) per bucket, 30 octaves
+        hist = std::make_unique<Histogram>(1e-7, 1.189207115, 120);
+    }
+
+    return *hist;
+}
+
+std::vector<LatencyStat> latencyStats()
+{
+    std::scoped_lock lock{g_mutex};
+
+    std::vector<LatencyStat> stats;
+    for(auto& [name, hist] : g_histograms)
+    {
+        auto& stat = stats.emplace_back();
+        stat.name = name;
+        stat.count = hist->count();
+        stat.mean = stat.count != 0 ? hist->sum() / stat.count : 0.0;
+        stat.p50 = hist->quantile(0.5);
+        stat.p99 = hist->quantile(0.99);
+        stat.max = hist->max();
+    }
+
+    return stats;
+}
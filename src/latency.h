@@ -0,0 +1,28 @@
+// Named latency histograms for gpu debug stats
+// Author: Max Schwarz <max.schwarz@ais.uni-bonn.de>
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <vector>
+
+#include "histogram.h"
+#include "protocol.h"
+
+// Histogram with ~19% resolution from 100ns to 100s, registered under name
+// (e.g. "nvml.getMemoryInfo"). The lookup takes a lock, so keep the result
+// in a function-local static. Observing is lock-free.
+Histogram& latencyHistogram(const char* name);
+
+// All registered histograms, sorted by name
+std::vector<LatencyStat> latencyStats();
+
+// Time a single call, e.g. timed(hist, [&]{ return nvmlDeviceGetMemoryInfo(dev, &mem); })
+template<class F>
+auto timed(Histogram& histogram, F&& f)
+{
+    ScopedTimer timer{histogram};
+    return f();
+}
+
+#endif
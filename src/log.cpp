@@ -0,0 +1,356 @@
+// Asynchronous structured logging
+// Author: Max Schwarz <max.schwarz@ais.uni-bonn.de>
+
+#include "log.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+#include <string_view>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace
+{
+    constexpr std::size_t RING_SIZE = 4096; // power of two
+    constexpr std::size_t MAX_TEXT = 256;
+    constexpr auto FLUSH_INTERVAL = std::chrono::milliseconds{20};
+
+    enum class Stream : std::uint8_t
+    {
+        Log,
+        Audit
+    };
+
+    struct Record
+    {
+        // Bounded MPSC queue after Dmitry Vyukov: the slot is free for the
+        // producer at position p if sequence == p, and readable by the
+        // consumer if sequence == p+1.
+        std::atomic<std::size_t> sequence;
+
+        Stream stream;
+        LogLevel level;
+        std::chrono::system_clock::time_point time;
+        std::size_t length;
+        char text[MAX_TEXT];
+    };
+
+    struct Ring
+    {
+        Ring()
+        {
+            for(std::size_t i = 0; i < RING_SIZE; ++i)
+                records[i].sequence.store(i, std::memory_order_relaxed);
+        }
+
+        std::array<Record, RING_SIZE> records;
+        alignas(64) std::atomic<std::size_t> head{0}; // producers
+        alignas(64) std::size_t tail = 0; // consumer
+    };
+
+    Ring g_ring;
+    std::atomic<bool> g_running{false};
+    std::atomic<int> g_level{static_cast<int>(LogLevel::Info)};
+    std::atomic<std::size_t> g_dropped{0};
+    int g_auditFD = -1;
+    std::jthread g_writer;
+
+    const char* levelName(LogLevel level)
+    {
+        switch(level)
+        {
+            case LogLevel::Debug:   return "debug";
+            case LogLevel::Info:    return "info";
+            case LogLevel::Warning: return "warning";
+            case LogLevel::Error:   return "error";
+        }
+        return "unknown";
+    }
+
+    // Returns nullptr if the ring is full
+    Record* acquire(std::size_t& pos)
+    {
+        pos = g_ring.head.load(std::memory_order_relaxed);
+        while(true)
+        {
+            Record& rec = g_ring.records[pos & (RING_SIZE-1)];
+            std::size_t seq = rec.sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<std::ptrdiff_t>(seq - pos);
+
+            if(diff == 0)
+            {
+                if(g_ring.head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    return &rec;
+            }
+            else if(diff < 0)
+                return nullptr;
+            else
+                pos = g_ring.head.load(std::memory_order_relaxed);
+        }
+    }
+
+    void commit(Record& rec, std::size_t pos)
+    {
+        rec.sequence.store(pos + 1, std::memory_order_release);
+    }
+
+    void appendTime(std::string& out, std::chrono::system_clock::time_point time)
+    {
+        auto secs = std::chrono::system_clock::to_time_t(time);
+        auto millis = std::chrono::duration_cast<std::chrono::milliseconds>(time.time_since_epoch()).count() % 1000;
+
+        tm t{};
+        gmtime_r(&secs, &t);
+
+        char buf[64];
+        std::size_t len = strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &t);
+        snprintf(buf + len, sizeof(buf) - len, ".%03dZ", static_cast<int>(millis));
+        out += buf;
+    }
+
+    void format(std::string& out, Stream stream, LogLevel level, std::chrono::system_clock::time_point time, std::string_view text)
+    {
+        out += "time=";
+        appendTime(out, time);
+
+        if(stream == Stream::Audit)
+        {
+            // Fields are key=value already
+            out += ' ';
+            out += text;
+            out += '\n';
+            return;
+        }
+
+        out += " level=";
+        out += levelName(level);
+        out += " msg=\"";
+        for(char c : text)
+        {
+            if(c == '"' || c == '\\')
+            {
+                out += '\\';
+                out += c;
+            }
+            else if(c == '\n')
+                out += "\\n";
+            else
+                out += c;
+        }
+        out += "\"\n";
+    }
+
+    void writeAll(int fd, const std::string& data)
+    {
+        std::size_t written = 0;
+        while(written < data.size())
+        {
+            ssize_t ret = write(fd, data.data() + written, data.size() - written);
+            if(ret < 0)
+            {
+                if(errno == EINTR)
+                    continue;
+                return;
+            }
+            written += ret;
+        }
+    }
+
+    // Returns the number of records written
+    std::size_t flush(std::string& logOut, std::string& auditOut)
+    {
+        logOut.clear();
+        auditOut.clear();
+
+        std::size_t count = 0;
+        while(true)
+        {
+            Record& rec = g_ring.records[g_ring.tail & (RING_SIZE-1)];
+            if(rec.sequence.load(std::memory_order_acquire) != g_ring.tail + 1)
+                break;
+
+            format(rec.stream == Stream::Audit ? auditOut : logOut,
+                rec.stream, rec.level, rec.time, {rec.text, rec.length}
+            );
+
+            rec.sequence.store(g_ring.tail + RING_SIZE, std::memory_order_release);
+            g_ring.tail++;
+            count++;
+        }
+
+        if(std::size_t dropped = g_dropped.exchange(0, std::memory_order_relaxed))
+        {
+            char msg[64];
+            snprintf(msg, sizeof(msg), "Dropped %zu log records, ring buffer was full", dropped);
+            format(logOut, Stream::Log, LogLevel::Warning, std::chrono::system_clock::now(), msg);
+        }
+
+        if(!logOut.empty())
+            writeAll(STDERR_FILENO, logOut);
+        if(!auditOut.empty() && g_auditFD >= 0)
+            writeAll(g_auditFD, auditOut);
+
+        return count;
+    }
+
+    void writerThread(std::stop_token stop)
+    {
+        std::string logOut;
+        std::string auditOut;
+
+        while(!stop.stop_requested())
+        {
+            if(flush(logOut, auditOut) == 0)
+                std::this_thread::sleep_for(FLUSH_INTERVAL);
+        }
+
+        // Whatever came in before stopLogging()
+        flush(logOut, auditOut);
+    }
+
+    void submit(Stream stream, LogLevel level, const char* prefix, const char* fmt, va_list args)
+    {
+        auto now = std::chrono::system_clock::now();
+
+        if(!g_running.load(std::memory_order_acquire))
+        {
+            char text[MAX_TEXT];
+            int len = snprintf(text, sizeof(text), "%s", prefix);
+            vsnprintf(text + len, sizeof(text) - len, fmt, args);
+
+            std::string out;
+            format(out, stream, level, now, text);
+
+            if(stream == Stream::Log)
+                writeAll(STDERR_FILENO, out);
+            else if(g_auditFD >= 0)
+                writeAll(g_auditFD, out);
+            return;
+        }
+
+        std::size_t pos = 0;
+        Record* rec = acquire(pos);
+        if(!rec)
+        {
+            if(stream == Stream::Log)
+            {
+                g_dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+
+            // Accounting needs every record
+            while(!(rec = acquire(pos)))
+                std::this_thread::yield();
+        }
+
+        rec->stream = stream;
+        rec->level = level;
+        rec->time = now;
+
+        int len = snprintf(rec->text, MAX_TEXT, "%s", prefix);
+        int ret = vsnprintf(rec->text + len, MAX_TEXT - len, fmt, args);
+        rec->length = std::min<std::size_t>(len + std::max(ret, 0), MAX_TEXT - 1);
+
+        commit(*rec, pos);
+    }
+
+    void submitLog(LogLevel level, const char* fmt, va_list args)
+    {
+        if(static_cast<int>(level) < g_level.load(std::memory_order_relaxed))
+            return;
+
+        submit(Stream::Log, level, "", fmt, args);
+    }
+}
+
+void startLogging(LogLevel level, const std::string& auditPath)
+{
+    g_level = static_cast<int>(level);
+
+    if(!auditPath.empty())
+    {
+        g_auditFD = open(auditPath.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0640);
+        if(g_auditFD < 0)
+            throw std::runtime_error{"Could not open audit log " + auditPath + ": " + strerror(errno)};
+    }
+
+    g_writer = std::jthread{writerThread};
+    g_running = true;
+}
+
+void stopLogging()
+{
+    if(!g_running)
+        return;
+
+    g_running = false;
+    g_writer.request_stop();
+    g_writer.join();
+}
+
+LogLevel parseLogLevel(const std::string& name)
+{
+    for(auto level : {LogLevel::Debug, LogLevel::Info, LogLevel::Warning, LogLevel::Error})
+    {
+        if(name == levelName(level))
+            return level;
+    }
+
+    throw std::invalid_argument{"Unknown log level '" + name + "' (expected debug, info, warning or error)"};
+}
+
+void logDebug(const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    submitLog(LogLevel::Debug, fmt, args);
+    va_end(args);
+}
+
+void logInfo(const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    submitLog(LogLevel::Info, fmt, args);
+    va_end(args);
+}
+
+void logWarning(const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    submitLog(LogLevel::Warning, fmt, args);
+    va_end(args);
+}
+
+void logError(const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    submitLog(LogLevel::Error, fmt, args);
+    va_end(args);
+}
+
+void audit(const char* event, const char* fmt, ...)
+{
+    if(g_auditFD < 0)
+        return;
+
+    char prefix[64];
+    snprintf(prefix, sizeof(prefix), "event=%s ", event);
+
+    va_list args;
+    va_start(args, fmt);
+    submit(Stream::Audit, LogLevel::Info, prefix, fmt, args);
+    va_end(args);
+}
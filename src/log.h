@@ -0,0 +1,42 @@
+// Asynchronous structured logging
+// Author: Max Schwarz <max.schwarz@ais.uni-bonn.de>
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <string>
+
+enum class LogLevel
+{
+    Debug,
+    Info,
+    Warning,
+    Error
+};
+
+// Records are formatted by the caller into a fixed-size ring buffer and
+// written by a background thread as key=value lines:
+//
+//   time=2026-01-01T12:00:00.000Z level=info msg="Card 0 released."
+//
+// Log records go to stderr. Audit records (claims and releases, for
+// accounting) go to auditPath if it is not empty. Log records are dropped
+// if the ring is full, audit records wait for space.
+//
+// Before startLogging() and after stopLogging(), records are written
+// synchronously.
+void startLogging(LogLevel level, const std::string& auditPath);
+void stopLogging();
+
+// Throws std::invalid_argument
+LogLevel parseLogLevel(const std::string& name);
+
+void logDebug(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+void logInfo(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+void logWarning(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+void logError(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+
+// fmt gives the fields after event=..., e.g. audit("claim", "card=%u uid=%d", ...)
+void audit(const char* event, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#endif
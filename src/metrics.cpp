@@ -0,0 +1,279 @@
+// Prometheus metrics endpoint
+// Author: Max Schwarz <max.schwarz@ais.uni-bonn.de>
+
+#include "metrics.h"
+#include "log.h"
+#include "tcp.h"
+
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace
+{
+    constexpr std::size_t MAX_CONNECTIONS = 64;
+    constexpr std::size_t MAX_REQUEST = 8192;
+    constexpr auto CONNECTION_TIMEOUT = std::chrono::seconds{10};
+
+    std::string httpResponse(const char* status, const std::string& body)
+    {
+        std::string resp = "HTTP/1.0 ";
+        resp += status;
+        resp += "\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\n";
+        resp += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+        resp += "Connection: close\r\n\r\n";
+        resp += body;
+        return resp;
+    }
+}
+
+void MetricsWriter::family(const char* name, const char* type, const char* help)
+{
+    m_text += "# HELP ";
+    m_text += name;
+    m_text += ' ';
+    m_text += help;
+    m_text += "\n# TYPE ";
+    m_text += name;
+    m_text += ' ';
+    m_text += type;
+    m_text += '\n';
+}
+
+void MetricsWriter::sample(const char* name, double value, Labels labels)
+{
+    m_text += name;
+
+    if(labels.size() != 0)
+    {
+        m_text += '{';
+        bool first = true;
+        for(auto& [key, labelValue] : labels)
+        {
+            if(!first)
+                m_text += ',';
+            first = false;
+
+            m_text += key;
+            m_text += "=\"";
+            for(char c : labelValue)
+            {
+                if(c == '\\' || c == '"')
+                    m_text += '\\';
+
+                if(c == '\n')
+                    m_text += "\\n";
+                else
+                    m_text += c;
+            }
+            m_text += '"';
+        }
+        m_text += '}';
+    }
+
+    m_text += ' ';
+    appendValue(value);
+    m_text += '\n';
+}
+
+void MetricsWriter::histogram(const char* name, const char* help, const Histogram& hist)
+{
+    family(name, "histogram", help);
+
+    std::string bucketName = std::string{name} + "_bucket";
+    auto& bounds = hist.bounds();
+
+    // Buckets are cumulative in this format
+    std::uint64_t cumulative = 0;
+    for(std::size_t i = 0; i <= bounds.size(); ++i)
+    {
+        cumulative += hist.bucket(i);
+
+        char le[32];
+        if(i < bounds.size())
+            snprintf(le, sizeof(le), "%g", bounds[i]);
+        else
+            snprintf(le, sizeof(le), "+Inf");
+
+        sample(bucketName.c_str(), cumulative, {{"le", le}});
+    }
+
+    sample((std::string{name} + "_sum").c_str(), hist.sum());
+    sample((std::string{name} + "_count").c_str(), cumulative);
+}
+
+void MetricsWriter::appendValue(double value)
+{
+    if(std::isinf(value))
+    {
+        m_text += value > 0 ? "+Inf" : "-Inf";
+        return;
+    }
+
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.10g", value);
+    m_text += buf;
+}
+
+MetricsServer::MetricsServer(unsigned int port)
+{
+    m_listenFD = listenTCP(port, 16);
+    if(m_listenFD < 0)
+        throw std::runtime_error{"Could not open metrics port " + std::to_string(port)};
+
+    fcntl(m_listenFD, F_SETFL, fcntl(m_listenFD, F_GETFL) | O_NONBLOCK);
+
+    m_epollFD = epoll_create1(EPOLL_CLOEXEC);
+    if(m_epollFD < 0)
+        throw std::runtime_error{std::string{"Could not create epoll fd: "} + strerror(errno)};
+
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = m_listenFD;
+    if(epoll_ctl(m_epollFD, EPOLL_CTL_ADD, m_listenFD, &ev) != 0)
+        throw std::runtime_error{std::string{"Could not add metrics socket to epoll: "} + strerror(errno)};
+}
+
+MetricsServer::~MetricsServer()
+{
+    for(auto& [fd, conn] : m_connections)
+        ::close(fd);
+
+    if(m_epollFD >= 0)
+        ::close(m_epollFD);
+    if(m_listenFD >= 0)
+        ::close(m_listenFD);
+}
+
+void MetricsServer::process(const std::function<std::string()>& render)
+{
+    epoll_event events[16];
+    int nfds = epoll_wait(m_epollFD, events, 16, 0);
+
+    for(int i = 0; i < nfds; ++i)
+    {
+        int fd = events[i].data.fd;
+        if(fd == m_listenFD)
+        {
+            accept();
+            continue;
+        }
+
+        auto it = m_connections.find(fd);
+        if(it == m_connections.end())
+            continue;
+
+        auto& conn = it->second;
+        if(conn.response.empty())
+            receive(fd, conn, render);
+        else if(!transmit(fd, conn))
+            close(fd);
+    }
+
+    // Slow or idle scrapers
+    auto now = std::chrono::steady_clock::now();
+    std::erase_if(m_connections, [&](auto& entry){
+        if(now - entry.second.acceptTime < CONNECTION_TIMEOUT)
+            return false;
+
+        ::close(entry.first);
+        return true;
+    });
+}
+
+void MetricsServer::accept()
+{
+    while(true)
+    {
+        int fd = accept4(m_listenFD, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+        if(fd < 0)
+        {
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                logError("Could not accept metrics client: %s", strerror(errno));
+            return;
+        }
+
+        if(m_connections.size() >= MAX_CONNECTIONS)
+        {
+            ::close(fd);
+            continue;
+        }
+
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if(epoll_ctl(m_epollFD, EPOLL_CTL_ADD, fd, &ev) != 0)
+        {
+            logError("Could not add metrics client to epoll: %s", strerror(errno));
+            ::close(fd);
+            continue;
+        }
+
+        m_connections[fd].acceptTime = std::chrono::steady_clock::now();
+    }
+}
+
+void MetricsServer::receive(int fd, Connection& conn, const std::function<std::string()>& render)
+{
+    char buf[1024];
+    ssize_t ret = recv(fd, buf, sizeof(buf), 0);
+    if(ret <= 0)
+    {
+        if(ret == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            close(fd);
+        return;
+    }
+
+    conn.request.append(buf, ret);
+
+    // We do not care about the headers, just wait for them to end
+    if(conn.request.find("\r\n\r\n") == std::string::npos)
+    {
+        if(conn.request.size() > MAX_REQUEST)
+            close(fd);
+        return;
+    }
+
+    std::string line = conn.request.substr(0, conn.request.find("\r\n"));
+    if(line.starts_with("GET /metrics ") || line.starts_with("GET / "))
+        conn.response = httpResponse("200 OK", render());
+    else
+        conn.response = httpResponse("404 Not Found", "Not found, try /metrics\n");
+
+    epoll_event ev{};
+    ev.events = EPOLLOUT;
+    ev.data.fd = fd;
+    epoll_ctl(m_epollFD, EPOLL_CTL_MOD, fd, &ev);
+
+    if(!transmit(fd, conn))
+        close(fd);
+}
+
+// Returns false once the connection should be closed
+bool MetricsServer::transmit(int fd, Connection& conn)
+{
+    while(conn.written < conn.response.size())
+    {
+        ssize_t ret = ::send(fd, conn.response.data() + conn.written, conn.response.size() - conn.written, MSG_NOSIGNAL);
+        if(ret < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+
+        conn.written += ret;
+    }
+
+    return false;
+}
+
+void MetricsServer::close(int fd)
+{
+    epoll_ctl(m_epollFD, EPOLL_CTL_DEL, fd, nullptr);
+    ::close(fd);
+    m_connections.erase(fd);
+}
@@ -0,0 +1,79 @@
+// Prometheus metrics endpoint
+// Author: Max Schwarz <max.schwarz@ais.uni-bonn.de>
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <chrono>
+#include <functional>
+#include <initializer_list>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "histogram.h"
+
+// Builds a response in the Prometheus text exposition format
+class MetricsWriter
+{
+public:
+    using Labels = std::initializer_list<std::pair<const char*, std::string>>;
+
+    // Starts a metric family. type is gauge, counter or histogram.
+    void family(const char* name, const char* type, const char* help);
+
+    void sample(const char* name, double value, Labels labels = {});
+
+    // Writes a complete histogram family
+    void histogram(const char* name, const char* help, const Histogram& hist);
+
+    [[nodiscard]] const std::string& text() const
+    { return m_text; }
+
+private:
+    void appendValue(double value);
+
+    std::string m_text;
+};
+
+// Minimal HTTP/1.0 server for GET /metrics. Connections are handled
+// non-blocking on an internal epoll set, whose fd can be added to the
+// caller's event loop.
+class MetricsServer
+{
+public:
+    // Throws std::runtime_error
+    explicit MetricsServer(unsigned int port);
+    ~MetricsServer();
+
+    MetricsServer(const MetricsServer&) = delete;
+    MetricsServer& operator=(const MetricsServer&) = delete;
+
+    // Readable whenever process() has work to do
+    [[nodiscard]] int fd() const
+    { return m_epollFD; }
+
+    // Accept, read and answer without blocking, and drop connections that
+    // take too long. render is called once per scrape.
+    void process(const std::function<std::string()>& render);
+
+private:
+    struct Connection
+    {
+        std::string request;
+        std::string response;
+        std::size_t written = 0;
+        std::chrono::steady_clock::time_point acceptTime;
+    };
+
+    void accept();
+    void receive(int fd, Connection& conn, const std::function<std::string()>& render);
+    bool transmit(int fd, Connection& conn);
+    void close(int fd);
+
+    int m_listenFD = -1;
+    int m_epollFD = -1;
+    std::unordered_map<int, Connection> m_connections;
+};
+
+#endif
@@ -0,0 +1,259 @@
+// MIG (multi-instance GPU) slices as claimable units
+// Author: Max Schwarz <max.schwarz@ais.uni-bonn.de>
+
+#include "mig.h"
+#include "log.h"
+
+#include <cstdio>
+#include <fstream>
+#include <optional>
+#include <stdexcept>
+
+namespace
+{
+    void check(nvmlReturn_t err, const std::string& what)
+    {
+        if(err != NVML_SUCCESS)
+            throw std::runtime_error{what + ": " + nvmlErrorString(err)};
+    }
+
+    // NVML reports e.g. "MIG 1g.10gb"
+    std::string profileName(const nvmlGpuInstanceProfileInfo_v2_t& info)
+    {
+        std::string name = info.name;
+        if(name.starts_with("MIG "))
+            name = name.substr(4);
+
+        return name;
+    }
+
+    std::vector<nvmlGpuInstanceProfileInfo_v2_t> profileInfos(nvmlDevice_t dev)
+    {
+        std::vector<nvmlGpuInstanceProfileInfo_v2_t> infos;
+        for(unsigned int profile = 0; profile < NVML_GPU_INSTANCE_PROFILE_COUNT; ++profile)
+        {
+            nvmlGpuInstanceProfileInfo_v2_t info{};
+            info.version = nvmlGpuInstanceProfileInfo_v2;
+            if(nvmlDeviceGetGpuInstanceProfileInfoV(dev, profile, &info) == NVML_SUCCESS)
+                infos.push_back(info);
+        }
+
+        return infos;
+    }
+
+    std::optional<nvmlGpuInstanceProfileInfo_v2_t> findProfile(nvmlDevice_t dev, const std::string& name)
+    {
+        for(auto& info : profileInfos(dev))
+        {
+            if(profileName(info) == name)
+                return info;
+        }
+
+        return {};
+    }
+
+    // The driver publishes the minor number of the access node in
+    // /proc/driver/nvidia/capabilities/.../access as "DeviceFileMinor: N"
+    std::string accessNode(const std::string& procPath)
+    {
+        std::ifstream file{procPath};
+        std::string key;
+        unsigned int minor = 0;
+        while(file >> key)
+        {
+            if(key == "DeviceFileMinor:" && file >> minor)
+                return "/dev/nvidia-caps/nvidia-cap" + std::to_string(minor);
+        }
+
+        throw std::runtime_error{"Could not read device minor from " + procPath};
+    }
+
+    std::string migUUID(nvmlDevice_t dev, unsigned int gpuInstanceId, unsigned int computeInstanceId)
+    {
+        unsigned int count = 0;
+        check(nvmlDeviceGetMaxMigDeviceCount(dev, &count), "Could not get MIG device count");
+
+        for(unsigned int i = 0; i < count; ++i)
+        {
+            nvmlDevice_t migDev{};
+            if(nvmlDeviceGetMigDeviceHandleByIndex(dev, i, &migDev) != NVML_SUCCESS)
+                continue;
+
+            unsigned int gi = 0;
+            unsigned int ci = 0;
+            if(nvmlDeviceGetGpuInstanceId(migDev, &gi) != NVML_SUCCESS || nvmlDeviceGetComputeInstanceId(migDev, &ci) != NVML_SUCCESS)
+                continue;
+
+            if(gi != gpuInstanceId || ci != computeInstanceId)
+                continue;
+
+            char buf[NVML_DEVICE_UUID_V2_BUFFER_SIZE];
+            check(nvmlDeviceGetUUID(migDev, buf, sizeof(buf)), "Could not get MIG device UUID");
+            return buf;
+        }
+
+        throw std::runtime_error{"No MIG device for GPU instance " + std::to_string(gpuInstanceId)};
+    }
+
+    std::vector<nvmlComputeInstance_t> computeInstances(nvmlGpuInstance_t gi)
+    {
+        std::vector<nvmlComputeInstance_t> result;
+        for(unsigned int profile = 0; profile < NVML_COMPUTE_INSTANCE_PROFILE_COUNT; ++profile)
+        {
+            nvmlComputeInstanceProfileInfo_t info{};
+            if(nvmlGpuInstanceGetComputeInstanceProfileInfo(gi, profile, NVML_COMPUTE_INSTANCE_ENGINE_PROFILE_SHARED, &info) != NVML_SUCCESS)
+                continue;
+
+            std::vector<nvmlComputeInstance_t> buf(info.instanceCount);
+            unsigned int count = buf.size();
+            if(nvmlGpuInstanceGetComputeInstances(gi, info.id, buf.data(), &count) != NVML_SUCCESS)
+                continue;
+
+            result.insert(result.end(), buf.begin(), buf.begin() + count);
+        }
+
+        return result;
+    }
+
+    // Compute instance profile covering the whole GPU instance
+    unsigned int fullComputeProfile(nvmlGpuInstance_t gi, unsigned int sliceCount)
+    {
+        for(unsigned int profile = NVML_COMPUTE_INSTANCE_PROFILE_COUNT; profile-- > 0;)
+        {
+            nvmlComputeInstanceProfileInfo_t info{};
+            if(nvmlGpuInstanceGetComputeInstanceProfileInfo(gi, profile, NVML_COMPUTE_INSTANCE_ENGINE_PROFILE_SHARED, &info) != NVML_SUCCESS)
+                continue;
+
+            if(info.sliceCount == sliceCount)
+                return info.id;
+        }
+
+        throw std::runtime_error{"No compute instance profile spans the GPU instance"};
+    }
+
+    MigInstance describe(nvmlDevice_t dev, unsigned int minorID,
+        const nvmlGpuInstanceProfileInfo_v2_t& profile, nvmlGpuInstance_t gi, nvmlComputeInstance_t ci)
+    {
+        nvmlGpuInstanceInfo_t giInfo{};
+        check(nvmlGpuInstanceGetInfo(gi, &giInfo), "Could not get GPU instance info");
+
+        nvmlComputeInstanceInfo_t ciInfo{};
+        check(nvmlComputeInstanceGetInfo(ci, &ciInfo), "Could not get compute instance info");
+
+        MigInstance instance;
+        instance.gpuInstanceId = giInfo.id;
+        instance.computeInstanceId = ciInfo.id;
+        instance.profileId = profile.id;
+        instance.profile = profileName(profile);
+        instance.memory = profile.memorySizeMB * 1024ULL * 1024ULL;
+        instance.uuid = migUUID(dev, giInfo.id, ciInfo.id);
+
+        std::string caps = "/proc/driver/nvidia/capabilities/gpu" + std::to_string(minorID)
+            + "/mig/gi" + std::to_string(giInfo.id);
+        instance.accessNodes.push_back(accessNode(caps + "/access"));
+        instance.accessNodes.push_back(accessNode(caps + "/ci" + std::to_string(ciInfo.id) + "/access"));
+
+        return instance;
+    }
+}
+
+bool migEnabled(nvmlDevice_t dev)
+{
+    unsigned int current = 0;
+    unsigned int pending = 0;
+    if(nvmlDeviceGetMigMode(dev, &current, &pending) != NVML_SUCCESS)
+        return false; // not supported
+
+    return current == NVML_DEVICE_MIG_ENABLE;
+}
+
+std::vector<MigCapacity> migCapacity(nvmlDevice_t dev)
+{
+    std::vector<MigCapacity> result;
+    for(auto& info : profileInfos(dev))
+    {
+        unsigned int count = 0;
+        if(nvmlDeviceGetGpuInstanceRemainingCapacity(dev, info.id, &count) != NVML_SUCCESS)
+            count = 0;
+
+        result.push_back(MigCapacity{profileName(info), count});
+    }
+
+    return result;
+}
+
+std::vector<MigInstance> listMigInstances(nvmlDevice_t dev, unsigned int minorID)
+{
+    std::vector<MigInstance> instances;
+
+    for(auto& profile : profileInfos(dev))
+    {
+        std::vector<nvmlGpuInstance_t> buf(profile.instanceCount);
+        unsigned int count = buf.size();
+        check(nvmlDeviceGetGpuInstances(dev, profile.id, buf.data(), &count), "Could not list GPU instances");
+
+        for(unsigned int i = 0; i < count; ++i)
+        {
+            auto cis = computeInstances(buf[i]);
+            if(cis.size() != 1)
+            {
+                logWarning("Skipping %s instance with %lu compute instances",
+                    profileName(profile).c_str(), cis.size()
+                );
+                continue;
+            }
+
+            instances.push_back(describe(dev, minorID, profile, buf[i], cis.front()));
+        }
+    }
+
+    return instances;
+}
+
+MigInstance createMigInstance(nvmlDevice_t dev, unsigned int minorID, const std::string& profile)
+{
+    auto info = findProfile(dev, profile);
+    if(!info)
+        throw std::runtime_error{"Unknown MIG profile " + profile};
+
+    nvmlGpuInstance_t gi{};
+    check(nvmlDeviceCreateGpuInstance(dev, info->id, &gi), "Could not create GPU instance");
+
+    nvmlComputeInstance_t ci{};
+    try
+    {
+        check(nvmlGpuInstanceCreateComputeInstance(gi, fullComputeProfile(gi, info->sliceCount), &ci),
+            "Could not create compute instance"
+        );
+    }
+    catch(std::runtime_error&)
+    {
+        nvmlGpuInstanceDestroy(gi);
+        throw;
+    }
+
+    try
+    {
+        MigInstance instance = describe(dev, minorID, *info, gi, ci);
+        instance.dynamic = true;
+        return instance;
+    }
+    catch(std::runtime_error&)
+    {
+        nvmlComputeInstanceDestroy(ci);
+        nvmlGpuInstanceDestroy(gi);
+        throw;
+    }
+}
+
+void destroyMigInstance(nvmlDevice_t dev, const MigInstance& instance)
+{
+    nvmlGpuInstance_t gi{};
+    check(nvmlDeviceGetGpuInstanceById(dev, instance.gpuInstanceId, &gi), "Could not find GPU instance");
+
+    nvmlComputeInstance_t ci{};
+    check(nvmlGpuInstanceGetComputeInstanceById(gi, instance.computeInstanceId, &ci), "Could not find compute instance");
+
+    check(nvmlComputeInstanceDestroy(ci), "Could not destroy compute instance");
+    check(nvmlGpuInstanceDestroy(gi), "Could not destroy GPU instance");
+}
@@ -0,0 +1,52 @@
+// MIG (multi-instance GPU) slices as claimable units
+// Author: Max Schwarz <max.schwarz@ais.uni-bonn.de>
+
+#ifndef MIG_H
+#define MIG_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <nvml.h>
+
+// A GPU instance with a single compute instance spanning all of it
+struct MigInstance
+{
+    unsigned int gpuInstanceId = 0;
+    unsigned int computeInstanceId = 0;
+    unsigned int profileId = 0; // nvmlGpuInstanceProfileInfo_v2_t::id
+    std::string profile; // e.g. "1g.10gb"
+    std::uint64_t memory = 0; // bytes
+    std::string uuid; // MIG-..., for CUDA_VISIBLE_DEVICES
+
+    // /dev/nvidia-caps/nvidia-capN nodes granting access to the GI and CI
+    std::vector<std::string> accessNodes;
+
+    // Created on demand, destroyed again when released
+    bool dynamic = false;
+};
+
+// A GPU instance profile the device supports
+struct MigCapacity
+{
+    std::string profile; // e.g. "1g.10gb"
+    unsigned int remaining = 0; // instances that still fit next to the existing ones
+};
+
+[[nodiscard]] bool migEnabled(nvmlDevice_t dev);
+
+// All supported profiles. Only changes when instances are created or
+// destroyed, so callers cache it.
+[[nodiscard]] std::vector<MigCapacity> migCapacity(nvmlDevice_t dev);
+
+// Existing instances. Instances without exactly one compute instance were set
+// up by hand for something else and are skipped. minorID is that of the
+// parent /dev/nvidiaN.
+[[nodiscard]] std::vector<MigInstance> listMigInstances(nvmlDevice_t dev, unsigned int minorID);
+
+// Throw std::runtime_error on failure
+MigInstance createMigInstance(nvmlDevice_t dev, unsigned int minorID, const std::string& profile);
+void destroyMigInstance(nvmlDevice_t dev, const MigInstance& instance);
+
+#endif
@@ -0,0 +1,308 @@
+// Synthetic NVML devices for benchmarks
+// Author: Max Schwarz <max.schwarz@ais.uni-bonn.de>
+
+#include "mock_nvml.h"
+
+#include <nvml.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+struct nvmlDevice_st
+{
+    unsigned int index = 0;
+    std::vector<nvmlProcessInfo_t> processes;
+    std::atomic<unsigned int> calls{0};
+};
+
+namespace
+{
+    constexpr unsigned long long MEMORY_TOTAL = 80ULL * 1000 * 1000 * 1000;
+    constexpr unsigned long long MEMORY_PER_PROCESS = 2ULL * 1000 * 1000 * 1000;
+    constexpr unsigned int CARDS_PER_SWITCH = 4;
+
+    unsigned int g_numCards = 0;
+    unsigned int g_numProcesses = 0;
+    bool g_configured = false;
+    std::vector<nvmlDevice_st> g_devices;
+
+    unsigned int envOr(const char* name, unsigned int def)
+    {
+        const char* value = getenv(name);
+        return value ? strtoul(value, nullptr, 10) : def;
+    }
+
+    std::vector<unsigned int> rootPIDs()
+    {
+        std::vector<unsigned int> pids;
+        for(auto& entry : std::filesystem::directory_iterator{"/proc"})
+        {
+            auto name = entry.path().filename().string();
+            if(name.empty() || !std::all_of(name.begin(), name.end(), ::isdigit))
+                continue;
+
+            struct stat st{};
+            if(stat(entry.path().c_str(), &st) == 0 && st.st_uid == 0)
+                pids.push_back(std::stoul(name));
+        }
+        return pids;
+    }
+
+    nvmlReturn_t getProcesses(nvmlDevice_t device, unsigned int* infoCount, nvmlProcessInfo_t* infos)
+    {
+        auto& procs = device->processes;
+        if(*infoCount < procs.size())
+        {
+            *infoCount = procs.size();
+            return NVML_ERROR_INSUFFICIENT_SIZE;
+        }
+
+        std::copy(procs.begin(), procs.end(), infos);
+        *infoCount = procs.size();
+        return NVML_SUCCESS;
+    }
+}
+
+void mockNvmlConfigure(unsigned int numCards, unsigned int numProcesses)
+{
+    g_numCards = numCards;
+    g_numProcesses = numProcesses;
+    g_configured = true;
+}
+
+nvmlReturn_t nvmlInitWithFlags(unsigned int)
+{
+    if(!g_configured)
+    {
+        g_numCards = envOr("GPU_CLAIM_MOCK_CARDS", 8);
+        g_numProcesses = envOr("GPU_CLAIM_MOCK_PROCESSES", 4 * g_numCards);
+    }
+
+    g_devices = std::vector<nvmlDevice_st>(g_numCards);
+    for(unsigned int i = 0; i < g_numCards; ++i)
+        g_devices[i].index = i;
+
+    auto pids = rootPIDs();
+    if(g_numCards != 0 && !pids.empty())
+    {
+        for(unsigned int i = 0; i < g_numProcesses; ++i)
+        {
+            nvmlProcessInfo_t info{};
+            info.pid = pids[i % pids.size()];
+            info.usedGpuMemory = MEMORY_PER_PROCESS;
+            g_devices[i % g_numCards].processes.push_back(info);
+        }
+    }
+
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlShutdown()
+{
+    g_devices.clear();
+    return NVML_SUCCESS;
+}
+
+const char* nvmlErrorString(nvmlReturn_t result)
+{
+    switch(result)
+    {
+        case NVML_SUCCESS:                  return "Success";
+        case NVML_ERROR_NOT_SUPPORTED:      return "Not supported by the mock";
+        case NVML_ERROR_INSUFFICIENT_SIZE:  return "Insufficient size";
+        default:                            return "Mock error";
+    }
+}
+
+nvmlReturn_t nvmlDeviceGetCount_v2(unsigned int* deviceCount)
+{
+    *deviceCount = g_devices.size();
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetHandleByIndex(unsigned int index, nvmlDevice_t* device)
+{
+    if(index >= g_devices.size())
+        return NVML_ERROR_UNKNOWN;
+
+    *device = &g_devices[index];
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetName(nvmlDevice_t, char* name, unsigned int length)
+{
+    snprintf(name, length, "Mock GPU");
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetUUID(nvmlDevice_t device, char* uuid, unsigned int length)
+{
+    snprintf(uuid, length, "GPU-00000000-0000-0000-0000-%012u", device->index);
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetMinorNumber(nvmlDevice_t device, unsigned int* minorNumber)
+{
+    *minorNumber = device->index;
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetMemoryInfo(nvmlDevice_t device, nvmlMemory_t* memory)
+{
+    memory->total = MEMORY_TOTAL;
+    memory->used = std::min(MEMORY_TOTAL, device->processes.size() * MEMORY_PER_PROCESS);
+    memory->free = memory->total - memory->used;
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetUtilizationRates(nvmlDevice_t device, nvmlUtilization_t* utilization)
+{
+    // Changes on every pass, so that status updates are never empty
+    unsigned int calls = device->calls.fetch_add(1, std::memory_order_relaxed);
+    utilization->gpu = (device->index * 7 + calls) % 101;
+    utilization->memory = utilization->gpu / 2;
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetComputeRunningProcesses(nvmlDevice_t device, unsigned int* infoCount, nvmlProcessInfo_t* infos)
+{
+    return getProcesses(device, infoCount, infos);
+}
+
+nvmlReturn_t nvmlDeviceGetGraphicsRunningProcesses(nvmlDevice_t, unsigned int* infoCount, nvmlProcessInfo_t*)
+{
+    *infoCount = 0;
+    return NVML_SUCCESS;
+}
+
+// Topology: groups of CARDS_PER_SWITCH cards behind one PCIe switch, no NVLink
+
+nvmlReturn_t nvmlDeviceGetPciInfo_v3(nvmlDevice_t device, nvmlPciInfo_t* pci)
+{
+    *pci = {};
+    pci->bus = device->index + 1;
+    snprintf(pci->busId, sizeof(pci->busId), "00000000:%02X:00.0", pci->bus);
+    snprintf(pci->busIdLegacy, sizeof(pci->busIdLegacy), "0000:%02X:00.0", pci->bus);
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetNvLinkState(nvmlDevice_t, unsigned int, nvmlEnableState_t*)
+{
+    return NVML_ERROR_NOT_SUPPORTED;
+}
+
+nvmlReturn_t nvmlDeviceGetNvLinkRemotePciInfo_v2(nvmlDevice_t, unsigned int, nvmlPciInfo_t*)
+{
+    return NVML_ERROR_NOT_SUPPORTED;
+}
+
+nvmlReturn_t nvmlDeviceGetTopologyCommonAncestor(nvmlDevice_t device1, nvmlDevice_t device2, nvmlGpuTopologyLevel_t* pathInfo)
+{
+    bool sameSwitch = device1->index / CARDS_PER_SWITCH == device2->index / CARDS_PER_SWITCH;
+    *pathInfo = sameSwitch ? NVML_TOPOLOGY_SINGLE : NVML_TOPOLOGY_SYSTEM;
+    return NVML_SUCCESS;
+}
+
+// No MIG
+
+nvmlReturn_t nvmlDeviceGetMigMode(nvmlDevice_t, unsigned int*, unsigned int*)
+{
+    return NVML_ERROR_NOT_SUPPORTED;
+}
+
+nvmlReturn_t nvmlDeviceGetGpuInstanceProfileInfoV(nvmlDevice_t, unsigned int, nvmlGpuInstanceProfileInfo_v2_t*)
+{
+    return NVML_ERROR_NOT_SUPPORTED;
+}
+
+nvmlReturn_t nvmlDeviceGetGpuInstances(nvmlDevice_t, unsigned int, nvmlGpuInstance_t*, unsigned int* count)
+{
+    *count = 0;
+    return NVML_ERROR_NOT_SUPPORTED;
+}
+
+nvmlReturn_t nvmlDeviceGetGpuInstanceById(nvmlDevice_t, unsigned int, nvmlGpuInstance_t*)
+{
+    return NVML_ERROR_NOT_SUPPORTED;
+}
+
+nvmlReturn_t nvmlDeviceGetGpuInstanceRemainingCapacity(nvmlDevice_t, unsigned int, unsigned int* count)
+{
+    *count = 0;
+    return NVML_ERROR_NOT_SUPPORTED;
+}
+
+nvmlReturn_t nvmlDeviceCreateGpuInstance(nvmlDevice_t, unsigned int, nvmlGpuInstance_t*)
+{
+    return NVML_ERROR_NOT_SUPPORTED;
+}
+
+nvmlReturn_t nvmlGpuInstanceDestroy(nvmlGpuInstance_t)
+{
+    return NVML_ERROR_NOT_SUPPORTED;
+}
+
+nvmlReturn_t nvmlGpuInstanceGetInfo(nvmlGpuInstance_t, nvmlGpuInstanceInfo_t*)
+{
+    return NVML_ERROR_NOT_SUPPORTED;
+}
+
+nvmlReturn_t nvmlGpuInstanceGetComputeInstanceProfileInfo(nvmlGpuInstance_t, unsigned int, unsigned int, nvmlComputeInstanceProfileInfo_t*)
+{
+    return NVML_ERROR_NOT_SUPPORTED;
+}
+
+nvmlReturn_t nvmlGpuInstanceCreateComputeInstance(nvmlGpuInstance_t, unsigned int, nvmlComputeInstance_t*)
+{
+    return NVML_ERROR_NOT_SUPPORTED;
+}
+
+nvmlReturn_t nvmlGpuInstanceGetComputeInstances(nvmlGpuInstance_t, unsigned int, nvmlComputeInstance_t*, unsigned int* count)
+{
+    *count = 0;
+    return NVML_ERROR_NOT_SUPPORTED;
+}
+
+nvmlReturn_t nvmlGpuInstanceGetComputeInstanceById(nvmlGpuInstance_t, unsigned int, nvmlComputeInstance_t*)
+{
+    return NVML_ERROR_NOT_SUPPORTED;
+}
+
+nvmlReturn_t nvmlComputeInstanceGetInfo(nvmlComputeInstance_t, nvmlComputeInstanceInfo_t*)
+{
+    return NVML_ERROR_NOT_SUPPORTED;
+}
+
+nvmlReturn_t nvmlComputeInstanceDestroy(nvmlComputeInstance_t)
+{
+    return NVML_ERROR_NOT_SUPPORTED;
+}
+
+nvmlReturn_t nvmlDeviceGetMaxMigDeviceCount(nvmlDevice_t, unsigned int* count)
+{
+    *count = 0;
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetMigDeviceHandleByIndex(nvmlDevice_t, unsigned int, nvmlDevice_t*)
+{
+    return NVML_ERROR_NOT_SUPPORTED;
+}
+
+nvmlReturn_t nvmlDeviceGetGpuInstanceId(nvmlDevice_t, unsigned int*)
+{
+    return NVML_ERROR_NOT_SUPPORTED;
+}
+
+nvmlReturn_t nvmlDeviceGetComputeInstanceId(nvmlDevice_t, unsigned int*)
+{
+    return NVML_ERROR_NOT_SUPPORTED;
+}
@@ -0,0 +1,20 @@
+// Synthetic NVML devices for benchmarks
+// Author: Max Schwarz <max.schwarz@ais.uni-bonn.de>
+
+#ifndef MOCK_NVML_H
+#define MOCK_NVML_H
+
+// mock_nvml.cpp implements the part of the NVML API used by gpu_server on
+// top of synthetic cards, so that the real sampling and scheduling code can
+// run without GPUs. Link it instead of libnvidia-ml.
+//
+// Without a call to mockNvmlConfigure() before nvmlInitWithFlags(), the
+// environment variables GPU_CLAIM_MOCK_CARDS (default 8) and
+// GPU_CLAIM_MOCK_PROCESSES (default 4 per card) are used.
+//
+// Processes are spread round-robin over the cards. They are real processes
+// owned by root, so that owner lookups through /proc do actual work without
+// matching the UID of any benchmark client.
+void mockNvmlConfigure(unsigned int numCards, unsigned int numProcesses);
+
+#endif
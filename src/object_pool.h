@@ -0,0 +1,82 @@
+// Pool allocator for frequently created objects
+// Author: Max Schwarz <max.schwarz@ais.uni-bonn.de>
+
+#ifndef OBJECT_POOL_H
+#define OBJECT_POOL_H
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Objects live in chunks of ChunkSize slots, freed slots are kept in a free
+// list and reused. A burst of connections then costs one allocation per
+// chunk instead of one per object, and memory is never returned to the
+// system. Objects that are still alive when the pool is destroyed are not
+// destructed.
+template<class T, std::size_t ChunkSize = 256>
+class ObjectPool
+{
+public:
+    ObjectPool() = default;
+
+    ObjectPool(const ObjectPool&) = delete;
+    ObjectPool& operator=(const ObjectPool&) = delete;
+
+    template<class... Args>
+    [[nodiscard]] T* create(Args&&... args)
+    {
+        if(!m_free)
+            grow();
+
+        Slot* slot = m_free;
+        m_free = slot->next;
+
+        try
+        {
+            return new (slot->storage) T(std::forward<Args>(args)...);
+        }
+        catch(...)
+        {
+            slot->next = m_free;
+            m_free = slot;
+            throw;
+        }
+    }
+
+    void destroy(T* obj)
+    {
+        obj->~T();
+
+        Slot* slot = reinterpret_cast<Slot*>(obj);
+        slot->next = m_free;
+        m_free = slot;
+    }
+
+private:
+    union Slot
+    {
+        Slot* next;
+        alignas(T) std::byte storage[sizeof(T)];
+    };
+
+    void grow()
+    {
+        auto chunk = std::make_unique<Slot[]>(ChunkSize);
+
+        // Hand out slots in address order
+        for(std::size_t i = ChunkSize; i-- > 0;)
+        {
+            chunk[i].next = m_free;
+            m_free = &chunk[i];
+        }
+
+        m_chunks.push_back(std::move(chunk));
+    }
+
+    std::vector<std::unique_ptr<Slot[]>> m_chunks;
+    Slot* m_free = nullptr;
+};
+
+#endif
@@ -0,0 +1,29 @@
+// SOCK_SEQPACKET helpers shared by client and server
+// Author: Max Schwarz <max.schwarz@ais.uni-bonn.de>
+
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <cstddef>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+// Receive one complete packet into buf, growing it as needed.
+// The buffer keeps its capacity, so steady-state receives don't allocate.
+// Returns the packet size, 0 on EOF or -1 on error (errno is set).
+inline ssize_t receivePacket(int fd, std::vector<std::byte>& buf, int flags = 0)
+{
+    // With MSG_TRUNC, Linux reports the real packet length (since 3.4)
+    ssize_t size = recv(fd, nullptr, 0, MSG_PEEK | MSG_TRUNC | flags);
+    if(size <= 0)
+        return size;
+
+    if(buf.size() < static_cast<std::size_t>(size))
+        buf.resize(size);
+
+    return recv(fd, buf.data(), size, flags);
+}
+
+#endif
@@ -3,23 +3,206 @@
 
 #include "priority_queue.h"
 
-#include <ranges>
+#include <cmath>
+#include <queue>
+#include <stdexcept>
+
+namespace
+{
+    // In hours, large enough to sort best-effort jobs behind all others
+    constexpr double BEST_EFFORT_PENALTY = 1e4;
+
+    double toHours(const std::chrono::system_clock::duration& d)
+    {
+        return std::chrono::duration<double, std::ratio<3600>>{d}.count();
+    }
+
+    // a is served after b. Ties (e.g. users without usage submitting at
+    // once) are broken first in, first out.
+    bool lessUrgent(const Job& a, const Job& b)
+    {
+        if(a.priority != b.priority)
+            return a.priority < b.priority;
+        if(a.submissionTime != b.submissionTime)
+            return a.submissionTime > b.submissionTime;
+        return a.pid > b.pid;
+    }
+}
+
+PriorityQueue::PriorityQueue()
+ : m_epoch{std::chrono::system_clock::now()}
+ , m_lastUpdate{m_epoch}
+{
+}
+
+double PriorityQueue::computePriority(const Job& job) const
+{
+    // Earlier submission -> higher priority. One hour of waiting makes up
+    // for one GPU-hour of recent usage.
+    double age = -toHours(job.submissionTime - m_epoch);
+    double priority = age - usage(job.uid);
+
+    // Behind everything else
+    if(job.bestEffort)
+        priority -= BEST_EFFORT_PENALTY;
+
+    return priority;
+}
+
+double PriorityQueue::usage(std::int64_t uid) const
+{
+    auto it = m_usage.find(uid);
+    if(it == m_usage.end())
+        return 0.0;
+
+    return it->second;
+}
 
 void PriorityQueue::enqueue(Job&& job)
 {
-    push_back(std::move(job));
+    if(m_index.contains(job.pid))
+        throw std::logic_error{"PriorityQueue::enqueue(): Duplicate pid"};
+
+    job.priority = computePriority(job);
+
+    m_index[job.pid] = m_heap.size();
+    m_heap.push_back(std::move(job));
+    siftUp(m_heap.size() - 1);
 }
 
-void PriorityQueue::remove(int pid)
+void PriorityQueue::pop_front()
 {
-    auto it = std::ranges::find_if(static_cast<std::deque<Job>&>(*this), [&](auto& j){
-        return j.pid == pid;
-    });
-    if(it != end())
-        erase(it);
+    eraseSlot(0);
 }
 
-void PriorityQueue::update()
+std::vector<Job> PriorityQueue::top(std::size_t n) const
 {
+    std::vector<Job> result;
+    result.reserve(std::min(n, m_heap.size()));
+
+    // Walk the heap best-first. Children of an extracted slot become candidates.
+    auto cmp = [&](std::size_t a, std::size_t b){
+        return lessUrgent(m_heap[a], m_heap[b]);
+    };
+    std::priority_queue<std::size_t, std::vector<std::size_t>, decltype(cmp)> candidates{cmp};
+
+    if(!m_heap.empty())
+        candidates.push(0);
+
+    while(!candidates.empty() && result.size() < n)
+    {
+        std::size_t idx = candidates.top();
+        candidates.pop();
+
+        result.push_back(m_heap[idx]);
+
+        for(std::size_t child : {2*idx + 1, 2*idx + 2})
+        {
+            if(child < m_heap.size())
+                candidates.push(child);
+        }
+    }
+
+    return result;
 }
 
+bool PriorityQueue::remove(int pid)
+{
+    auto it = m_index.find(pid);
+    if(it == m_index.end())
+        return false;
+
+    eraseSlot(it->second);
+    return true;
+}
+
+void PriorityQueue::accountUsage(std::int64_t uid, double gpuHours)
+{
+    m_usage[uid] += gpuHours;
+}
+
+void PriorityQueue::update(const std::chrono::system_clock::time_point& now)
+{
+    auto dt = now - m_lastUpdate;
+    m_lastUpdate = now;
+
+    if(dt.count() > 0 && m_halfLife.count() > 0)
+    {
+        double factor = std::exp2(-toHours(dt) / toHours(m_halfLife));
+        for(auto it = m_usage.begin(); it != m_usage.end();)
+        {
+            it->second *= factor;
+            if(it->second < 1e-6)
+                it = m_usage.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    for(auto& job : m_heap)
+        job.priority = computePriority(job);
+
+    // Floyd heap construction, linear in the number of jobs
+    for(std::size_t i = m_heap.size() / 2; i-- > 0;)
+        siftDown(i);
+}
+
+void PriorityQueue::swapSlots(std::size_t a, std::size_t b)
+{
+    std::swap(m_heap[a], m_heap[b]);
+    m_index[m_heap[a].pid] = a;
+    m_index[m_heap[b].pid] = b;
+}
+
+void PriorityQueue::siftUp(std::size_t idx)
+{
+    while(idx > 0)
+    {
+        std::size_t parent = (idx - 1) / 2;
+        if(!lessUrgent(m_heap[parent], m_heap[idx]))
+            break;
+
+        swapSlots(parent, idx);
+        idx = parent;
+    }
+}
+
+void PriorityQueue::siftDown(std::size_t idx)
+{
+    while(true)
+    {
+        std::size_t best = idx;
+        std::size_t left = 2*idx + 1;
+        std::size_t right = left + 1;
+
+        if(left < m_heap.size() && lessUrgent(m_heap[best], m_heap[left]))
+            best = left;
+        if(right < m_heap.size() && lessUrgent(m_heap[best], m_heap[right]))
+            best = right;
+
+        if(best == idx)
+            break;
+
+        swapSlots(idx, best);
+        idx = best;
+    }
+}
+
+void PriorityQueue::eraseSlot(std::size_t idx)
+{
+    m_index.erase(m_heap[idx].pid);
+
+    std::size_t last = m_heap.size() - 1;
+    if(idx != last)
+    {
+        m_heap[idx] = std::move(m_heap[last]);
+        m_index[m_heap[idx].pid] = idx;
+    }
+    m_heap.pop_back();
+
+    if(idx < m_heap.size())
+    {
+        siftUp(idx);
+        siftDown(idx);
+    }
+}
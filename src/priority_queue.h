@@ -4,23 +4,82 @@
 #ifndef PRIORITY_QUEUE_H
 #define PRIORITY_QUEUE_H
 
-#include <deque>
+#include <chrono>
+#include <unordered_map>
+#include <vector>
 
 #include "protocol.h"
 
-class PriorityQueue : private std::deque<Job>
+// Fair-share priority queue.
+//
+// A job's priority is its waiting time (aging) minus the recent GPU usage of
+// its user, both measured in hours. Usage decays exponentially with a
+// configurable half-life. Since all jobs age at the same rate, aging is
+// expressed relative to a fixed epoch, which keeps priorities stable between
+// updates. Best-effort jobs (ClaimRequest::bestEffort) sort behind all
+// others. Jobs with equal priority are served in submission order. Jobs are
+// kept in a binary max-heap with a pid -> heap slot index,
+// so enqueue, removal and reprioritization of a single job are O(log n).
+class PriorityQueue
 {
 public:
-    using std::deque<Job>::operator[];
-    using std::deque<Job>::size;
-    using std::deque<Job>::empty;
-    using std::deque<Job>::front;
-    using std::deque<Job>::pop_front;
+    PriorityQueue();
+
+    [[nodiscard]] std::size_t size() const
+    { return m_heap.size(); }
+    [[nodiscard]] bool empty() const
+    { return m_heap.empty(); }
+
+    // Job with the highest priority
+    [[nodiscard]] const Job& front() const
+    { return m_heap.front(); }
+    void pop_front();
+
+    // Up to n jobs in priority order, O(n log n) independent of queue length
+    [[nodiscard]] std::vector<Job> top(std::size_t n) const;
+
+    // All jobs in no particular order
+    [[nodiscard]] const std::vector<Job>& jobs() const
+    { return m_heap; }
 
     void enqueue(Job&& job);
-    void update();
 
-    void remove(int pid);
+    // Returns true if a job was removed
+    bool remove(int pid);
+
+    // Charge GPU usage to a user. Takes effect on the next update().
+    void accountUsage(std::int64_t uid, double gpuHours);
+
+    // Decay usage and recompute all priorities (O(n))
+    void update(const std::chrono::system_clock::time_point& now = std::chrono::system_clock::now());
+
+    // Recent (decayed) GPU-hours of a user
+    [[nodiscard]] double usage(std::int64_t uid) const;
+
+    // All users with recent usage, for persisting across restarts
+    [[nodiscard]] const std::unordered_map<std::int64_t, double>& usages() const
+    { return m_usage; }
+    void restoreUsage(std::int64_t uid, double gpuHours)
+    { m_usage[uid] = gpuHours; }
+
+    void setHalfLife(const std::chrono::system_clock::duration& halfLife)
+    { m_halfLife = halfLife; }
+
+private:
+    double computePriority(const Job& job) const;
+
+    void swapSlots(std::size_t a, std::size_t b);
+    void siftUp(std::size_t idx);
+    void siftDown(std::size_t idx);
+    void eraseSlot(std::size_t idx);
+
+    std::vector<Job> m_heap;
+    std::unordered_map<std::int64_t, std::size_t> m_index; // pid -> slot in m_heap
+
+    std::unordered_map<std::int64_t, double> m_usage; // uid -> decayed GPU-hours
+    std::chrono::system_clock::duration m_halfLife = std::chrono::hours{24};
+    std::chrono::system_clock::time_point m_epoch;
+    std::chrono::system_clock::time_point m_lastUpdate;
 };
 
 #endif
@@ -0,0 +1,121 @@
+// Cache for process owner lookups
+// Author: Max Schwarz <max.schwarz@ais.uni-bonn.de>
+
+#include "process_cache.h"
+#include "latency.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace
+{
+    // Field 22 of /proc/<pid>/stat, in clock ticks since boot
+    std::optional<std::uint64_t> readStartTime(int pid)
+    {
+        static auto& s_latency = latencyHistogram("proc.readStat");
+        ScopedTimer timer{s_latency};
+
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if(fd < 0)
+            return {};
+
+        char buf[1024];
+        ssize_t len = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        if(len <= 0)
+            return {};
+        buf[len] = 0;
+
+        // The command name may contain spaces and parentheses, skip past it
+        char* p = strrchr(buf, ')');
+        if(!p)
+            return {};
+
+        // p now points before field 3 (state)
+        p++;
+        for(int field = 3; field < 22; ++field)
+        {
+            p = strchr(p + 1, ' ');
+            if(!p)
+                return {};
+        }
+
+        return strtoull(p + 1, nullptr, 10);
+    }
+
+    std::optional<int> readUID(int pid)
+    {
+        static auto& s_latency = latencyHistogram("proc.stat");
+        ScopedTimer timer{s_latency};
+
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/%d", pid);
+
+        struct stat st{};
+        if(stat(path, &st) != 0)
+            return {};
+
+        return st.st_uid;
+    }
+}
+
+ProcessCache::ProcessCache(const Clock::duration& revalidateInterval)
+ : m_revalidateInterval{revalidateInterval}
+{
+}
+
+void ProcessCache::beginPass(const Clock::time_point& now)
+{
+    m_now = now;
+    m_pass++;
+}
+
+std::optional<int> ProcessCache::uid(int pid)
+{
+    auto it = m_entries.find(pid);
+    if(it != m_entries.end())
+    {
+        auto& entry = it->second;
+
+        if(m_now - entry.verified < m_revalidateInterval)
+        {
+            entry.lastPass = m_pass;
+            return entry.uid;
+        }
+
+        // Same start time -> same process
+        auto startTime = readStartTime(pid);
+        if(startTime && *startTime == entry.startTime)
+        {
+            entry.lastPass = m_pass;
+            entry.verified = m_now;
+            return entry.uid;
+        }
+
+        m_entries.erase(it);
+    }
+
+    auto startTime = readStartTime(pid);
+    auto uid = readUID(pid);
+    if(!startTime || !uid)
+        return {};
+
+    m_entries[pid] = Entry{*uid, *startTime, m_pass, m_now};
+    return uid;
+}
+
+void ProcessCache::endPass()
+{
+    std::erase_if(m_entries, [&](auto& entry){
+        return entry.second.lastPass != m_pass;
+    });
+}
@@ -0,0 +1,49 @@
+// Cache for process owner lookups
+// Author: Max Schwarz <max.schwarz@ais.uni-bonn.de>
+
+#ifndef PROCESS_CACHE_H
+#define PROCESS_CACHE_H
+
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <unordered_map>
+
+// Resolves the UID of GPU processes without touching /proc for PIDs that are
+// already known. Entries are dropped as soon as a PID is no longer reported
+// during a sampling pass. To catch PID reuse, the process start time of an
+// entry is re-checked after revalidateInterval.
+class ProcessCache
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit ProcessCache(const Clock::duration& revalidateInterval = std::chrono::seconds{30});
+
+    void beginPass(const Clock::time_point& now = Clock::now());
+
+    // UID of the process, nullopt if it does not exist
+    [[nodiscard]] std::optional<int> uid(int pid);
+
+    // Forget all processes which were not looked up during this pass
+    void endPass();
+
+    [[nodiscard]] std::size_t size() const
+    { return m_entries.size(); }
+
+private:
+    struct Entry
+    {
+        int uid = 0;
+        std::uint64_t startTime = 0;
+        std::uint64_t lastPass = 0;
+        Clock::time_point verified;
+    };
+
+    std::unordered_map<int, Entry> m_entries;
+    Clock::duration m_revalidateInterval;
+    Clock::time_point m_now;
+    std::uint64_t m_pass = 0;
+};
+
+#endif
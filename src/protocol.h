@@ -8,6 +8,8 @@
 #include <cstdint>
 #include <string>
 #include <chrono>
+#include <optional>
+#include <variant>
 
 #include <zpp_bits.h>
 
@@ -16,6 +18,27 @@ struct Process
     int uid = 0;
     int pid = 0;
     std::uint64_t memory = 0;
+
+    bool operator==(const Process&) const = default;
+};
+
+// A user sharing a card with others, see ClaimRequest::memory
+struct Tenant
+{
+    int uid = 0;
+    std::uint64_t memory = 0; // reserved bytes
+
+    bool operator==(const Tenant&) const = default;
+};
+
+// A MIG slice of a card, see ClaimRequest::migProfile
+struct MigSlice
+{
+    std::string profile; // e.g. "1g.10gb"
+    std::string uuid;
+    int reservedByUID = 0;
+
+    bool operator==(const MigSlice&) const = default;
 };
 
 struct Card
@@ -31,6 +54,16 @@ struct Card
     int reservedByUID = 0;
     std::vector<Process> processes;
 
+    // Non-empty if the card is shared. reservedByUID is 0 in that case.
+    std::vector<Tenant> tenants;
+
+    // Non-empty if the card is in MIG mode and has instances. Such cards are
+    // only claimable in slices.
+    std::vector<MigSlice> migSlices;
+
+    // False while NVML or the device node fail. Such cards are not handed out.
+    bool healthy = true;
+
     std::chrono::steady_clock::time_point lastUsageTime;
 };
 
@@ -39,7 +72,11 @@ struct Job
     std::int64_t uid = 0;
     std::int64_t pid = 0;
     std::int64_t numGPUs = 0;
-    float priority;
+    std::uint64_t memory = 0; // shared claim, see ClaimRequest::memory
+    std::string migProfile; // see ClaimRequest::migProfile
+    std::uint32_t walltime = 0; // see ClaimRequest::walltime
+    bool bestEffort = false; // see ClaimRequest::bestEffort
+    double priority = 0.0; // see PriorityQueue
     std::chrono::system_clock::time_point submissionTime;
 };
 
@@ -51,27 +88,267 @@ struct StatusResponse
     std::vector<Card> cards;
 };
 
+// zpp_bits has no optional fields: adding members changes the wire format,
+// and clients and server have to be updated together.
 struct ClaimRequest
 {
     std::uint32_t numGPUs = 0;
     bool wait = false;
+
+    // Keep the connection open while the job runs. The cards are released
+    // when it is closed (used by gpu run).
+    bool releaseOnClose = false;
+
+    // If non-zero, the job only needs this much GPU memory (bytes) and may
+    // share a card with other such jobs. Requires numGPUs == 1.
+    std::uint64_t memory = 0;
+
+    // If set (e.g. "1g.10gb"), claim a MIG slice of this profile instead of
+    // a whole card. Requires numGPUs == 1.
+    std::string migProfile;
+
+    // While waiting, send ClaimResponse progress messages (see below)
+    bool progress = false;
+
+    // Maximum runtime in seconds (0: unlimited). Afterwards the processes on
+    // the cards get SIGTERM, SIGKILL after a grace period, and the cards are
+    // released. Only for whole cards.
+    std::uint32_t walltime = 0;
+
+    // Queue behind all other jobs, but ignore the per-user limit. The job is
+    // ended like above as soon as a regular job needs its cards.
+    bool bestEffort = false;
 };
 struct ClaimResponse
 {
     std::vector<Card> claimedCards;
     std::string error;
+
+    // A progress message has queuePosition > 0 (1: next in line) and is
+    // followed by further ClaimResponses. The final response has 0.
+    std::uint32_t queuePosition = 0;
+    std::uint32_t queueLength = 0;
+    std::int64_t etaSeconds = -1; // estimated time until start, -1: unknown
 };
 
 struct ReleaseRequest
 {
     std::vector<std::uint32_t> gpus;
+    std::vector<std::string> migSlices; // by UUID
 };
 struct ReleaseResponse
 {
     std::string errors;
 };
 
-using Request = std::variant<StatusRequest, ClaimRequest, ReleaseRequest>;
+// Claim cards for numTasks tasks of numGPUs cards each (gpu array). The
+// connection stays open. The server sends one ArrayTaskStart per task as
+// soon as it is feasible, with at most maxRunning tasks running at a time.
+// The client reports finished tasks with ArrayTaskDone, which releases their
+// cards. All tasks share one place in the queue.
+struct ArrayClaimRequest
+{
+    std::uint32_t numTasks = 0;
+    std::uint32_t numGPUs = 0;
+    std::uint32_t maxRunning = 0; // 0: no limit
+};
+struct ArrayTaskStart
+{
+    std::uint32_t task = 0;
+    std::vector<Card> claimedCards;
+    std::string error; // no further tasks will be started
+};
+struct ArrayTaskDone
+{
+    std::uint32_t task = 0;
+};
+
+// Keeps the connection open. The server answers with a StatusResponse and
+// then pushes a StatusUpdate whenever a card changes.
+struct SubscribeRequest
+{
+};
+
+// Fields of a card that changed since the previous update
+struct CardDelta
+{
+    unsigned int index = 0;
+    std::optional<std::uint8_t> computeUsagePercent;
+    std::optional<std::uint64_t> memoryUsage;
+    std::optional<int> reservedByUID;
+    std::optional<std::vector<Process>> processes;
+    std::optional<std::vector<Tenant>> tenants;
+    std::optional<std::vector<MigSlice>> migSlices;
+    std::optional<bool> healthy;
+    std::optional<std::chrono::steady_clock::time_point> lastUsageTime;
+};
+struct StatusUpdate
+{
+    std::vector<CardDelta> changes;
+};
+
+// Compact status protocol
+//
+// Static card properties never change while the server is running. They are
+// only sent if the client does not know the current server generation yet,
+// the per-request payload only contains the dynamic state with varint fields.
+constexpr std::uint32_t PROTOCOL_VERSION = 5;
+
+struct CardInfo
+{
+    unsigned int index = 0;
+    unsigned int minorID = 0;
+    std::string name;
+    std::string uuid;
+    std::uint64_t memoryTotal = 0;
+};
+
+struct CompactProcess
+{
+    zpp::bits::vuint32_t uid;
+    zpp::bits::vuint32_t pid;
+    zpp::bits::vuint64_t memory;
+};
+
+struct CompactTenant
+{
+    zpp::bits::vuint32_t uid;
+    zpp::bits::vuint64_t memory;
+};
+
+struct CompactSlice
+{
+    std::string profile;
+    zpp::bits::vuint32_t reservedByUID;
+};
+
+struct CardState
+{
+    std::uint8_t computeUsagePercent = 0;
+    zpp::bits::vuint64_t memoryUsage;
+    zpp::bits::vuint32_t reservedByUID;
+    std::vector<CompactProcess> processes;
+    zpp::bits::vuint64_t lastUsageTime; // steady_clock, ms
+    std::vector<CompactTenant> tenants;
+    std::vector<CompactSlice> migSlices; // without UUIDs
+    bool healthy = true;
+};
+
+struct CompactStatusRequest
+{
+    std::uint64_t knownGeneration = 0; // 0: nothing cached
+};
+struct CompactStatusResponse
+{
+    std::uint32_t version = PROTOCOL_VERSION;
+    std::uint64_t generation = 0;
+    std::vector<CardInfo> info; // empty if knownGeneration matched
+    std::vector<CardState> cards;
+};
+
+struct HistoryRequest
+{
+};
+
+// Recent samples of one card. The server keeps one sample per sampling
+// interval, but sends at most HISTORY_POINTS of them (oldest first), each
+// covering an equal share of the history, so that the response stays within
+// the size limit of a single packet.
+constexpr std::size_t HISTORY_POINTS = 120;
+
+struct CardHistory
+{
+    unsigned int index = 0;
+
+    // Over all samples
+    std::uint32_t samples = 0;
+    std::uint8_t averageUtilization = 0; // percent
+    std::uint8_t maxUtilization = 0; // percent
+    std::uint32_t peakMemoryUsage = 0; // MB
+
+    std::vector<std::uint8_t> utilization; // average per point, percent
+    std::vector<std::uint32_t> memoryUsage; // maximum per point, MB
+};
+struct HistoryResponse
+{
+    std::uint32_t intervalMs = 0;
+    std::chrono::steady_clock::time_point lastSample;
+    std::vector<CardHistory> cards;
+};
+
+// gpu debug stats: where the server spends its time, see latency.h
+struct DebugStatsRequest
+{
+};
+struct LatencyStat
+{
+    std::string name;
+    std::uint64_t count = 0;
+    double mean = 0.0; // seconds
+    double p50 = 0.0;
+    double p99 = 0.0;
+    double max = 0.0;
+};
+struct DebugStatsResponse
+{
+    std::vector<LatencyStat> stats;
+};
+
+// Cluster mode
+//
+// Node agents (gpu_server --coordinator) connect to gpu_coordinator over TCP
+// and keep it updated with their card state. gpu run --cluster queues with
+// the coordinator, which picks a node. The job is then started there through
+// the local gpu_server, which does the actual claiming. Messages over TCP are
+// framed, see tcp.h.
+struct NodeHello
+{
+    std::string name;
+    std::uint64_t generation = 0;
+    std::vector<CardInfo> info;
+
+    // Must match gpu_coordinator --secret-file
+    std::string secret;
+};
+struct NodeUpdate
+{
+    std::vector<CardState> cards;
+    std::uint64_t now = 0; // steady_clock ms of the node, for CardState::lastUsageTime
+};
+
+// Client -> coordinator. The UID cannot be verified over TCP, it is only
+// used for fair-share ordering.
+struct ClusterClaimRequest
+{
+    std::uint32_t uid = 0;
+    std::uint32_t numGPUs = 0;
+};
+struct ClusterClaimResponse
+{
+    std::string node;
+    std::string error;
+};
+
+struct ClusterStatusRequest
+{
+};
+struct NodeStatus
+{
+    std::string name;
+    std::vector<Card> cards;
+};
+struct ClusterStatusResponse
+{
+    std::vector<NodeStatus> nodes;
+    std::uint32_t queueLength = 0;
+
+    // lastUsageTime of the cards is relative to this (coordinator clock)
+    std::chrono::steady_clock::time_point now;
+};
+
+using CoordinatorMessage = std::variant<NodeHello, NodeUpdate, ClusterClaimRequest, ClusterStatusRequest>;
+
+using Request = std::variant<StatusRequest, ClaimRequest, ReleaseRequest, SubscribeRequest, CompactStatusRequest, HistoryRequest, ArrayClaimRequest, ArrayTaskDone, DebugStatsRequest>;
 
 namespace std
 {
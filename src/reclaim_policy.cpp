@@ -0,0 +1,161 @@
+// Policies for returning idle cards to the pool
+// Author: Max Schwarz <max.schwarz@ais.uni-bonn.de>
+
+#include "reclaim_policy.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include <pwd.h>
+
+namespace
+{
+    void parseThreshold(ReclaimThresholds& thresholds, const std::string& token)
+    {
+        auto eq = token.find('=');
+        if(eq == std::string::npos)
+            throw std::runtime_error{"expected key=value, got '" + token + "'"};
+
+        std::string key = token.substr(0, eq);
+        unsigned long long value = std::stoull(token.substr(eq + 1));
+
+        if(key == "idle")
+            thresholds.idleTimeout = std::chrono::seconds{value};
+        else if(key == "window")
+            thresholds.utilizationWindow = std::chrono::seconds{value};
+        else if(key == "utilization")
+            thresholds.maxUtilization = static_cast<std::uint8_t>(std::min(value, 100ULL));
+        else if(key == "memory")
+            thresholds.maxMemoryChange = value * 1000ULL * 1000ULL;
+        else
+            throw std::runtime_error{"unknown key '" + key + "'"};
+    }
+}
+
+ThresholdPolicy::ThresholdPolicy(const ReclaimThresholds& defaults)
+ : m_defaults{defaults}
+{
+}
+
+std::unique_ptr<ThresholdPolicy> ThresholdPolicy::fromFile(const std::string& path)
+{
+    std::ifstream file{path};
+    if(!file)
+        throw std::runtime_error{"Could not open reclaim config " + path};
+
+    auto policy = std::make_unique<ThresholdPolicy>();
+
+    std::string line;
+    for(int lineNo = 1; std::getline(file, line); ++lineNo)
+    {
+        if(auto hash = line.find('#'); hash != std::string::npos)
+            line.resize(hash);
+
+        std::istringstream ss{line};
+        std::string kind;
+        if(!(ss >> kind))
+            continue;
+
+        try
+        {
+            if(kind == "default")
+            {
+                for(std::string token; ss >> token;)
+                    parseThreshold(policy->m_defaults, token);
+            }
+            else if(kind == "user")
+            {
+                std::string name;
+                if(!(ss >> name))
+                    throw std::runtime_error{"missing user name"};
+
+                struct passwd* pw = getpwnam(name.c_str());
+                if(!pw)
+                    throw std::runtime_error{"unknown user '" + name + "'"};
+
+                ReclaimThresholds thresholds = policy->m_defaults;
+                for(std::string token; ss >> token;)
+                    parseThreshold(thresholds, token);
+
+                policy->setUserThresholds(pw->pw_uid, thresholds);
+            }
+            else
+                throw std::runtime_error{"expected 'default' or 'user', got '" + kind + "'"};
+        }
+        catch(std::logic_error&) // from std::stoull
+        {
+            throw std::runtime_error{path + ":" + std::to_string(lineNo) + ": invalid number"};
+        }
+        catch(std::runtime_error& e)
+        {
+            throw std::runtime_error{path + ":" + std::to_string(lineNo) + ": " + e.what()};
+        }
+    }
+
+    return policy;
+}
+
+void ThresholdPolicy::setUserThresholds(int uid, const ReclaimThresholds& thresholds)
+{
+    m_perUser[uid] = thresholds;
+}
+
+const ReclaimThresholds& ThresholdPolicy::thresholds(int uid) const
+{
+    auto it = m_perUser.find(uid);
+    if(it == m_perUser.end())
+        return m_defaults;
+
+    return it->second;
+}
+
+std::optional<std::string> ThresholdPolicy::check(const Card& card,
+    const UsageHistory& history, const TimePoint& now) const
+{
+    const auto& t = thresholds(card.reservedByUID);
+
+    if(now - card.lastUsageTime > t.idleTimeout)
+        return "no usage for long time";
+
+    if(t.utilizationWindow.count() == 0 || history.empty())
+        return {};
+
+    // Only judge once we have seen the card for the whole window
+    auto windowStart = now - t.utilizationWindow;
+    if(history[0].time > windowStart)
+        return {};
+
+    std::uint8_t maxUtil = 0;
+    std::uint64_t minMem = UINT64_MAX;
+    std::uint64_t maxMem = 0;
+    std::size_t samples = 0;
+    for(std::size_t i = history.size(); i-- > 0; ++samples)
+    {
+        const auto& sample = history[i];
+        if(sample.time < windowStart)
+            break;
+
+        maxUtil = std::max(maxUtil, sample.computeUsagePercent);
+        minMem = std::min(minMem, sample.ownerMemory);
+        maxMem = std::max(maxMem, sample.ownerMemory);
+    }
+
+    if(samples == 0 || maxUtil > t.maxUtilization || maxMem - minMem > t.maxMemoryChange)
+        return {};
+
+    std::stringstream reason;
+    reason << "utilization at most " << int(maxUtil) << "% for "
+        << std::chrono::duration_cast<std::chrono::minutes>(t.utilizationWindow).count() << "min";
+    return reason.str();
+}
+
+std::chrono::steady_clock::duration ThresholdPolicy::window() const
+{
+    auto window = m_defaults.utilizationWindow;
+    for(auto& [uid, t] : m_perUser)
+        window = std::max(window, t.utilizationWindow);
+
+    return window;
+}
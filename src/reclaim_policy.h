@@ -0,0 +1,85 @@
+// Policies for returning idle cards to the pool
+// Author: Max Schwarz <max.schwarz@ais.uni-bonn.de>
+
+#ifndef RECLAIM_POLICY_H
+#define RECLAIM_POLICY_H
+
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+#include "protocol.h"
+#include "ring_buffer.h"
+
+// One sampler measurement of a claimed card
+struct UsageSample
+{
+    std::chrono::steady_clock::time_point time;
+    std::uint8_t computeUsagePercent = 0;
+    std::uint64_t ownerMemory = 0; // memory used by processes of the card owner
+};
+
+using UsageHistory = RingBuffer<UsageSample>;
+
+class ReclaimPolicy
+{
+public:
+    using TimePoint = std::chrono::steady_clock::time_point;
+
+    virtual ~ReclaimPolicy() = default;
+
+    // Reason for taking the card away from its owner, nullopt to keep it.
+    // history only contains samples taken since the card was claimed.
+    [[nodiscard]] virtual std::optional<std::string> check(const Card& card,
+        const UsageHistory& history, const TimePoint& now) const = 0;
+
+    // How much history check() needs
+    [[nodiscard]] virtual std::chrono::steady_clock::duration window() const = 0;
+};
+
+struct ReclaimThresholds
+{
+    // Reclaim if no process of the owner has been seen for this long
+    std::chrono::seconds idleTimeout{300};
+
+    // Reclaim if utilization stayed at or below maxUtilization and the memory
+    // of the owner's processes changed by at most maxMemoryChange during
+    // this window. Zero disables this check.
+    std::chrono::seconds utilizationWindow{0};
+    std::uint8_t maxUtilization = 0;
+    std::uint64_t maxMemoryChange = 64ULL * 1000ULL * 1000ULL;
+};
+
+// Default policy: idle timeout plus sustained-low-utilization detection,
+// with per-user thresholds.
+class ThresholdPolicy : public ReclaimPolicy
+{
+public:
+    explicit ThresholdPolicy(const ReclaimThresholds& defaults = {});
+
+    // Read thresholds from a config file. Throws std::runtime_error.
+    //
+    //   # comment
+    //   default idle=300 window=3600 utilization=5 memory=64
+    //   user alice window=0
+    //
+    // idle & window are in seconds, utilization in percent, memory in MB.
+    // User lines start from the defaults given before them.
+    static std::unique_ptr<ThresholdPolicy> fromFile(const std::string& path);
+
+    void setUserThresholds(int uid, const ReclaimThresholds& thresholds);
+    [[nodiscard]] const ReclaimThresholds& thresholds(int uid) const;
+
+    [[nodiscard]] std::optional<std::string> check(const Card& card,
+        const UsageHistory& history, const TimePoint& now) const override;
+
+    [[nodiscard]] std::chrono::steady_clock::duration window() const override;
+
+private:
+    ReclaimThresholds m_defaults;
+    std::unordered_map<int, ReclaimThresholds> m_perUser;
+};
+
+#endif
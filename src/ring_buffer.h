@@ -0,0 +1,75 @@
+// Fixed-capacity ring buffer
+// Author: Max Schwarz <max.schwarz@ais.uni-bonn.de>
+
+#ifndef RING_BUFFER_H
+#define RING_BUFFER_H
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+// Keeps the last capacity() elements. Storage is allocated once, pushing
+// into a full buffer overwrites the oldest element.
+template<class T>
+class RingBuffer
+{
+public:
+    RingBuffer() = default;
+    explicit RingBuffer(std::size_t capacity)
+     : m_data(capacity)
+    {}
+
+    [[nodiscard]] std::size_t capacity() const
+    { return m_data.size(); }
+    [[nodiscard]] std::size_t size() const
+    { return m_size; }
+    [[nodiscard]] bool empty() const
+    { return m_size == 0; }
+
+    void push(const T& value)
+    {
+        if(m_data.empty())
+            return;
+
+        m_data[m_head] = value;
+        m_head = (m_head + 1) % m_data.size();
+        if(m_size < m_data.size())
+            m_size++;
+    }
+
+    void clear()
+    {
+        m_head = 0;
+        m_size = 0;
+    }
+
+    // Element i, counted from the oldest one
+    [[nodiscard]] const T& operator[](std::size_t i) const
+    {
+        return m_data[(m_head + m_data.size() - m_size + i) % m_data.size()];
+    }
+
+    [[nodiscard]] const T& back() const
+    { return (*this)[m_size - 1]; }
+
+    // All elements, oldest first
+    [[nodiscard]] std::vector<T> toVector() const
+    {
+        std::vector<T> out;
+        out.reserve(m_size);
+
+        std::size_t start = (m_head + m_data.size() - m_size) % std::max<std::size_t>(m_data.size(), 1);
+        std::size_t first = std::min(m_size, m_data.size() - start);
+        out.insert(out.end(), m_data.begin() + start, m_data.begin() + start + first);
+        out.insert(out.end(), m_data.begin(), m_data.begin() + (m_size - first));
+
+        return out;
+    }
+
+private:
+    std::vector<T> m_data;
+    std::size_t m_head = 0; // next write position
+    std::size_t m_size = 0;
+};
+
+#endif
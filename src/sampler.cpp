@@ -0,0 +1,228 @@
+// Background NVML sampler
+// Author: Max Schwarz <max.schwarz@ais.uni-bonn.de>
+
+#include "sampler.h"
+#include "latency.h"
+#include "log.h"
+
+#include <nvml.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <cstring>
+#include <array>
+#include <algorithm>
+#include <optional>
+#include <stdexcept>
+#include <string>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace
+{
+    constexpr std::chrono::minutes MAX_BACKOFF{5};
+
+    // Returns a description of the error if the device failed
+    std::optional<std::string> updateCardFromNVML(unsigned int devIdx, nvmlDevice_t dev, Card& card, ProcessCache& processes)
+    {
+        static auto& s_memoryInfo = latencyHistogram("nvml.getMemoryInfo");
+        static auto& s_utilization = latencyHistogram("nvml.getUtilizationRates");
+        static auto& s_computeProcesses = latencyHistogram("nvml.getComputeRunningProcesses");
+        static auto& s_graphicsProcesses = latencyHistogram("nvml.getGraphicsRunningProcesses");
+
+        std::array<nvmlProcessInfo_t, 128> processBuf;
+
+        card.index = devIdx;
+
+        nvmlMemory_t mem{};
+        if(auto err = timed(s_memoryInfo, [&]{ return nvmlDeviceGetMemoryInfo(dev, &mem); }))
+            return std::string{"Could not get memory info: "} + nvmlErrorString(err);
+        card.memoryTotal = mem.total;
+        card.memoryUsage = mem.used;
+
+        // Not available in MIG mode
+        nvmlUtilization_t util{};
+        if(auto err = timed(s_utilization, [&]{ return nvmlDeviceGetUtilizationRates(dev, &util); }); err && err != NVML_ERROR_NOT_SUPPORTED)
+            return std::string{"Could not get utilization info: "} + nvmlErrorString(err);
+        card.computeUsagePercent = util.gpu;
+
+        unsigned int procCount = processBuf.size();
+        if(auto err = timed(s_computeProcesses, [&]{ return nvmlDeviceGetComputeRunningProcesses(dev, &procCount, processBuf.data()); }))
+        {
+            logError("Could not get running processes: %s", nvmlErrorString(err));
+            procCount = 0;
+        }
+
+        card.processes.clear();
+        for(unsigned int i = 0; i < procCount; ++i)
+        {
+            auto& proc = card.processes.emplace_back();
+            proc.pid = processBuf[i].pid;
+            proc.memory = processBuf[i].usedGpuMemory;
+
+            auto uid = processes.uid(proc.pid);
+            if(!uid)
+            {
+                card.processes.pop_back();
+                continue;
+            }
+
+            proc.uid = *uid;
+        }
+
+        procCount = processBuf.size();
+        if(auto err = timed(s_graphicsProcesses, [&]{ return nvmlDeviceGetGraphicsRunningProcesses(dev, &procCount, processBuf.data()); }))
+        {
+            logError("Could not get running processes: %s", nvmlErrorString(err));
+            procCount = 0;
+        }
+
+        for(unsigned int i = 0; i < procCount; ++i)
+        {
+            auto it = std::find_if(card.processes.begin(), card.processes.end(), [&](auto& proc){
+                return proc.pid == static_cast<int>(processBuf[i].pid);
+            });
+
+            if(it != card.processes.end())
+            {
+                it->memory += processBuf[i].usedGpuMemory;
+                continue;
+            }
+
+            auto& proc = card.processes.emplace_back();
+            proc.pid = processBuf[i].pid;
+            proc.memory = processBuf[i].usedGpuMemory;
+
+            auto uid = processes.uid(proc.pid);
+            if(!uid)
+            {
+                card.processes.pop_back();
+                continue;
+            }
+
+            proc.uid = *uid;
+        }
+
+        return {};
+    }
+}
+
+Sampler::Sampler(unsigned int numDevices, std::chrono::steady_clock::duration interval)
+ : m_numDevices{numDevices}
+ , m_interval{interval}
+{
+    // Handles stay valid until nvmlShutdown(). Missing ones are retried in sample().
+    m_handles.resize(numDevices);
+    m_health.resize(numDevices);
+    for(unsigned int devIdx = 0; devIdx < numDevices; ++devIdx)
+    {
+        if(nvmlDeviceGetHandleByIndex(devIdx, &m_handles[devIdx]) != NVML_SUCCESS)
+            m_handles[devIdx] = nullptr;
+    }
+
+    m_eventFD = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(m_eventFD < 0)
+        throw std::runtime_error{std::string{"Could not create eventfd: "} + strerror(errno)};
+
+    m_thread = std::jthread{[this](std::stop_token stop){ run(stop); }};
+}
+
+Sampler::~Sampler()
+{
+    m_thread.request_stop();
+    if(m_thread.joinable())
+        m_thread.join();
+
+    if(m_eventFD >= 0)
+        close(m_eventFD);
+}
+
+void Sampler::sample(Snapshot& snapshot)
+{
+    snapshot.cards.resize(m_numDevices);
+
+    auto now = std::chrono::steady_clock::now();
+
+    m_processCache.beginPass();
+    for(unsigned int devIdx = 0; devIdx < m_numDevices; ++devIdx)
+    {
+        auto& card = snapshot.cards[devIdx];
+        auto& health = m_health[devIdx];
+
+        card.index = devIdx;
+        card.healthy = false;
+
+        if(health.failures != 0 && now < health.retry)
+            continue;
+
+        std::optional<std::string> error;
+        if(!m_handles[devIdx])
+        {
+            if(auto err = nvmlDeviceGetHandleByIndex(devIdx, &m_handles[devIdx]))
+            {
+                error = std::string{"Could not get device: "} + nvmlErrorString(err);
+                m_handles[devIdx] = nullptr;
+            }
+        }
+
+        if(!error)
+            error = updateCardFromNVML(devIdx, m_handles[devIdx], card, m_processCache);
+
+        if(!error)
+        {
+            if(health.failures != 0)
+                logInfo("Card %u recovered after %u failed attempts.", devIdx, health.failures);
+
+            health.failures = 0;
+            card.healthy = true;
+            continue;
+        }
+
+        // E.g. fallen off the bus (Xid 79). Keep going with the others.
+        auto backoff = std::min<std::chrono::steady_clock::duration>(
+            m_interval * (1u << std::min(health.failures, 16u)), MAX_BACKOFF
+        );
+        health.failures++;
+        health.retry = now + backoff;
+
+        logWarning("Card %u: %s. Retrying in %lds.", devIdx, error->c_str(),
+            std::chrono::duration_cast<std::chrono::seconds>(backoff).count()
+        );
+    }
+    m_processCache.endPass();
+
+    snapshot.time = std::chrono::steady_clock::now();
+    snapshot.duration = snapshot.time - now;
+
+    static auto& s_pass = latencyHistogram("sampler.pass");
+    s_pass.observe(snapshot.duration);
+    snapshot.generation = ++m_generation;
+}
+
+void Sampler::run(std::stop_token stop)
+{
+    std::shared_ptr<Snapshot> front;
+
+    while(!stop.stop_requested())
+    {
+        auto deadline = std::chrono::steady_clock::now() + m_interval;
+
+        // Reuse the old buffer (and its allocations) if nobody holds it anymore
+        if(!m_back || m_back.use_count() != 1)
+            m_back = std::make_shared<Snapshot>();
+
+        sample(*m_back);
+
+        m_snapshot.store(m_back, std::memory_order_release);
+        std::swap(front, m_back);
+
+        std::uint64_t one = 1;
+        if(write(m_eventFD, &one, sizeof(one)) != sizeof(one))
+            logError("Could not signal new snapshot: %s", strerror(errno));
+
+        std::unique_lock lock{m_mutex};
+        m_cond.wait_until(lock, stop, deadline, []{ return false; });
+    }
+}
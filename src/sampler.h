@@ -0,0 +1,79 @@
+// Background NVML sampler
+// Author: Max Schwarz <max.schwarz@ais.uni-bonn.de>
+
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <nvml.h>
+
+#include "process_cache.h"
+#include "protocol.h"
+
+// Immutable result of one sampling pass over all devices.
+// Only the NVML-derived fields of the cards are filled in (index,
+// computeUsagePercent, memoryTotal, memoryUsage, processes, healthy).
+// The other fields of unhealthy cards are unspecified.
+struct Snapshot
+{
+    std::uint64_t generation = 0;
+    std::chrono::steady_clock::time_point time;
+    std::chrono::steady_clock::duration duration{}; // time taken by the NVML pass
+    std::vector<Card> cards;
+};
+
+class Sampler
+{
+public:
+    Sampler(unsigned int numDevices, std::chrono::steady_clock::duration interval);
+    ~Sampler();
+
+    Sampler(const Sampler&) = delete;
+    Sampler& operator=(const Sampler&) = delete;
+
+    // Becomes readable (eventfd semantics) whenever a new snapshot was published
+    [[nodiscard]] int eventFD() const
+    { return m_eventFD; }
+
+    // Latest published snapshot, nullptr before the first pass completed
+    [[nodiscard]] std::shared_ptr<const Snapshot> snapshot() const
+    { return m_snapshot.load(std::memory_order_acquire); }
+
+private:
+    void run(std::stop_token stop);
+    void sample(Snapshot& snapshot);
+
+    unsigned int m_numDevices = 0;
+    std::vector<nvmlDevice_t> m_handles;
+
+    // A failing device is retried with exponential backoff, the others
+    // are sampled as usual
+    struct Health
+    {
+        unsigned int failures = 0;
+        std::chrono::steady_clock::time_point retry;
+    };
+    std::vector<Health> m_health;
+    ProcessCache m_processCache;
+    std::chrono::steady_clock::duration m_interval;
+    int m_eventFD = -1;
+
+    std::atomic<std::shared_ptr<const Snapshot>> m_snapshot;
+
+    // Back buffer, reused whenever the event loop is done with it
+    std::shared_ptr<Snapshot> m_back;
+    std::uint64_t m_generation = 0;
+
+    std::mutex m_mutex;
+    std::condition_variable_any m_cond;
+    std::jthread m_thread;
+};
+
+#endif
@@ -13,22 +13,48 @@
 #include <algorithm>
 #include <chrono>
 #include <memory>
+#include <optional>
 #include <ranges>
+#include <span>
 #include <sstream>
+#include <unordered_map>
+#include <unordered_set>
+#include <iostream>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/epoll.h>
-#include <sys/timerfd.h>
+#include <sys/resource.h>
 #include <unistd.h>
+#include <signal.h>
 #include <pwd.h>
+#include <grp.h>
 
 #include <zpp_bits.h>
 
+#include <boost/program_options.hpp>
+
 #include "protocol.h"
+#include "backfill.h"
+#include "compact.h"
+#include "coordinator_link.h"
+#include "delta.h"
+#include "histogram.h"
+#include "journal.h"
+#include "latency.h"
+#include "log.h"
+#include "metrics.h"
+#include "mig.h"
+#include "object_pool.h"
+#include "packet.h"
 #include "priority_queue.h"
+#include "reclaim_policy.h"
+#include "sampler.h"
+#include "status_segment.h"
+#include "tcp.h"
+#include "topology.h"
 
 namespace
 {
@@ -36,6 +62,9 @@ namespace
     template<class... Ts> overloaded(Ts...) -> overloaded<Ts...>;
 }
 
+struct Client;
+void scheduleDelete(Client* client);
+
 struct Client
 {
     int fd = -1;
@@ -43,322 +72,1811 @@ struct Client
     int uid = -1;
     int pid = -1;
     bool waitingOnQueue = false;
+    bool subscribed = false;
+
+    // Queue position updates, see ClaimRequest::progress
+    bool progress = false;
+    std::chrono::steady_clock::time_point lastProgress;
+
+    // Cards claimed through this connection are released when it closes
+    bool releaseOnClose = false;
+
+    // gpu array, see ArrayClaimRequest
+    struct Array
+    {
+        std::uint32_t numTasks = 0;
+        std::uint32_t numGPUs = 0;
+        std::uint32_t maxRunning = 0;
+        std::uint32_t nextTask = 0;
+        std::chrono::system_clock::time_point submissionTime;
+        std::unordered_map<std::uint32_t, std::vector<unsigned int>> running; // task -> cards
+    };
+    std::optional<Array> array;
+
+    // Position in g_clients, kept up to date for O(1) removal
+    std::size_t slot = 0;
+
+    // Intrusive deletion list, see scheduleDelete()
+    bool pendingDelete = false;
+    Client* nextPendingDelete = nullptr;
 
     explicit Client(int fd);
 
     ~Client()
     {
-        printf("Closing connection to client %d (UID %d)\n", pid, uid);
+        logDebug("Closing connection to client %d (UID %d)", pid, uid);
         if(fd >= 0)
             close(fd);
     };
 
-    // Return false if the client should be deleted
+    // Handle all pending requests. Return false if the client should be deleted.
     [[nodiscard]] bool communicate();
 
-    void send(auto&& msg)
+    // Return false if the client should be deleted
+    [[nodiscard]] bool handle(const Request& req);
+
+    // Replies never block the event loop. A client which does not read them
+    // (full socket buffer) or is gone is disconnected, unless dropIfFull is
+    // set for messages it can do without. Returns false if nothing was sent.
+    bool send(auto&& msg, bool dropIfFull = false)
+    {
+        static auto& s_serialize = latencyHistogram("client.serialize");
+
+        {
+            ScopedTimer timer{s_serialize};
+            sendBuffer.clear();
+            zpp::bits::out out{sendBuffer};
+            out(msg).or_throw();
+        }
+
+        return sendSerialized(sendBuffer, dropIfFull);
+    }
+
+    // Send a message which is already serialized, see statusResponse()
+    bool sendSerialized(std::span<const std::byte> data, bool dropIfFull = false)
     {
-        auto [data, out] = zpp::bits::data_out();
-        out(msg).or_throw();
+        static auto& s_send = latencyHistogram("client.send");
+
+        ScopedTimer timer{s_send};
+        if(::send(fd, data.data(), data.size(), MSG_EOR | MSG_NOSIGNAL | MSG_DONTWAIT) == static_cast<ssize_t>(data.size()))
+            return true;
+
+        if(errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            if(dropIfFull)
+                return false;
+
+            logWarning("Disconnecting client %d (UID %d), it does not read its replies", pid, uid);
+        }
+        else
+            logError("Could not send response: %s", strerror(errno));
 
-        if(::send(fd, data.data(), data.size(), MSG_EOR) != data.size())
-            perror("Could not send response");
+        scheduleDelete(this);
+        return false;
     }
+
+    // Reused across messages to avoid allocations
+    std::vector<std::byte> sendBuffer;
+    std::vector<std::byte> recvBuffer;
 };
 
 std::vector<Card> g_cards;
-std::vector<std::unique_ptr<Client>> g_clients;
+
+// Server-side per-card state, parallel to g_cards
+struct Device
+{
+    nvmlDevice_t handle{};
+    std::string path; // /dev/nvidiaN
+    std::chrono::steady_clock::time_point claimStart;
+
+    // Connection which holds the claim, see ClaimRequest::releaseOnClose
+    Client* holder = nullptr;
+
+    // The holder is gone, release as soon as the user's processes have exited
+    bool releaseWhenIdle = false;
+
+    // See ClaimRequest::walltime and ClaimRequest::bestEffort
+    std::chrono::steady_clock::duration walltime{}; // zero: unlimited
+    bool bestEffort = false;
+
+    // The claim is being ended (walltime or preemption). SIGTERM was sent at
+    // terminateTime, SIGKILL follows after the grace period.
+    std::chrono::steady_clock::time_point terminateTime{};
+    bool killSent = false;
+
+    // Samples since the card was claimed, for the reclaim policy
+    UsageHistory usage;
+
+    // Long-term history for HistoryRequest, one entry per snapshot
+    RingBuffer<std::uint8_t> utilizationHistory;
+    RingBuffer<std::uint32_t> memoryHistory; // MB
+
+    // Per-tenant state of a shared card, parallel to Card::tenants
+    struct Share
+    {
+        Client* holder = nullptr;
+        std::chrono::steady_clock::time_point claimStart;
+        std::chrono::steady_clock::time_point lastUsageTime;
+        bool releaseWhenIdle = false;
+    };
+    std::vector<Share> shares;
+
+    // In MIG mode, the card is only claimable in slices
+    bool mig = false;
+
+    // Cached, NVML is only asked again after creating or destroying an
+    // instance (see refreshMigCapacity())
+    std::vector<MigCapacity> migCapacity;
+
+    // See Card::healthy
+    bool nvmlHealthy = true; // last sample succeeded
+    bool nodeFault = false; // changing the owner of the device node failed
+
+    // Per-slice state, parallel to Card::migSlices
+    struct Slice
+    {
+        MigInstance instance;
+        Client* holder = nullptr;
+        std::chrono::steady_clock::time_point claimStart;
+        std::chrono::steady_clock::time_point lastUsageTime;
+        bool releaseWhenIdle = false;
+    };
+    std::vector<Slice> slices;
+};
+std::vector<Device> g_devices;
+Topology g_topology;
+ObjectPool<Client> g_clientPool;
+std::vector<Client*> g_clients; // owned by g_clientPool
+std::size_t g_maxClients = 10000;
 PriorityQueue g_jobQueue;
 std::size_t gpuLimitPerUser = 8;
-std::vector<Client*> deleteList;
+std::unordered_map<int, Client*> g_waitingClients; // pid -> client with a queued job
+std::unordered_map<std::int64_t, std::size_t> g_claimedByUID; // uid -> number of claimed cards
+Client* g_deleteList = nullptr;
+std::unordered_set<Client*> g_subscribers;
+std::vector<Card> g_lastPublished; // card state last pushed to subscribers
+std::vector<std::byte> g_statusCache; // serialized StatusResponse, empty: outdated
+std::uint64_t g_generation = 0; // identifies static card info, changes on restart
+bool g_scheduleRequested = false;
+std::chrono::steady_clock::time_point g_lastSampleTime;
+
+RuntimeEstimator g_runtimes;
+bool g_backfill = true;
+std::size_t g_backfillDepth = 100;
+std::chrono::steady_clock::duration g_progressInterval = std::chrono::seconds{30};
+std::chrono::steady_clock::duration g_terminateGrace = std::chrono::seconds{60};
+std::chrono::steady_clock::duration g_ownershipCheckInterval = std::chrono::minutes{1};
+std::chrono::steady_clock::time_point g_lastOwnershipCheck;
+std::unique_ptr<ReclaimPolicy> g_reclaimPolicy;
+std::chrono::milliseconds g_sampleInterval{1000};
+int g_shareGID = -1; // group owning shared and MIG cards, -1: sharing disabled
+std::unique_ptr<Journal> g_journal; // nullptr: no persistence
+std::unordered_map<std::int64_t, Job> g_restoredJobs; // pid -> job queued before the restart
+std::chrono::steady_clock::duration g_stateSyncInterval = std::chrono::seconds{30};
+std::chrono::steady_clock::time_point g_lastStateSync;
+
+// Cluster mode, see NodeHello
+std::string g_coordinator; // host:port, empty: standalone
+std::string g_nodeName;
+std::string g_coordinatorSecret;
+std::unique_ptr<CoordinatorLink> g_coordinatorLink; // nullptr: standalone
+std::vector<Card> g_lastSentToCoordinator;
+
+// Prometheus endpoint, nullptr if --metrics-port is not given
+std::unique_ptr<MetricsServer> g_metrics;
+
+// Shared memory status for local readers, nullptr if disabled
+std::unique_ptr<StatusSegmentWriter> g_statusSegment;
+bool g_statusSegmentOutdated = true;
+Histogram g_queueWait{1.0, 2.0, 18};        // 1s .. 36h
+Histogram g_startDuration{1e-5, 2.0, 20};   // 10us .. 5s
+Histogram g_sampleDuration{1e-4, 2.0, 18};  // 100us .. 13s
+Histogram g_loopDuration{1e-6, 2.0, 22};    // 1us .. 2s
+
+// The journal stores wall clock times
+std::chrono::system_clock::time_point toSystemTime(const std::chrono::steady_clock::time_point& tp)
+{
+    return std::chrono::system_clock::now() + std::chrono::duration_cast<std::chrono::system_clock::duration>(
+        tp - std::chrono::steady_clock::now()
+    );
+}
+
+std::chrono::steady_clock::time_point toSteadyTime(const std::chrono::system_clock::time_point& tp)
+{
+    return std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        tp - std::chrono::system_clock::now()
+    );
+}
+
+// Close the client connection at the end of the current event loop iteration.
+// Safe to call multiple times.
+void scheduleDelete(Client* client)
+{
+    if(client->pendingDelete)
+        return;
+
+    client->pendingDelete = true;
+    client->nextPendingDelete = g_deleteList;
+    g_deleteList = client;
+}
+
+std::size_t claimedCards(std::int64_t uid)
+{
+    auto it = g_claimedByUID.find(uid);
+    if(it == g_claimedByUID.end())
+        return 0;
+
+    return it->second;
+}
+
+// Run the feasibility pass at the end of the current event loop iteration
+void requestSchedule()
+{
+    g_scheduleRequested = true;
+}
+
+// Call whenever g_cards changes
+void cardsChanged()
+{
+    // Keeps the capacity, so rebuilding usually does not allocate
+    g_statusCache.clear();
 
-void claim(Card& card, int uid, int gid=65534)
+    // Written once at the end of the event loop iteration
+    g_statusSegmentOutdated = true;
+}
+
+// StatusResponse for g_cards, serialized once and then shared by all status
+// requests until the cards change
+std::span<const std::byte> statusResponse()
+{
+    if(g_statusCache.empty())
+    {
+        zpp::bits::out out{g_statusCache};
+        out(StatusResponse{g_cards}).or_throw();
+    }
+
+    return g_statusCache;
+}
+
+void updateHealth(Card& card)
+{
+    auto& device = g_devices[card.index];
+    bool healthy = device.nvmlHealthy && !device.nodeFault;
+    if(healthy == card.healthy)
+        return;
+
+    card.healthy = healthy;
+    cardsChanged();
+    if(healthy)
+    {
+        logInfo("Card %u is schedulable again.", card.index);
+        requestSchedule();
+    }
+    else
+        logWarning("Card %u is unschedulable.", card.index);
+}
+
+// The device node could not be changed. The card is taken out of scheduling
+// until validateOwnership() succeeds.
+void deviceNodeFault(Card& card, const std::string& path, int uid)
+{
+    logError("Could not set owner of %s to UID %d: %s", path.c_str(), uid, strerror(errno));
+    g_devices[card.index].nodeFault = true;
+    updateHealth(card);
+}
+
+// Returns false if the device node could not be changed. Releasing (uid 0)
+// always succeeds as far as the bookkeeping is concerned. Best-effort claims
+// do not count towards the per-user limit.
+bool claim(Card& card, int uid, Client* holder = nullptr, std::uint32_t walltime = 0, bool bestEffort = false)
 {
     if(uid < 0)
         throw std::logic_error{"claim(): Invalid UID"};
 
-    char buf[256];
-    snprintf(buf, sizeof(buf), "/dev/nvidia%u", card.minorID);
+    auto& device = g_devices[card.index];
+    int gid = uid == 0 ? 0 : 65534;
+
+    if(chown(device.path.c_str(), uid, gid) != 0)
+    {
+        deviceNodeFault(card, device.path, uid);
+        if(uid != 0)
+            return false;
+    }
 
-    if(chown(buf, uid, gid) != 0)
+    auto now = std::chrono::steady_clock::now();
+    if(uid == 0 && card.reservedByUID != 0)
     {
-        fprintf(stderr, "Could not set owner of %s to UID %d: %s\n",
-            buf, uid, strerror(errno)
+        g_runtimes.record(card.reservedByUID, now - device.claimStart);
+        audit("release", "card=%u uid=%d seconds=%.0f",
+            card.index, card.reservedByUID, std::chrono::duration<double>{now - device.claimStart}.count()
         );
-        std::exit(1);
     }
+    else if(uid != 0)
+    {
+        device.claimStart = now;
+        audit("claim", "card=%u uid=%d", card.index, uid);
+    }
+
+    device.holder = holder;
+    device.releaseWhenIdle = false;
+    device.usage.clear();
+
+    if(card.reservedByUID != 0 && !device.bestEffort && --g_claimedByUID[card.reservedByUID] == 0)
+        g_claimedByUID.erase(card.reservedByUID);
+    if(uid != 0 && !bestEffort)
+        g_claimedByUID[uid]++;
+
+    device.walltime = std::chrono::seconds{walltime};
+    device.bestEffort = bestEffort;
+    device.terminateTime = {};
+    device.killSent = false;
+
     card.reservedByUID = uid;
-    card.lastUsageTime = std::chrono::steady_clock::now();
+    card.lastUsageTime = now;
+    cardsChanged();
+
+    if(g_journal)
+    {
+        if(uid == 0)
+            g_journal->release(card.index);
+        else
+            g_journal->claim(card.index, uid, toSystemTime(now), holder != nullptr, walltime, bestEffort);
+    }
 
     if(uid == 0)
-        printf("Card %d released.\n", card.index);
+        logInfo("Card %d released.", card.index);
     else
-        printf("Card %d claimed by UID %d.\n", card.index, uid);
+        logInfo("Card %d claimed by UID %d.", card.index, uid);
+
+    return true;
 }
 
 void release(Card& card)
 {
-    claim(card, 0, 0);
+    claim(card, 0);
+    requestSchedule();
 }
 
-void updateCardFromNVML(unsigned int devIdx, Card& card, const std::chrono::steady_clock::time_point& now = std::chrono::steady_clock::now())
+// Add a tenant to a shared card, or start sharing a free one.
+// Returns false if the device node could not be changed.
+bool addTenant(Card& card, int uid, std::uint64_t memory, Client* holder)
 {
-    char buf[1024];
-    std::array<nvmlProcessInfo_t, 128> processBuf;
+    auto& device = g_devices[card.index];
 
-    nvmlDevice_t dev{};
-    if(auto err = nvmlDeviceGetHandleByIndex(devIdx, &dev))
+    // All tenants get access through the group
+    if(card.tenants.empty() && chown(device.path.c_str(), 0, g_shareGID) != 0)
     {
-        fprintf(stderr, "Could not get device %u: %s\n", devIdx, nvmlErrorString(err));
-        std::exit(1);
+        deviceNodeFault(card, device.path, 0);
+        return false;
     }
 
-    nvmlMemory_t mem{};
-    if(auto err = nvmlDeviceGetMemoryInfo(dev, &mem))
-    {
-        fprintf(stderr, "Could not get memory info: %s\n", nvmlErrorString(err));
-        std::exit(1);
-    }
-    card.memoryTotal = mem.total;
-    card.memoryUsage = mem.used;
+    auto now = std::chrono::steady_clock::now();
+    card.tenants.push_back(Tenant{uid, memory});
+    device.shares.push_back(Device::Share{holder, now, now, false});
+    cardsChanged();
+    g_claimedByUID[uid]++;
+
+    audit("share", "card=%u uid=%d memory_mb=%lu", card.index, uid, memory / 1000000UL);
+
+    if(g_journal)
+        g_journal->addTenant(card.index, uid, memory, toSystemTime(now), holder != nullptr);
+
+    logInfo("Card %d: UID %d reserved %lu MB (%lu tenants).",
+        card.index, uid, memory / 1000000UL, card.tenants.size()
+    );
+
+    return true;
+}
 
-    nvmlUtilization_t util{};
-    if(auto err = nvmlDeviceGetUtilizationRates(dev, &util))
+void removeTenant(Card& card, std::size_t idx)
+{
+    auto& device = g_devices[card.index];
+    int uid = card.tenants[idx].uid;
+
+    auto now = std::chrono::steady_clock::now();
+    g_runtimes.record(uid, now - device.shares[idx].claimStart);
+    audit("unshare", "card=%u uid=%d seconds=%.0f",
+        card.index, uid, std::chrono::duration<double>{now - device.shares[idx].claimStart}.count()
+    );
+
+    if(--g_claimedByUID[uid] == 0)
+        g_claimedByUID.erase(uid);
+
+    card.tenants.erase(card.tenants.begin() + idx);
+    device.shares.erase(device.shares.begin() + idx);
+    cardsChanged();
+
+    if(g_journal)
+        g_journal->removeTenant(card.index, uid);
+
+    logInfo("Card %d: UID %d left (%lu tenants).", card.index, uid, card.tenants.size());
+
+    if(card.tenants.empty())
     {
-        fprintf(stderr, "Could not get utilization info: %s\n", nvmlErrorString(err));
-        std::exit(1);
+        if(chown(device.path.c_str(), 0, 0) != 0)
+            deviceNodeFault(card, device.path, 0);
+
+        card.lastUsageTime = now;
+        logInfo("Card %d released.", card.index);
     }
-    card.computeUsagePercent = util.gpu;
 
-    if(auto err = nvmlDeviceGetMinorNumber(dev, &card.minorID))
+    requestSchedule();
+}
+
+void refreshMigCapacity(Device& device)
+{
+    device.migCapacity = migCapacity(device.handle);
+}
+
+// MIG slices are accessed through their capability nodes, the parent device
+// node is accessible to the share group. Returns false on failure.
+bool setSliceOwner(Card& card, const Device::Slice& slice, int uid)
+{
+    int gid = uid == 0 ? 0 : 65534;
+    for(auto& node : slice.instance.accessNodes)
     {
-        fprintf(stderr, "Could not query device ID: %s\n", nvmlErrorString(err));
-        std::exit(1);
+        // The driver makes them world-readable by default
+        if(chown(node.c_str(), uid, gid) != 0 || chmod(node.c_str(), 0400) != 0)
+        {
+            deviceNodeFault(card, node, uid);
+            return false;
+        }
     }
 
-    snprintf(buf, sizeof(buf), "/dev/nvidia%u", card.minorID);
-    struct stat st{};
-    if(stat(buf, &st) != 0)
+    return true;
+}
+
+bool claimSlice(Card& card, std::size_t idx, int uid, Client* holder)
+{
+    auto& slice = g_devices[card.index].slices[idx];
+    if(!setSliceOwner(card, slice, uid))
+        return false;
+
+    auto now = std::chrono::steady_clock::now();
+    slice.holder = holder;
+    slice.claimStart = now;
+    slice.lastUsageTime = now;
+    slice.releaseWhenIdle = false;
+
+    card.migSlices[idx].reservedByUID = uid;
+    g_claimedByUID[uid]++;
+    cardsChanged();
+
+    audit("slice_claim", "card=%u uid=%d profile=%s", card.index, uid, slice.instance.profile.c_str());
+
+    logInfo("Card %d: MIG slice %s claimed by UID %d.", card.index, slice.instance.profile.c_str(), uid);
+
+    return true;
+}
+
+void releaseSlice(Card& card, std::size_t idx)
+{
+    auto& device = g_devices[card.index];
+    auto& slice = device.slices[idx];
+    int uid = card.migSlices[idx].reservedByUID;
+
+    auto elapsed = std::chrono::steady_clock::now() - slice.claimStart;
+    g_runtimes.record(uid, elapsed);
+    audit("slice_release", "card=%u uid=%d profile=%s seconds=%.0f",
+        card.index, uid, slice.instance.profile.c_str(), std::chrono::duration<double>{elapsed}.count()
+    );
+
+    if(--g_claimedByUID[uid] == 0)
+        g_claimedByUID.erase(uid);
+
+    setSliceOwner(card, slice, 0);
+    card.migSlices[idx].reservedByUID = 0;
+    cardsChanged();
+    slice.holder = nullptr;
+    slice.releaseWhenIdle = false;
+
+    logInfo("Card %d: MIG slice %s released.", card.index, slice.instance.profile.c_str());
+
+    // Give the space back, so that the next job can have any profile
+    if(slice.instance.dynamic)
     {
-        fprintf(stderr, "Could not query owner of %s: %s\n", buf, strerror(errno));
-        std::exit(1);
+        try
+        {
+            destroyMigInstance(device.handle, slice.instance);
+            device.slices.erase(device.slices.begin() + idx);
+            card.migSlices.erase(card.migSlices.begin() + idx);
+            cardsChanged();
+        }
+        catch(std::runtime_error& e)
+        {
+            logError("Could not destroy MIG instance on card %d: %s", card.index, e.what());
+        }
+
+        refreshMigCapacity(device);
     }
-    card.reservedByUID = st.st_uid;
 
-    unsigned int procCount = processBuf.size();
-    if(auto err = nvmlDeviceGetComputeRunningProcesses(dev, &procCount, processBuf.data()))
+    requestSchedule();
+}
+
+// Summary and downsampled history of a card, see CardHistory
+CardHistory cardHistory(unsigned int index)
+{
+    auto& utilization = g_devices[index].utilizationHistory;
+    auto& memory = g_devices[index].memoryHistory;
+
+    CardHistory hist;
+    hist.index = index;
+    hist.samples = utilization.size();
+    if(utilization.empty())
+        return hist;
+
+    unsigned long sum = 0;
+    for(std::size_t i = 0; i < utilization.size(); ++i)
     {
-        fprintf(stderr, "Could not get running processes: %s\n", nvmlErrorString(err));
-        procCount = 0;
+        sum += utilization[i];
+        hist.maxUtilization = std::max(hist.maxUtilization, utilization[i]);
     }
+    hist.averageUtilization = sum / utilization.size();
+
+    for(std::size_t i = 0; i < memory.size(); ++i)
+        hist.peakMemoryUsage = std::max(hist.peakMemoryUsage, memory[i]);
 
-    card.processes.clear();
-    for(unsigned int i = 0; i < procCount; ++i)
+    // Both histories are pushed together and have the same length
+    std::size_t n = utilization.size();
+    std::size_t points = std::min(HISTORY_POINTS, n);
+    hist.utilization.reserve(points);
+    hist.memoryUsage.reserve(points);
+    for(std::size_t point = 0; point < points; ++point)
     {
-        auto& proc = card.processes.emplace_back();
-        proc.pid = processBuf[i].pid;
-        proc.memory = processBuf[i].usedGpuMemory;
+        std::size_t begin = point * n / points;
+        std::size_t end = (point + 1) * n / points;
 
-        snprintf(buf, sizeof(buf), "/proc/%u", proc.pid);
-        struct stat st{};
-        if(stat(buf, &st) != 0)
+        unsigned int bucketSum = 0;
+        std::uint32_t bucketMax = 0;
+        for(std::size_t i = begin; i < end; ++i)
         {
-            card.processes.pop_back();
-            continue;
+            bucketSum += utilization[i];
+            if(i < memory.size())
+                bucketMax = std::max(bucketMax, memory[i]);
         }
 
-        proc.uid = st.st_uid;
+        hist.utilization.push_back(bucketSum / (end - begin));
+        hist.memoryUsage.push_back(bucketMax);
     }
 
-    procCount = processBuf.size();
-    if(auto err = nvmlDeviceGetGraphicsRunningProcesses(dev, &procCount, processBuf.data()))
+    return hist;
+}
+
+// A process of the user which is still running on the card. The process list
+// may be up to one sampling interval old, so exited processes are skipped.
+const Process* activeProcess(const Card& card, int uid)
+{
+    auto it = std::ranges::find_if(card.processes, [&](const auto& proc){
+        return proc.uid == uid && (kill(proc.pid, 0) == 0 || errno != ESRCH);
+    });
+
+    if(it == card.processes.end())
+        return nullptr;
+
+    return &*it;
+}
+
+// The holding connection is done with the card. Release it now, or as soon
+// as the user's processes have exited.
+void releaseHeld(Card& card)
+{
+    auto& device = g_devices[card.index];
+    device.holder = nullptr;
+
+    if(activeProcess(card, card.reservedByUID))
+        device.releaseWhenIdle = true;
+    else
+        release(card);
+}
+
+// End a claim before its owner is done with it: SIGTERM the owner's
+// processes on the card now, see enforceClaimEnd() for the rest.
+void terminateClaim(Card& card, const char* reason)
+{
+    auto& device = g_devices[card.index];
+    if(device.terminateTime != std::chrono::steady_clock::time_point{})
+        return;
+
+    logInfo("Ending claim of UID %d on card %u, %s", card.reservedByUID, card.index, reason);
+    audit("terminate", "card=%u uid=%d reason=\"%s\"", card.index, card.reservedByUID, reason);
+
+    for(auto& proc : card.processes)
     {
-        fprintf(stderr, "Could not get running processes: %s\n", nvmlErrorString(err));
-        procCount = 0;
+        if(proc.uid == card.reservedByUID && kill(proc.pid, SIGTERM) != 0 && errno != ESRCH)
+            logError("Could not send SIGTERM to PID %ld: %s", static_cast<long>(proc.pid), strerror(errno));
     }
 
-    for(unsigned int i = 0; i < procCount; ++i)
+    device.terminateTime = std::chrono::steady_clock::now();
+}
+
+// Enforce walltimes, and finish claims ended by terminateClaim(): release
+// the card once the processes are gone, SIGKILL them after the grace period.
+void enforceClaimEnd(const std::chrono::steady_clock::time_point& now)
+{
+    for(auto& card : g_cards)
     {
-        auto it = std::find_if(card.processes.begin(), card.processes.end(), [&](auto& proc){
-            return proc.pid == processBuf[i].pid;
-        });
+        if(card.reservedByUID == 0)
+            continue;
 
-        if(it == card.processes.end())
-            it = card.processes.insert(it, {});
+        auto& device = g_devices[card.index];
+        if(device.walltime.count() != 0 && now - device.claimStart > device.walltime)
+            terminateClaim(card, "walltime exceeded");
 
-        auto& proc = card.processes.emplace_back();
-        proc.pid = processBuf[i].pid;
-        proc.memory += processBuf[i].usedGpuMemory;
+        if(device.terminateTime == std::chrono::steady_clock::time_point{})
+            continue;
 
-        snprintf(buf, sizeof(buf), "/proc/%u", proc.pid);
-        struct stat st{};
-        if(stat(buf, &st) != 0)
+        if(!activeProcess(card, card.reservedByUID))
         {
-            card.processes.pop_back();
+            logInfo("Returning card %u, job was ended", card.index);
+            release(card);
             continue;
         }
 
-        proc.uid = st.st_uid;
-    }
-
-    if(card.reservedByUID != 0)
-    {
-        for(auto& proc : card.processes)
+        if(!device.killSent && now - device.terminateTime > g_terminateGrace)
         {
-            if(card.reservedByUID == proc.uid)
-                card.lastUsageTime = now;
+            logWarning("Processes of UID %d on card %u did not exit within the grace period, killing them",
+                card.reservedByUID, card.index
+            );
+            for(auto& proc : card.processes)
+            {
+                if(proc.uid == card.reservedByUID)
+                    kill(proc.pid, SIGKILL);
+            }
+            device.killSent = true;
         }
     }
 }
 
-void periodicUpdate()
+// Ownership is tracked in memory. Every now and then make sure nobody has
+// changed the device nodes behind our back, and restore them if so. This
+// also retries device nodes which could not be changed before.
+void validateOwnership()
 {
-    auto now = std::chrono::steady_clock::now();
-    for(unsigned int devIdx = 0; devIdx < g_cards.size(); ++devIdx)
+    for(auto& card : g_cards)
     {
-        auto& card = g_cards[devIdx];
+        auto& device = g_devices[card.index];
+        if(device.path.empty())
+            continue; // failed at startup
 
-        updateCardFromNVML(devIdx, card, now);
+        struct stat st{};
+        if(stat(device.path.c_str(), &st) != 0)
+        {
+            logError("Could not query owner of %s: %s", device.path.c_str(), strerror(errno));
+            continue;
+        }
 
-        using namespace std::chrono_literals;
-        if(card.reservedByUID && now - card.lastUsageTime > 5min)
+        int gid = card.reservedByUID == 0 ? 0 : 65534;
+        if(!card.tenants.empty() || device.mig)
+            gid = g_shareGID;
+
+        if(gid < 0)
+            continue; // MIG cards without share group are not managed
+
+        if(static_cast<int>(st.st_uid) != card.reservedByUID || static_cast<int>(st.st_gid) != gid)
         {
-            printf("Returning card %u, no usage for long time\n", devIdx);
-            release(card);
+            logWarning("Owner of %s is %d:%d, restoring %d:%d",
+                device.path.c_str(), st.st_uid, st.st_gid, card.reservedByUID, gid
+            );
+
+            if(chown(device.path.c_str(), card.reservedByUID, gid) != 0)
+            {
+                deviceNodeFault(card, device.path, card.reservedByUID);
+                continue;
+            }
         }
-    }
 
-    for(auto& client : g_clients)
-    {
-        using namespace std::chrono_literals;
-        if(!client->waitingOnQueue && now - client->connectTime > 2s)
-            deleteList.push_back(client.get());
+        if(device.nodeFault)
+        {
+            device.nodeFault = false;
+            updateHealth(card);
+        }
     }
+}
 
-    // Check if next jobs are feasible
-    g_jobQueue.update();
-    while(!g_jobQueue.empty())
+// Fair-share accounting and reclaiming for the tenants of a shared card.
+// Processes can only be attributed by UID, so several shares of one user on
+// the same card count as busy as long as any of them is.
+void updateTenants(Card& card, const std::chrono::steady_clock::time_point& now, double sampleHours)
+{
+    static const UsageHistory noHistory;
+    auto& device = g_devices[card.index];
+
+    for(std::size_t i = card.tenants.size(); i-- > 0;)
     {
-        const auto& job = g_jobQueue.front();
-        auto it = std::ranges::find_if(g_clients, [&](auto& client){
-            return client->pid == job.pid;
-        });
-        if(it == g_clients.end())
-            throw std::logic_error{"Job without client"};
-        auto& client = *it;
+        auto& tenant = card.tenants[i];
+        auto& share = device.shares[i];
 
-        // Can we immediately satisfy this request?
-        std::vector<int> freeCards;
-        for(std::size_t i = 0; i < g_cards.size(); ++i)
+        // Charged by the reserved fraction of the card
+        if(card.memoryTotal != 0)
+            g_jobQueue.accountUsage(tenant.uid, sampleHours * tenant.memory / card.memoryTotal);
+
+        bool used = std::ranges::any_of(card.processes, [&](auto& proc){
+            return proc.uid == tenant.uid;
+        });
+        if(used)
         {
-            auto& card = g_cards[i];
-            if(card.reservedByUID == 0)
-                freeCards.push_back(i);
+            share.lastUsageTime = now;
+            card.lastUsageTime = now;
         }
 
-        // Never allow someone to claim all cards
-        int alreadyClaimed = std::ranges::count_if(g_cards, [=](auto& card) { return card.reservedByUID == job.uid; });
-        if(alreadyClaimed + job.numGPUs > gpuLimitPerUser)
+        if(share.releaseWhenIdle && !activeProcess(card, tenant.uid))
         {
-            printf("Sending per-user limit reached\n");
-            ClaimResponse resp;
-            resp.error = "GPU per-user limit is reached";
-            client->send(resp);
-            deleteList.push_back(client.get());
+            logInfo("Removing UID %d from card %u, job has ended", tenant.uid, card.index);
+            removeTenant(card, i);
+            continue;
         }
 
-        // Not feasible currently
-        if(job.numGPUs > freeCards.size())
-            break;
-
-        // Feasible!
-        printf("Starting job of client %ld\n", job.pid);
-        ClaimResponse resp;
-        for(unsigned int i = 0; i < job.numGPUs; ++i)
+        // Utilization cannot be attributed to a tenant, so only the idle
+        // timeout applies
+        Card view;
+        view.index = card.index;
+        view.reservedByUID = tenant.uid;
+        view.lastUsageTime = share.lastUsageTime;
+        if(auto reason = g_reclaimPolicy->check(view, noHistory, now))
         {
-            claim(g_cards[freeCards[i]], job.uid);
-            resp.claimedCards.push_back(g_cards[freeCards[i]]);
+            logInfo("Removing UID %d from card %u, %s", tenant.uid, card.index, reason->c_str());
+            removeTenant(card, i);
         }
-        client->send(resp);
-        deleteList.push_back(client.get());
-
-        g_jobQueue.pop_front();
     }
 }
 
-Client::Client(int fd)
-    : fd(fd)
-    , connectTime{std::chrono::steady_clock::now()}
+// Same as updateTenants() for claimed MIG slices. Processes are attributed to
+// a slice by UID only.
+void updateSlices(Card& card, const std::chrono::steady_clock::time_point& now, double sampleHours)
 {
-    ucred cred{};
-    socklen_t len = sizeof(cred);
-    if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+    static const UsageHistory noHistory;
+    auto& device = g_devices[card.index];
+
+    for(std::size_t i = card.migSlices.size(); i-- > 0;)
     {
-        perror("Could not get SO_PEERCRED option");
-        return;
-    }
+        int uid = card.migSlices[i].reservedByUID;
+        if(uid == 0)
+            continue;
 
-    uid = cred.uid;
-    pid = cred.pid;
+        auto& slice = device.slices[i];
+
+        if(card.memoryTotal != 0)
+            g_jobQueue.accountUsage(uid, sampleHours * slice.instance.memory / card.memoryTotal);
+
+        bool used = std::ranges::any_of(card.processes, [&](auto& proc){
+            return proc.uid == uid;
+        });
+        if(used)
+        {
+            slice.lastUsageTime = now;
+            card.lastUsageTime = now;
+        }
+
+        if(slice.releaseWhenIdle && !activeProcess(card, uid))
+        {
+            logInfo("Returning MIG slice %s of card %u, job has ended", slice.instance.profile.c_str(), card.index);
+            releaseSlice(card, i);
+            continue;
+        }
+
+        Card view;
+        view.index = card.index;
+        view.reservedByUID = uid;
+        view.lastUsageTime = slice.lastUsageTime;
+        if(auto reason = g_reclaimPolicy->check(view, noHistory, now))
+        {
+            logInfo("Returning MIG slice %s of card %u, %s", slice.instance.profile.c_str(), card.index, reason->c_str());
+            releaseSlice(card, i);
+        }
+    }
 }
 
-// Return false if the client should be deleted
-[[nodiscard]] bool Client::communicate()
+// Merge the NVML measurements of a sampler snapshot into g_cards.
+// Ownership is tracked here in the event loop, the sampler never touches it.
+void applySnapshot(const Snapshot& snapshot)
 {
-    // If authentication failed (see above), don't accept any commands.
-    if(uid < 0)
-        return false;
+    double sampleHours = 0.0;
+    if(g_lastSampleTime != std::chrono::steady_clock::time_point{})
+        sampleHours = std::chrono::duration<double, std::ratio<3600>>{snapshot.time - g_lastSampleTime}.count();
+    g_lastSampleTime = snapshot.time;
+    g_sampleDuration.observe(snapshot.duration);
+    cardsChanged();
+
+    for(auto& sample : snapshot.cards)
+    {
+        if(sample.index >= g_cards.size())
+            continue;
 
-    std::array<uint8_t, 512> buf;
+        auto& card = g_cards[sample.index];
+        auto& device = g_devices[card.index];
 
-    int ret = read(fd, buf.data(), buf.size());
-    if(ret == 0)
+        device.nvmlHealthy = sample.healthy;
+        updateHealth(card);
+
+        // Keep the last good values. Claims on the card stay as they are,
+        // but are neither charged nor reclaimed while we cannot see them.
+        if(!sample.healthy)
+            continue;
+
+        card.computeUsagePercent = sample.computeUsagePercent;
+        card.memoryTotal = sample.memoryTotal;
+        card.memoryUsage = sample.memoryUsage;
+        card.processes = sample.processes;
+
+        device.utilizationHistory.push(card.computeUsagePercent);
+        device.memoryHistory.push(card.memoryUsage / 1000000ULL);
+
+        if(!card.tenants.empty())
+            updateTenants(card, snapshot.time, sampleHours);
+        if(!card.migSlices.empty())
+            updateSlices(card, snapshot.time, sampleHours);
+
+        if(card.reservedByUID != 0)
+        {
+            // Holding a card counts towards fair-share usage, busy or not
+            g_jobQueue.accountUsage(card.reservedByUID, sampleHours);
+
+            for(auto& proc : card.processes)
+            {
+                if(card.reservedByUID == proc.uid)
+                    card.lastUsageTime = snapshot.time;
+            }
+
+            if(device.releaseWhenIdle && !activeProcess(card, card.reservedByUID))
+            {
+                logInfo("Returning card %u, job has ended", card.index);
+                release(card);
+                continue;
+            }
+
+            UsageSample usage;
+            usage.time = snapshot.time;
+            usage.computeUsagePercent = card.computeUsagePercent;
+            for(auto& proc : card.processes)
+            {
+                if(proc.uid == card.reservedByUID)
+                    usage.ownerMemory += proc.memory;
+            }
+            device.usage.push(usage);
+
+            if(auto reason = g_reclaimPolicy->check(card, device.usage, snapshot.time))
+            {
+                logInfo("Returning card %u, %s", card.index, reason->c_str());
+                release(card);
+            }
+        }
+    }
+
+    // Usage changed, so the queue order may have changed as well
+    if(!g_jobQueue.empty())
+        requestSchedule();
+}
+
+// Write a snapshot of everything needed for a warm restart
+void saveState()
+{
+    PersistentState state;
+
+    for(auto& card : g_cards)
     {
-        // Client has closed connection
-        return false;
+        auto& device = g_devices[card.index];
+
+        if(card.reservedByUID != 0)
+        {
+            state.claims[card.index] = PersistentState::Claim{
+                card.reservedByUID, 0,
+                toSystemTime(device.claimStart), toSystemTime(card.lastUsageTime),
+                device.holder != nullptr || device.releaseWhenIdle,
+                static_cast<std::uint32_t>(std::chrono::duration_cast<std::chrono::seconds>(device.walltime).count()),
+                device.bestEffort
+            };
+        }
+
+        for(std::size_t i = 0; i < card.tenants.size(); ++i)
+        {
+            auto& share = device.shares[i];
+            state.tenants.emplace(card.index, PersistentState::Claim{
+                card.tenants[i].uid, card.tenants[i].memory,
+                toSystemTime(share.claimStart), toSystemTime(share.lastUsageTime),
+                share.holder != nullptr || share.releaseWhenIdle
+            });
+        }
+    }
+
+    for(auto& job : g_jobQueue.top(g_jobQueue.size()))
+        state.queue[job.pid] = job;
+
+    // Jobs from before the restart whose client has not come back (yet)
+    for(auto it = g_restoredJobs.begin(); it != g_restoredJobs.end();)
+    {
+        if(kill(it->first, 0) != 0 && errno == ESRCH)
+            it = g_restoredJobs.erase(it);
+        else
+        {
+            state.queue.emplace(it->first, it->second);
+            ++it;
+        }
+    }
+
+    for(auto& [uid, hours] : g_jobQueue.usages())
+        state.usage[uid] = hours;
+
+    for(auto& [uid, avg] : g_runtimes.perUser())
+        state.runtimes[uid] = avg;
+    if(g_runtimes.global().samples != 0)
+        state.globalRuntime = g_runtimes.global();
+
+    g_journal->compact(state);
+}
+
+// Continue with the state of a previous instance. Device node ownership has
+// already been read and wins over the journal if they disagree.
+void restoreState(const PersistentState& state)
+{
+    std::size_t claims = 0;
+    for(auto& [idx, claim] : state.claims)
+    {
+        if(idx >= g_cards.size() || g_cards[idx].reservedByUID != claim.uid)
+            continue;
+
+        auto& device = g_devices[idx];
+        device.claimStart = toSteadyTime(claim.claimStart);
+        g_cards[idx].lastUsageTime = toSteadyTime(claim.lastUsage);
+
+        // The connection holding the claim is gone, release when the job ends
+        device.releaseWhenIdle = claim.held;
+
+        device.walltime = std::chrono::seconds{claim.walltime};
+        if(claim.bestEffort)
+        {
+            device.bestEffort = true;
+            if(--g_claimedByUID[claim.uid] == 0)
+                g_claimedByUID.erase(claim.uid);
+        }
+        claims++;
+    }
+
+    std::size_t tenants = 0;
+    for(auto& [idx, tenant] : state.tenants)
+    {
+        if(idx >= g_cards.size() || g_cards[idx].reservedByUID != 0 || g_devices[idx].mig)
+            continue;
+
+        auto& device = g_devices[idx];
+        struct stat st{};
+        if(g_shareGID < 0 || stat(device.path.c_str(), &st) != 0 || static_cast<int>(st.st_gid) != g_shareGID)
+            continue;
+
+        auto& card = g_cards[idx];
+        card.tenants.push_back(Tenant{tenant.uid, tenant.memory});
+        device.shares.push_back(Device::Share{
+            nullptr, toSteadyTime(tenant.claimStart), toSteadyTime(tenant.lastUsage), tenant.held
+        });
+        g_claimedByUID[tenant.uid]++;
+        tenants++;
+    }
+
+    for(auto& [pid, job] : state.queue)
+        g_restoredJobs[pid] = job;
+
+    for(auto& [uid, hours] : state.usage)
+        g_jobQueue.restoreUsage(uid, hours);
+
+    for(auto& [uid, avg] : state.runtimes)
+        g_runtimes.restore(uid, avg);
+    if(state.globalRuntime)
+        g_runtimes.restoreGlobal(*state.globalRuntime);
+
+    logInfo("Restored %lu claims, %lu shares and %lu queued jobs.", claims, tenants, g_restoredJobs.size());
+}
+
+// Push changed card fields to all subscribed clients
+void publishStatus()
+{
+    if(g_subscribers.empty())
+        return;
+
+    StatusUpdate update;
+    update.changes = diffCards(g_lastPublished, g_cards);
+    if(update.changes.empty())
+        return;
+
+    // A subscriber which does not keep up is disconnected by send() and can
+    // resubscribe to get a full snapshot
+    for(auto* client : g_subscribers)
+    {
+        if(!client->pendingDelete)
+            client->send(update);
     }
-    if(ret < 0)
+
+    g_lastPublished = g_cards;
+}
+
+NodeUpdate nodeUpdate()
+{
+    NodeUpdate update;
+    update.cards.reserve(g_cards.size());
+    for(auto& card : g_cards)
+        update.cards.push_back(cardState(card));
+
+    update.now = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()
+    ).count();
+
+    return update;
+}
+
+// Keep the coordinator up to date, like publishStatus(). Sending happens in
+// the background, see CoordinatorLink.
+void publishToCoordinator()
+{
+    if(!g_coordinatorLink || diffCards(g_lastSentToCoordinator, g_cards).empty())
+        return;
+
+    g_coordinatorLink->publish(nodeUpdate());
+    g_lastSentToCoordinator = g_cards;
+}
+
+void reapStaleClients(const std::chrono::steady_clock::time_point& now)
+{
+    for(auto& client : g_clients)
     {
-        perror("Could not read from client");
+        using namespace std::chrono_literals;
+        if(!client->waitingOnQueue && !client->subscribed && !client->releaseOnClose && now - client->connectTime > 2s)
+            scheduleDelete(client);
+    }
+}
+
+Client& clientForJob(const Job& job)
+{
+    auto it = g_waitingClients.find(job.pid);
+    if(it == g_waitingClients.end())
+        throw std::logic_error{"Job without client"};
+
+    return *it->second;
+}
+
+std::vector<unsigned int> freeCards()
+{
+    std::vector<unsigned int> freeCards;
+    for(std::size_t i = 0; i < g_cards.size(); ++i)
+    {
+        auto& card = g_cards[i];
+        if(card.reservedByUID == 0 && card.tenants.empty() && !g_devices[i].mig && card.healthy)
+            freeCards.push_back(i);
+    }
+    return freeCards;
+}
+
+// Card for a shared job: the fullest shared card on which it still fits,
+// otherwise a free one. nullopt if neither exists.
+std::optional<unsigned int> shareCard(const Job& job, const std::vector<unsigned int>& freeCards)
+{
+    std::optional<unsigned int> best;
+    std::uint64_t bestRemaining = UINT64_MAX;
+
+    for(auto& card : g_cards)
+    {
+        if(card.tenants.empty() || !card.healthy)
+            continue;
+
+        std::uint64_t reserved = 0;
+        for(auto& tenant : card.tenants)
+            reserved += tenant.memory;
+
+        // Tenants may use more than they asked for
+        std::uint64_t used = std::min(std::max(reserved, card.memoryUsage), card.memoryTotal);
+        std::uint64_t available = card.memoryTotal - used;
+        if(job.memory > available)
+            continue;
+
+        if(available - job.memory < bestRemaining)
+        {
+            best = card.index;
+            bestRemaining = available - job.memory;
+        }
+    }
+
+    if(best || freeCards.empty())
+        return best;
+
+    return g_topology.select(freeCards, 1).front();
+}
+
+struct MigPlacement
+{
+    unsigned int card = 0;
+    std::optional<std::size_t> slice; // nullopt: create a new instance
+};
+
+// A free slice of the requested profile, otherwise a card with room for a
+// new one
+std::optional<MigPlacement> migPlacement(const Job& job)
+{
+    if(g_shareGID < 0)
+        return {};
+
+    for(auto& card : g_cards)
+    {
+        if(!card.healthy)
+            continue;
+
+        for(std::size_t i = 0; i < card.migSlices.size(); ++i)
+        {
+            auto& slice = card.migSlices[i];
+            if(slice.reservedByUID == 0 && slice.profile == job.migProfile)
+                return MigPlacement{card.index, i};
+        }
+    }
+
+    for(auto& card : g_cards)
+    {
+        auto& device = g_devices[card.index];
+        if(device.mig && card.healthy && std::ranges::any_of(device.migCapacity, [&](auto& cap){
+            return cap.profile == job.migProfile && cap.remaining > 0;
+        }))
+            return MigPlacement{card.index, {}};
+    }
+
+    return {};
+}
+
+bool feasible(const Job& job, const std::vector<unsigned int>& freeCards)
+{
+    if(!job.migProfile.empty())
+        return migPlacement(job).has_value();
+
+    if(job.memory != 0)
+        return shareCard(job, freeCards).has_value();
+
+    return job.numGPUs <= static_cast<std::int64_t>(freeCards.size());
+}
+
+// Never allow someone to claim all cards, except with best-effort jobs
+bool overUserLimit(const Job& job)
+{
+    if(job.bestEffort)
         return false;
+
+    return claimedCards(job.uid) + job.numGPUs > gpuLimitPerUser;
+}
+
+// Queue the next task of a gpu array client. The tasks share the submission
+// time, but only one of them is queued at a time. If the client is at its
+// limit, the next task is queued once a running one has finished.
+void enqueueArrayTask(Client& client)
+{
+    auto& array = *client.array;
+    if(array.nextTask == array.numTasks || g_waitingClients.contains(client.pid))
+        return;
+
+    Job job;
+    job.uid = client.uid;
+    job.pid = client.pid;
+    job.numGPUs = array.numGPUs;
+    job.submissionTime = array.submissionTime;
+
+    if(array.maxRunning != 0 && array.running.size() >= array.maxRunning)
+        return;
+
+    // Our own tasks will free cards again, do not fail like a single claim
+    if(!array.running.empty() && overUserLimit(job))
+        return;
+
+    g_jobQueue.enqueue(std::move(job));
+    g_waitingClients[client.pid] = &client;
+    client.waitingOnQueue = true;
+
+    requestSchedule();
+}
+
+// Claim cards for the job, answer its client and remove it from the queue.
+// Returns false if a card turned out to be faulty. The job stays queued in
+// that case, and the card is taken out of freeCards and scheduling.
+bool startJob(const Job& job, std::vector<unsigned int>& freeCards)
+{
+    auto startTime = std::chrono::steady_clock::now();
+    auto& client = clientForJob(job);
+
+    ClaimResponse resp;
+    std::vector<unsigned int> selected;
+
+    if(!job.migProfile.empty())
+    {
+        auto placement = *migPlacement(job);
+        auto& card = g_cards[placement.card];
+        auto& device = g_devices[placement.card];
+
+        try
+        {
+            if(!placement.slice)
+            {
+                auto& slice = device.slices.emplace_back();
+                slice.instance = createMigInstance(device.handle, card.minorID, job.migProfile);
+                card.migSlices.push_back(MigSlice{slice.instance.profile, slice.instance.uuid, 0});
+                placement.slice = device.slices.size() - 1;
+                refreshMigCapacity(device);
+                cardsChanged();
+
+                logInfo("Created MIG instance %s on card %u.", job.migProfile.c_str(), card.index);
+            }
+
+            if(!claimSlice(card, *placement.slice, job.uid, client.releaseOnClose ? &client : nullptr))
+                return false;
+
+            // Looks like a card of its own to the client
+            Card claimed = card;
+            claimed.name += " MIG " + job.migProfile;
+            claimed.uuid = card.migSlices[*placement.slice].uuid;
+            claimed.migSlices = {card.migSlices[*placement.slice]};
+            claimed.tenants.clear();
+            resp.claimedCards.push_back(std::move(claimed));
+        }
+        catch(std::runtime_error& e)
+        {
+            if(device.slices.size() > card.migSlices.size())
+                device.slices.pop_back();
+            refreshMigCapacity(device);
+
+            logError("Could not create MIG instance on card %u: %s", card.index, e.what());
+            resp.error = std::string{"Could not create MIG instance: "} + e.what();
+        }
     }
+    else if(job.memory != 0)
+    {
+        auto& card = g_cards[*shareCard(job, freeCards)];
+        if(!addTenant(card, job.uid, job.memory, client.releaseOnClose ? &client : nullptr))
+        {
+            std::erase(freeCards, card.index);
+            return false;
+        }
+        resp.claimedCards.push_back(card);
+        selected.push_back(card.index);
+    }
+    else
+    {
+        selected = g_topology.select(freeCards, job.numGPUs);
+        for(auto idx : selected)
+        {
+            auto& card = g_cards[idx];
+            if(!claim(card, job.uid, client.releaseOnClose ? &client : nullptr, job.walltime, job.bestEffort))
+            {
+                // Undo, the job will get a different set of cards
+                for(auto& claimed : resp.claimedCards)
+                    release(g_cards[claimed.index]);
 
-    zpp::bits::in in{buf};
+                std::erase(freeCards, idx);
+                return false;
+            }
+            resp.claimedCards.push_back(card);
+        }
+    }
+
+    std::erase_if(freeCards, [&](unsigned int idx){
+        return std::ranges::find(selected, idx) != selected.end();
+    });
+
+    // Array tasks all carry the submission time of the array
+    g_startDuration.observe(std::chrono::steady_clock::now() - startTime);
+    if(!client.array)
+        g_queueWait.observe(std::chrono::system_clock::now() - job.submissionTime);
 
-    Request req;
-    auto res = in(req);
-    if(zpp::bits::failure(res))
+    g_jobQueue.remove(job.pid);
+    g_waitingClients.erase(job.pid);
+    client.waitingOnQueue = false;
+
+    if(client.array)
     {
-        fprintf(stderr, "Client sent request that could not be parsed\n");
+        std::uint32_t task = client.array->nextTask++;
+        client.array->running[task] = selected;
+        client.send(ArrayTaskStart{task, std::move(resp.claimedCards), {}});
+
+        enqueueArrayTask(client);
+        return true;
+    }
+
+    client.send(resp);
+
+    if(g_journal)
+        g_journal->dequeue(job.pid);
+
+    // Keep the connection of gpu run open for the lifetime of the job
+    if(!client.releaseOnClose || !resp.error.empty())
+        scheduleDelete(&client);
+
+    return true;
+}
+
+// Estimated release time of each busy card
+std::vector<Reservation::TimePoint> releaseTimes(Reservation::TimePoint now)
+{
+    using TimePoint = Reservation::TimePoint;
+
+    std::vector<TimePoint> releaseTimes;
+    for(auto& card : g_cards)
+    {
+        auto& device = g_devices[card.index];
+
+        // A shared card is free once its last tenant is done
+        if(!card.tenants.empty())
+        {
+            TimePoint release = now;
+            for(std::size_t i = 0; i < card.tenants.size(); ++i)
+            {
+                auto runtime = g_runtimes.estimate(card.tenants[i].uid);
+                release = runtime ? std::max(release, device.shares[i].claimStart + *runtime) : TimePoint::max();
+                if(release == TimePoint::max())
+                    break;
+            }
+            releaseTimes.push_back(release);
+            continue;
+        }
+
+        if(card.reservedByUID == 0)
+            continue;
+
+        if(auto runtime = g_runtimes.estimate(card.reservedByUID))
+            releaseTimes.push_back(std::max(now, device.claimStart + *runtime));
+        else
+            releaseTimes.push_back(TimePoint::max());
+    }
+
+    return releaseTimes;
+}
+
+// Make room for a regular job by ending best-effort claims, if that is
+// enough to start it. The most recently started claims go first, they have
+// the least work to lose.
+void preemptFor(const Job& job, const std::vector<unsigned int>& freeCards)
+{
+    if(job.bestEffort || !job.migProfile.empty())
+        return;
+
+    std::size_t needed = job.memory != 0 ? 1 : job.numGPUs;
+    if(needed <= freeCards.size())
+        return;
+    needed -= freeCards.size();
+
+    std::vector<unsigned int> candidates;
+    for(auto& card : g_cards)
+    {
+        auto& device = g_devices[card.index];
+        if(card.reservedByUID == 0 || !device.bestEffort || !card.healthy)
+            continue;
+
+        // Already on its way out
+        if(device.terminateTime != std::chrono::steady_clock::time_point{})
+        {
+            if(--needed == 0)
+                return;
+            continue;
+        }
+
+        candidates.push_back(card.index);
+    }
+
+    if(candidates.size() < needed)
+        return;
+
+    std::ranges::sort(candidates, [](unsigned int a, unsigned int b){
+        return g_devices[a].claimStart > g_devices[b].claimStart;
+    });
+
+    for(auto idx : candidates | std::views::take(needed))
+        terminateClaim(g_cards[idx], "preempted by a regular job");
+}
+
+// Start lower-priority jobs on idle cards, as long as they do not delay the
+// estimated start of the job at the head of the queue.
+void backfill(std::vector<unsigned int>& freeCards)
+{
+    using TimePoint = Reservation::TimePoint;
+    auto now = std::chrono::steady_clock::now();
+
+    // A MIG job waits for slices, not for whole cards
+    auto& head = g_jobQueue.front();
+    std::size_t headCards = head.migProfile.empty() ? head.numGPUs : 0;
+
+    auto reservation = reserve(headCards, freeCards.size(), releaseTimes(now));
+
+    auto candidates = g_jobQueue.top(g_backfillDepth + 1);
+    for(auto& job : candidates | std::views::drop(1))
+    {
+        if(!feasible(job, freeCards) || overUserLimit(job))
+            continue;
+
+        // Joining an already shared card does not take anything from the head job
+        std::size_t cardsTaken = job.numGPUs;
+        if(!job.migProfile.empty())
+            cardsTaken = 0;
+        else if(job.memory != 0 && !g_cards[*shareCard(job, freeCards)].tenants.empty())
+            cardsTaken = 0;
+
+        // Without an estimated start for the head job, any card taken might
+        // delay it indefinitely. Only spare cards (none) may be used then.
+        auto runtime = g_runtimes.estimate(job.uid);
+        bool endsInTime = runtime && reservation.start != TimePoint::max() && now + *runtime <= reservation.start;
+
+        if(!endsInTime)
+        {
+            if(cardsTaken > reservation.spareCards)
+                continue;
+
+            reservation.spareCards -= cardsTaken;
+        }
+
+        logDebug("Backfilling job of client %ld", job.pid);
+        startJob(job, freeCards);
+    }
+}
+
+// Check if next jobs are feasible
+void schedule()
+{
+    g_jobQueue.update();
+
+    auto cards = freeCards();
+
+    while(!g_jobQueue.empty())
+    {
+        Job job = g_jobQueue.front();
+
+        if(overUserLimit(job))
+        {
+            auto& client = clientForJob(job);
+
+            // Our own tasks will free cards again. Wait without the queue
+            // slot, ArrayTaskDone enqueues the next task.
+            if(client.array && !client.array->running.empty())
+            {
+                g_jobQueue.pop_front();
+                g_waitingClients.erase(job.pid);
+                client.waitingOnQueue = false;
+                continue;
+            }
+
+            logDebug("Sending per-user limit reached");
+            std::string error = "GPU per-user limit is reached";
+            if(client.array)
+                client.send(ArrayTaskStart{0, {}, error});
+            else
+                client.send(ClaimResponse{{}, error});
+
+            g_jobQueue.pop_front();
+            g_waitingClients.erase(job.pid);
+            client.waitingOnQueue = false;
+            if(g_journal && !client.array)
+                g_journal->dequeue(job.pid);
+
+            scheduleDelete(&client);
+            continue;
+        }
+
+        // Not feasible currently
+        if(!feasible(job, cards))
+        {
+            preemptFor(job, cards);
+
+            if(g_backfill)
+                backfill(cards);
+            break;
+        }
+
+        // Feasible!
+        logDebug("Starting job of client %ld", job.pid);
+        startJob(job, cards);
+    }
+}
+
+// Tell waiting clients where they are in the queue and when they can expect
+// to start, see ClaimRequest::progress
+void publishQueueProgress(const std::chrono::steady_clock::time_point& now)
+{
+    bool due = false;
+    for(auto& [pid, client] : g_waitingClients)
+    {
+        if(client->progress && now - client->lastProgress >= g_progressInterval)
+        {
+            due = true;
+            break;
+        }
+    }
+    if(!due)
+        return;
+
+    auto jobs = g_jobQueue.top(g_jobQueue.size());
+
+    std::vector<PlannedJob> planned;
+    planned.reserve(jobs.size());
+    for(auto& job : jobs)
+    {
+        // Shared and MIG claims do not wait for whole cards
+        std::size_t cards = (job.memory == 0 && job.migProfile.empty()) ? job.numGPUs : 0;
+        planned.push_back({cards, g_runtimes.estimate(job.uid)});
+    }
+
+    auto starts = estimateStarts(now, freeCards().size(), releaseTimes(now), planned);
+
+    for(std::size_t i = 0; i < jobs.size(); ++i)
+    {
+        auto& client = clientForJob(jobs[i]);
+        if(!client.progress || client.array || now - client.lastProgress < g_progressInterval)
+            continue;
+
+        ClaimResponse resp;
+        resp.queuePosition = i + 1;
+        resp.queueLength = jobs.size();
+        if(starts[i] != Reservation::TimePoint::max())
+            resp.etaSeconds = std::chrono::ceil<std::chrono::seconds>(starts[i] - now).count();
+
+        // Progress is optional. A client which does not read (e.g. a
+        // suspended gpu run) must not block the event loop, it just misses
+        // this update.
+        client.send(resp, true);
+        client.lastProgress = now;
+    }
+}
+
+Client::Client(int fd)
+    : fd(fd)
+    , connectTime{std::chrono::steady_clock::now()}
+{
+    ucred cred{};
+    socklen_t len = sizeof(cred);
+    if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+    {
+        logError("Could not get SO_PEERCRED option: %s", strerror(errno));
+        return;
+    }
+
+    uid = cred.uid;
+    pid = cred.pid;
+}
+
+// Time spent in Client::handle() per request type
+Histogram& requestHistogram(const Request& req)
+{
+    static constexpr const char* NAMES[] = {
+        "request.status", "request.claim", "request.release", "request.subscribe",
+        "request.compactStatus", "request.history", "request.arrayClaim",
+        "request.arrayTaskDone", "request.debugStats"
+    };
+    static_assert(std::size(NAMES) == std::variant_size_v<Request>);
+
+    static auto histograms = []{
+        std::array<Histogram*, std::size(NAMES)> ret;
+        for(std::size_t i = 0; i < ret.size(); ++i)
+            ret[i] = &latencyHistogram(NAMES[i]);
+        return ret;
+    }();
+
+    return *histograms[req.index()];
+}
+
+// Client sockets are edge-triggered, so read until there is nothing left
+[[nodiscard]] bool Client::communicate()
+{
+    // If authentication failed (see above), don't accept any commands.
+    if(uid < 0)
         return false;
+
+    while(true)
+    {
+        ssize_t ret = receivePacket(fd, recvBuffer, MSG_DONTWAIT);
+        if(ret == 0)
+        {
+            // Client has closed connection
+            return false;
+        }
+        if(ret < 0)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return true;
+
+            logError("Could not read from client: %s", strerror(errno));
+            return false;
+        }
+
+        zpp::bits::in in{std::span{recvBuffer.data(), static_cast<std::size_t>(ret)}};
+
+        Request req;
+        auto res = in(req);
+        if(zpp::bits::failure(res))
+        {
+            logError("Client sent request that could not be parsed");
+            return false;
+        }
+
+        ScopedTimer timer{requestHistogram(req)};
+        if(!handle(req))
+            return false;
     }
+}
 
+[[nodiscard]] bool Client::handle(const Request& req)
+{
     return std::visit(overloaded {
         [&](const StatusRequest&) {
-            StatusResponse resp;
-            resp.cards = g_cards;
+            sendSerialized(statusResponse());
+            return false;
+        },
+        [&](const DebugStatsRequest&) {
+            send(DebugStatsResponse{latencyStats()});
+            return false;
+        },
+        [&](const CompactStatusRequest& req) {
+            CompactStatusResponse resp;
+            resp.generation = g_generation;
+
+            if(req.knownGeneration != g_generation)
+            {
+                resp.info.reserve(g_cards.size());
+                for(auto& card : g_cards)
+                    resp.info.push_back(cardInfo(card));
+            }
+
+            resp.cards.reserve(g_cards.size());
+            for(auto& card : g_cards)
+                resp.cards.push_back(cardState(card));
+
+            send(resp);
+            return false;
+        },
+        [&](const HistoryRequest&) {
+            HistoryResponse resp;
+            resp.intervalMs = g_sampleInterval.count();
+            resp.lastSample = g_lastSampleTime;
+
+            resp.cards.reserve(g_cards.size());
+            for(auto& card : g_cards)
+                resp.cards.push_back(cardHistory(card.index));
 
             send(resp);
             return false;
         },
+        [&](const SubscribeRequest&) {
+            if(g_subscribers.empty())
+                g_lastPublished = g_cards;
+
+            sendSerialized(statusResponse());
+
+            subscribed = true;
+            g_subscribers.insert(this);
+            return true; // keep alive
+        },
         [&](const ClaimRequest& req) {
-            if(req.numGPUs > gpuLimitPerUser)
+            if(req.numGPUs > gpuLimitPerUser && !req.bestEffort)
+            {
+                ClaimResponse resp;
+                resp.error = "Your requested GPU count is over the per-user limit.";
+                send(resp);
+                return false;
+            }
+
+            if(req.memory != 0)
+            {
+                std::string error;
+                if(g_shareGID < 0)
+                    error = "Card sharing is not enabled on this server.";
+                else if(req.numGPUs != 1)
+                    error = "Shared claims are limited to a single GPU.";
+                else if(std::ranges::none_of(g_cards, [&](auto& card){ return card.memoryTotal >= req.memory; }))
+                    error = "No card has that much memory.";
+
+                if(!error.empty())
+                {
+                    ClaimResponse resp;
+                    resp.error = error;
+                    send(resp);
+                    return false;
+                }
+            }
+
+            if((req.walltime != 0 || req.bestEffort) && (req.memory != 0 || !req.migProfile.empty()))
+            {
+                ClaimResponse resp;
+                resp.error = "Time limits and best-effort claims are only supported for whole cards.";
+                send(resp);
+                return false;
+            }
+
+            if(!req.migProfile.empty())
+            {
+                std::string error;
+                if(g_shareGID < 0)
+                    error = "MIG slices are not enabled on this server.";
+                else if(req.numGPUs != 1 || req.memory != 0)
+                    error = "MIG claims are limited to a single slice.";
+                else if(std::ranges::none_of(g_devices, [&](auto& device){
+                    return device.mig && std::ranges::any_of(device.migCapacity, [&](auto& cap){
+                        return cap.profile == req.migProfile;
+                    });
+                }))
+                    error = "No card supports MIG profile " + req.migProfile + ".";
+
+                if(!error.empty())
+                {
+                    ClaimResponse resp;
+                    resp.error = error;
+                    send(resp);
+                    return false;
+                }
+            }
+
+            // Jobs are identified by the client pid
+            if(g_waitingClients.contains(pid))
             {
                 ClaimResponse resp;
-                resp.error = "Your requested GPU count is over the per-user limit.";
+                resp.error = "This process already has a pending claim.";
                 send(resp);
                 return false;
             }
 
             Job job;
             job.numGPUs = req.numGPUs;
+            job.memory = req.memory;
+            job.migProfile = req.migProfile;
+            job.walltime = req.walltime;
+            job.bestEffort = req.bestEffort;
             job.pid = pid;
             job.uid = uid;
+            job.submissionTime = std::chrono::system_clock::now();
+
+            // gpu run reconnects after a server restart, keep its place in the queue
+            if(auto it = g_restoredJobs.find(pid); it != g_restoredJobs.end())
+            {
+                auto& old = it->second;
+                if(old.uid == job.uid && old.numGPUs == job.numGPUs && old.memory == job.memory && old.migProfile == job.migProfile
+                    && old.bestEffort == job.bestEffort)
+                    job.submissionTime = old.submissionTime;
+                g_restoredJobs.erase(it);
+            }
+
+            if(g_journal)
+                g_journal->enqueue(job);
+
             g_jobQueue.enqueue(std::move(job));
+            g_waitingClients[pid] = this;
 
-            periodicUpdate();
+            requestSchedule();
 
             waitingOnQueue = true;
+            releaseOnClose = req.releaseOnClose;
+            progress = req.progress;
+            return true; // keep alive
+        },
+        [&](const ArrayClaimRequest& req) {
+            std::string error;
+            if(req.numTasks == 0 || req.numGPUs == 0)
+                error = "Need at least one task and one GPU per task.";
+            else if(req.numGPUs > gpuLimitPerUser)
+                error = "Your requested GPU count is over the per-user limit.";
+            else if(array || g_waitingClients.contains(pid))
+                error = "This process already has a pending claim.";
+
+            if(!error.empty())
+            {
+                send(ArrayTaskStart{0, {}, error});
+                return false;
+            }
+
+            array = Array{req.numTasks, req.numGPUs, req.maxRunning, 0, std::chrono::system_clock::now(), {}};
+            releaseOnClose = true;
+            enqueueArrayTask(*this);
+            return true; // keep alive
+        },
+        [&](const ArrayTaskDone& req) {
+            if(!array)
+                return false;
+
+            auto it = array->running.find(req.task);
+            if(it == array->running.end())
+                return false;
+
+            for(auto idx : it->second)
+            {
+                auto& card = g_cards[idx];
+                if(g_devices[idx].holder == this)
+                    releaseHeld(card);
+            }
+            array->running.erase(it);
+
+            enqueueArrayTask(*this);
             return true; // keep alive
         },
         [&](const ReleaseRequest& req) {
@@ -373,7 +1891,41 @@ Client::Client(int fd)
 
                 auto& card = g_cards[cardIdx];
 
-                updateCardFromNVML(cardIdx, card);
+                if(!card.tenants.empty())
+                {
+                    // The user may share the card several times. Release the
+                    // share of this connection, otherwise one without a holder
+                    // (gpu claim) - never one belonging to another running job.
+                    auto& shares = g_devices[cardIdx].shares;
+                    auto ownShare = std::ranges::find_if(shares, [&](auto& share){ return share.holder == this; });
+                    std::size_t idx = ownShare - shares.begin();
+                    if(ownShare == shares.end())
+                    {
+                        auto tenant = std::ranges::find_if(card.tenants, [&](auto& t){
+                            return t.uid == uid && !shares[&t - card.tenants.data()].holder;
+                        });
+                        if(tenant == card.tenants.end())
+                        {
+                            if(std::ranges::any_of(card.tenants, [&](auto& t){ return t.uid == uid; }))
+                                errors << "Card " << cardIdx << " is shared by another of your running jobs\n";
+                            else
+                                errors << "Card " << cardIdx << " is not reserved by user\n";
+                            continue;
+                        }
+
+                        idx = tenant - card.tenants.begin();
+                    }
+                    if(auto proc = activeProcess(card, uid))
+                    {
+                        errors << "Card " << cardIdx << " is still in use. Maybe you want to kill the process with PID " << proc->pid << "?\n";
+                        if(shares[idx].holder == this)
+                            errors << "It will be released automatically once the process has exited.\n";
+                        continue;
+                    }
+
+                    removeTenant(card, idx);
+                    continue;
+                }
 
                 if(card.reservedByUID != uid)
                 {
@@ -381,17 +1933,46 @@ Client::Client(int fd)
                     continue;
                 }
 
-                auto it = std::ranges::find_if(card.processes, [&](const auto& proc){
-                    return proc.uid == uid;
+                if(auto proc = activeProcess(card, uid))
+                {
+                    errors << "Card " << cardIdx << " is still in use. Maybe you want to kill the process with PID " << proc->pid << "?\n";
+                    if(g_devices[cardIdx].holder == this)
+                        errors << "It will be released automatically once the process has exited.\n";
+                    continue;
+                }
+
+                release(card);
+            }
+
+            for(auto& uuid : req.migSlices)
+            {
+                auto card = std::ranges::find_if(g_cards, [&](auto& c){
+                    return std::ranges::any_of(c.migSlices, [&](auto& slice){ return slice.uuid == uuid; });
                 });
+                if(card == g_cards.end())
+                {
+                    errors << "Invalid MIG slice " << uuid << "\n";
+                    continue;
+                }
+
+                auto slice = std::ranges::find_if(card->migSlices, [&](auto& s){ return s.uuid == uuid; });
+                std::size_t idx = slice - card->migSlices.begin();
 
-                if(it != card.processes.end())
+                if(slice->reservedByUID != uid)
                 {
-                    errors << "Card " << cardIdx << " is still in use. Maybe you want to kill the process with PID " << it->pid << "?\n";
+                    errors << "MIG slice " << uuid << " is not reserved by user\n";
                     continue;
                 }
 
-                release(card);
+                if(auto proc = activeProcess(*card, uid))
+                {
+                    errors << "MIG slice " << uuid << " is still in use. Maybe you want to kill the process with PID " << proc->pid << "?\n";
+                    if(g_devices[card->index].slices[idx].holder == this)
+                        errors << "It will be released automatically once the process has exited.\n";
+                    continue;
+                }
+
+                releaseSlice(*card, idx);
             }
 
             send(ReleaseResponse{errors.str()});
@@ -399,129 +1980,544 @@ Client::Client(int fd)
             return false;
         },
         [&](auto) {
-            fprintf(stderr, "Unhandled command type\n");
+            logError("Unhandled command type");
             return false;
         },
     }, req);
 }
 
+void processDeleteList(int epollfd)
+{
+    while(Client* client = g_deleteList)
+    {
+        g_deleteList = client->nextPendingDelete;
+
+        if(epoll_ctl(epollfd, EPOLL_CTL_DEL, client->fd, nullptr) != 0)
+        {
+            logError("Could not remove client from epoll list: %s", strerror(errno));
+        }
+
+        if(client->subscribed)
+            g_subscribers.erase(client);
+
+        // The job has ended (or its gpu run process died). Free the cards, or
+        // if something is still running on them, as soon as it exits.
+        if(client->releaseOnClose)
+        {
+            for(auto& card : g_cards)
+            {
+                if(g_devices[card.index].holder == client)
+                    releaseHeld(card);
+            }
+
+            for(auto& card : g_cards)
+            {
+                auto& device = g_devices[card.index];
+                for(std::size_t i = card.tenants.size(); i-- > 0;)
+                {
+                    auto& share = device.shares[i];
+                    if(share.holder != client)
+                        continue;
+
+                    share.holder = nullptr;
+
+                    if(activeProcess(card, card.tenants[i].uid))
+                        share.releaseWhenIdle = true;
+                    else
+                        removeTenant(card, i);
+                }
+
+                for(std::size_t i = card.migSlices.size(); i-- > 0;)
+                {
+                    auto& slice = device.slices[i];
+                    if(slice.holder != client)
+                        continue;
+
+                    slice.holder = nullptr;
+
+                    if(activeProcess(card, card.migSlices[i].reservedByUID))
+                        slice.releaseWhenIdle = true;
+                    else
+                        releaseSlice(card, i);
+                }
+            }
+        }
+
+        if(client->waitingOnQueue)
+        {
+            g_waitingClients.erase(client->pid);
+
+            // A departing waiter may have been blocking the queue
+            if(g_jobQueue.remove(client->pid))
+            {
+                if(g_journal && !client->array)
+                    g_journal->dequeue(client->pid);
+                requestSchedule();
+            }
+        }
+
+        // Swap with the last client and pop
+        std::size_t slot = client->slot;
+        if(slot != g_clients.size() - 1)
+        {
+            std::swap(g_clients[slot], g_clients.back());
+            g_clients[slot]->slot = slot;
+        }
+        g_clients.pop_back();
+
+        g_clientPool.destroy(client);
+    }
+}
+
+// Static properties of a card. Returns a description of the error on failure.
+std::optional<std::string> queryCardInfo(unsigned int devIdx, nvmlDevice_t& dev, Card& card)
+{
+    char buf[1024];
+
+    if(auto err = nvmlDeviceGetHandleByIndex(devIdx, &dev))
+        return std::string{"Could not get device: "} + nvmlErrorString(err);
+
+    if(auto err = nvmlDeviceGetName(dev, buf, sizeof(buf)))
+        return std::string{"Could not get device name: "} + nvmlErrorString(err);
+    card.name = buf;
+
+    if(auto err = nvmlDeviceGetUUID(dev, buf, sizeof(buf)))
+        return std::string{"Could not get card UUID: "} + nvmlErrorString(err);
+    card.uuid = buf;
+
+    nvmlMemory_t mem{};
+    if(auto err = nvmlDeviceGetMemoryInfo(dev, &mem))
+        return std::string{"Could not get memory info: "} + nvmlErrorString(err);
+    card.memoryTotal = mem.total;
+
+    if(auto err = nvmlDeviceGetMinorNumber(dev, &card.minorID))
+        return std::string{"Could not query device ID: "} + nvmlErrorString(err);
+
+    return {};
+}
 
+std::string renderMetrics()
+{
+    MetricsWriter out;
+
+    auto now = std::chrono::system_clock::now();
+    double oldestWait = 0.0;
+    for(auto& job : g_jobQueue.jobs())
+        oldestWait = std::max(oldestWait, std::chrono::duration<double>{now - job.submissionTime}.count());
+
+    out.family("gpu_claim_queue_length", "gauge", "Number of jobs waiting for cards");
+    out.sample("gpu_claim_queue_length", g_jobQueue.size());
+    out.family("gpu_claim_queue_oldest_wait_seconds", "gauge", "Time the longest-waiting job has been queued");
+    out.sample("gpu_claim_queue_oldest_wait_seconds", oldestWait);
+    out.histogram("gpu_claim_queue_wait_seconds", "Time jobs spent in the queue before they were started", g_queueWait);
+
+    out.family("gpu_claim_clients", "gauge", "Number of connected clients");
+    out.sample("gpu_claim_clients", g_clients.size());
+
+    out.family("gpu_claim_card_info", "gauge", "Static card information");
+    for(auto& card : g_cards)
+        out.sample("gpu_claim_card_info", 1, {{"card", std::to_string(card.index)}, {"name", card.name}, {"uuid", card.uuid}});
+
+    auto perCard = [&](const char* name, const char* type, const char* help, auto&& value) {
+        out.family(name, type, help);
+        for(auto& card : g_cards)
+            out.sample(name, value(card), {{"card", std::to_string(card.index)}});
+    };
+    perCard("gpu_claim_card_utilization_ratio", "gauge", "GPU utilization (0-1)",
+        [](const Card& card){ return card.computeUsagePercent / 100.0; });
+    perCard("gpu_claim_card_memory_used_bytes", "gauge", "Used GPU memory",
+        [](const Card& card){ return static_cast<double>(card.memoryUsage); });
+    perCard("gpu_claim_card_memory_total_bytes", "gauge", "Total GPU memory",
+        [](const Card& card){ return static_cast<double>(card.memoryTotal); });
+    perCard("gpu_claim_card_owner_uid", "gauge", "UID the card is claimed by (0: free or shared)",
+        [](const Card& card){ return static_cast<double>(card.reservedByUID); });
+    perCard("gpu_claim_card_tenants", "gauge", "Number of jobs sharing the card",
+        [](const Card& card){ return static_cast<double>(card.tenants.size()); });
+    perCard("gpu_claim_card_healthy", "gauge", "1 if the card can be handed out",
+        [](const Card& card){ return card.healthy ? 1.0 : 0.0; });
+
+    out.histogram("gpu_claim_job_start_duration_seconds", "Time to claim cards for a job and send the response", g_startDuration);
+    out.histogram("gpu_claim_nvml_sample_duration_seconds", "Duration of one NVML refresh of all cards", g_sampleDuration);
+    out.histogram("gpu_claim_event_loop_duration_seconds", "Time spent handling one batch of events", g_loopDuration);
+
+    return out.text();
+}
 
 int main(int argc, char** argv)
 {
-    int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    namespace po = boost::program_options;
+
+    po::options_description desc{"Options"};
+    desc.add_options()
+        ("help,h", "Help")
+        ("sample-interval", po::value<unsigned int>()->default_value(1000)->value_name("MS"), "NVML refresh interval in milliseconds")
+        ("backfill", po::value<bool>()->default_value(true)->value_name("BOOL"), "Start smaller jobs on idle cards if that does not delay the queue head")
+        ("backfill-depth", po::value<std::size_t>()->default_value(100)->value_name("N"), "Number of queued jobs considered for backfilling")
+        ("progress-interval", po::value<unsigned int>()->default_value(30)->value_name("S"), "How often waiting clients are told their queue position and estimated start")
+        ("terminate-grace", po::value<unsigned int>()->default_value(60)->value_name("S"), "Time between SIGTERM and SIGKILL when a job exceeds its walltime or is preempted")
+        ("ownership-check-interval", po::value<unsigned int>()->default_value(60)->value_name("S"), "How often device node owners are checked against the internal state")
+        ("history-length", po::value<unsigned int>()->default_value(3600)->value_name("S"), "Utilization history kept per card for gpu status --history")
+        ("reclaim-config", po::value<std::string>()->value_name("FILE"), "Idle card reclaim thresholds (default: reclaim after 5min without processes)")
+        ("fairshare-half-life", po::value<double>()->default_value(24.0)->value_name("HOURS"), "Half-life of GPU usage in the fair-share priority")
+        ("state-file", po::value<std::string>()->default_value("/var/lib/gpu_server.state")->value_name("FILE"), "Journal for warm restarts (empty: disabled)")
+        ("state-sync-interval", po::value<unsigned int>()->default_value(30)->value_name("S"), "How often the full state is written to the journal")
+        ("share-group", po::value<std::string>()->value_name("GROUP"), "Enable card sharing (gpu run --memory). Shared cards are accessible to this group.")
+        ("max-clients", po::value<std::size_t>()->default_value(10000)->value_name("N"), "Maximum number of concurrent connections (0: unlimited)")
+        ("listen-backlog", po::value<int>()->default_value(1024)->value_name("N"), "Backlog of the client socket (capped by net.core.somaxconn)")
+        ("coordinator", po::value<std::string>()->value_name("HOST:PORT"), "Report to gpu_coordinator for cluster-wide scheduling")
+        ("node-name", po::value<std::string>()->value_name("NAME"), "Name under which this node is reachable via ssh (default: hostname)")
+        ("coordinator-secret-file", po::value<std::string>()->value_name("PATH"), "Shared secret to present to the coordinator (gpu_coordinator --secret-file)")
+        ("log-level", po::value<std::string>()->default_value("info")->value_name("LEVEL"), "Minimum level of log messages (debug, info, warning, error)")
+        ("audit-log", po::value<std::string>()->value_name("FILE"), "Append claim and release records for accounting to this file")
+        ("metrics-port", po::value<unsigned int>()->value_name("PORT"), "Serve Prometheus metrics via HTTP on this port")
+        ("status-segment", po::value<std::string>()->default_value(STATUS_SEGMENT_NAME)->value_name("NAME"), "POSIX shared memory segment for local status readers (empty: disabled)")
+        ("gpus-per-user", po::value<std::size_t>()->default_value(8)->value_name("N"), "Maximum number of cards claimed by one user")
+        ("socket", po::value<std::string>()->default_value("/var/run/gpu_server.sock")->value_name("PATH"), "Client socket")
+        ("device-dir", po::value<std::string>()->default_value("/dev")->value_name("DIR"), "Directory containing the nvidiaN device nodes")
+    ;
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+
+    if(vm.count("help"))
+    {
+        std::cerr << "Usage: gpu_server [options]\n" << desc << "\n";
+        return 1;
+    }
+
+    po::notify(vm);
+
+    try
+    {
+        startLogging(
+            parseLogLevel(vm["log-level"].as<std::string>()),
+            vm.count("audit-log") ? vm["audit-log"].as<std::string>() : std::string{}
+        );
+    }
+    catch(std::exception& e)
+    {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+
+    auto sampleInterval = std::chrono::milliseconds{vm["sample-interval"].as<unsigned int>()};
+    if(sampleInterval.count() == 0)
+    {
+        logError("--sample-interval needs to be positive");
+        return 1;
+    }
+    g_sampleInterval = sampleInterval;
+
+    try
+    {
+        if(vm.count("reclaim-config"))
+            g_reclaimPolicy = ThresholdPolicy::fromFile(vm["reclaim-config"].as<std::string>());
+        else
+            g_reclaimPolicy = std::make_unique<ThresholdPolicy>();
+    }
+    catch(std::runtime_error& e)
+    {
+        logError("%s", e.what());
+        return 1;
+    }
+
+    if(vm.count("share-group"))
+    {
+        auto name = vm["share-group"].as<std::string>();
+        struct group* gr = getgrnam(name.c_str());
+        if(!gr)
+        {
+            logError("Unknown group '%s'", name.c_str());
+            return 1;
+        }
+        g_shareGID = gr->gr_gid;
+    }
+
+    g_stateSyncInterval = std::chrono::seconds{vm["state-sync-interval"].as<unsigned int>()};
+    if(auto path = vm["state-file"].as<std::string>(); !path.empty())
+    {
+        try
+        {
+            g_journal = std::make_unique<Journal>(path);
+        }
+        catch(std::runtime_error& e)
+        {
+            logError("%s", e.what());
+            return 1;
+        }
+    }
+
+    if(vm.count("coordinator"))
+    {
+        g_coordinator = vm["coordinator"].as<std::string>();
+
+        if(vm.count("node-name"))
+            g_nodeName = vm["node-name"].as<std::string>();
+        else
+        {
+            char hostname[256]{};
+            if(gethostname(hostname, sizeof(hostname)-1) != 0)
+            {
+                logError("Could not get hostname: %s", strerror(errno));
+                return 1;
+            }
+            g_nodeName = hostname;
+        }
+
+        if(vm.count("coordinator-secret-file"))
+        {
+            auto secret = readSecret(vm["coordinator-secret-file"].as<std::string>());
+            if(!secret)
+                return 1;
+
+            g_coordinatorSecret = *secret;
+        }
+    }
+
+    g_maxClients = vm["max-clients"].as<std::size_t>();
+
+    // Every waiting gpu run holds a connection, the default of 1024 fds is
+    // easily reached
+    {
+        rlimit limit{};
+        if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+        {
+            limit.rlim_cur = limit.rlim_max;
+            if(setrlimit(RLIMIT_NOFILE, &limit) != 0)
+                logError("Could not raise file descriptor limit: %s", strerror(errno));
+        }
+    }
+
+    g_ownershipCheckInterval = std::chrono::seconds{vm["ownership-check-interval"].as<unsigned int>()};
+    gpuLimitPerUser = vm["gpus-per-user"].as<std::size_t>();
+    auto deviceDir = vm["device-dir"].as<std::string>();
+    g_backfill = vm["backfill"].as<bool>();
+    g_backfillDepth = vm["backfill-depth"].as<std::size_t>();
+    g_progressInterval = std::chrono::seconds{vm["progress-interval"].as<unsigned int>()};
+    g_terminateGrace = std::chrono::seconds{vm["terminate-grace"].as<unsigned int>()};
+
+    g_jobQueue.setHalfLife(std::chrono::duration_cast<std::chrono::system_clock::duration>(
+        std::chrono::duration<double, std::ratio<3600>>{vm["fairshare-half-life"].as<double>()}
+    ));
+
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0);
     if(sock < 0)
     {
-        perror("Could not open unix socket");
+        logError("Could not open unix socket: %s", strerror(errno));
         return 1;
     }
 
     {
-        unlink("/var/run/gpu_server.sock");
+        auto path = vm["socket"].as<std::string>();
 
         sockaddr_un addr{};
         addr.sun_family = AF_UNIX;
-        strcpy(addr.sun_path, "/var/run/gpu_server.sock");
+        if(path.size() >= sizeof(addr.sun_path))
+        {
+            logError("Socket path %s is too long", path.c_str());
+            return 1;
+        }
+        strcpy(addr.sun_path, path.c_str());
+
+        unlink(path.c_str());
 
         if(bind(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
         {
-            perror("Could not create unix socket at /var/run/gpu_server.sock");
+            logError("Could not create unix socket at %s: %s", path.c_str(), strerror(errno));
             return 1;
         }
 
-        if(listen(sock, 20) != 0)
+        if(listen(sock, vm["listen-backlog"].as<int>()) != 0)
         {
-            perror("Could not listen()");
+            logError("Could not listen(): %s", strerror(errno));
             return 1;
         }
 
-        if(chmod("/var/run/gpu_server.sock", 0777) != 0)
+        if(chmod(path.c_str(), 0777) != 0)
         {
-            perror("Could not set socket permissions on /var/run/gpu_server.sock");
+            logError("Could not set socket permissions on %s: %s", path.c_str(), strerror(errno));
             return 1;
         }
     }
 
     if(auto err = nvmlInitWithFlags(0))
     {
-        fprintf(stderr, "Could not initialize NVML: %s\n", nvmlErrorString(err));
+        logError("Could not initialize NVML: %s", nvmlErrorString(err));
         return 1;
     }
 
     unsigned int devices = 0;
     if(auto err = nvmlDeviceGetCount_v2(&devices))
     {
-        fprintf(stderr, "Could not list nvidia devices: %s\n", nvmlErrorString(err));
+        logError("Could not list nvidia devices: %s", nvmlErrorString(err));
         return 1;
     }
 
-    char buf[1024];
+    // Enough samples to cover the longest reclaim window
+    std::size_t historyLength = g_reclaimPolicy->window() / sampleInterval + 2;
 
+    std::vector<nvmlDevice_t> handles;
     for(unsigned int devIdx = 0; devIdx < devices; ++devIdx)
     {
         nvmlDevice_t dev{};
-        if(auto err = nvmlDeviceGetHandleByIndex(devIdx, &dev))
+        auto& card = g_cards.emplace_back();
+        card.index = g_cards.size() - 1;
+
+        auto error = queryCardInfo(devIdx, dev, card);
+        handles.push_back(dev);
+
+        auto& device = g_devices.emplace_back();
+        device.handle = dev;
+        device.claimStart = std::chrono::steady_clock::now(); // claims before a restart count from here
+        device.usage = UsageHistory{historyLength};
+
+        std::size_t historySamples = std::chrono::seconds{vm["history-length"].as<unsigned int>()} / sampleInterval;
+        device.utilizationHistory = RingBuffer<std::uint8_t>{historySamples};
+        device.memoryHistory = RingBuffer<std::uint32_t>{historySamples};
+
+        // Serve the other cards
+        if(error)
         {
-            fprintf(stderr, "Could not get device %u: %s\n", devIdx, nvmlErrorString(err));
-            return 1;
+            logError("Card %u: %s. It is not schedulable until the server is restarted.", devIdx, error->c_str());
+            card.name = "unknown";
+            card.healthy = false;
+            device.nvmlHealthy = false;
+            device.nodeFault = true;
+            continue;
         }
 
-        auto& card = g_cards.emplace_back();
+        device.path = deviceDir + "/nvidia" + std::to_string(card.minorID);
 
-        card.index = g_cards.size() - 1;
+        card.lastUsageTime = std::chrono::steady_clock::now();
 
-        if(auto err = nvmlDeviceGetName(dev, buf, sizeof(buf)))
+        device.mig = migEnabled(dev);
+        if(device.mig)
         {
-            fprintf(stderr, "Could not get device name: %s\n", nvmlErrorString(err));
-            return 1;
+            if(g_shareGID < 0)
+            {
+                logWarning("Card %u is in MIG mode, which needs --share-group. It is not claimable.", card.index);
+                continue;
+            }
+
+            // Retried by validateOwnership(). The instances are still listed,
+            // so that the card is complete once that succeeds.
+            if(chown(device.path.c_str(), 0, g_shareGID) != 0)
+            {
+                logError("Could not set group of %s: %s. Card %u is not schedulable for now.", device.path.c_str(), strerror(errno), card.index);
+                card.healthy = false;
+                device.nodeFault = true;
+            }
+
+            // Instances which exist already are kept. Their claims survive
+            // restarts through the access nodes.
+            std::vector<Device::Slice> slices;
+            std::vector<MigSlice> migSlices;
+            try
+            {
+                for(auto& instance : listMigInstances(dev, card.minorID))
+                {
+                    struct stat nodeSt{};
+                    if(stat(instance.accessNodes.front().c_str(), &nodeSt) != 0)
+                        throw std::runtime_error{"Could not query owner of " + instance.accessNodes.front() + ": " + strerror(errno)};
+
+                    auto& slice = slices.emplace_back();
+                    slice.instance = instance;
+                    slice.claimStart = card.lastUsageTime;
+                    slice.lastUsageTime = card.lastUsageTime;
+                    migSlices.push_back(MigSlice{instance.profile, instance.uuid, static_cast<int>(nodeSt.st_uid)});
+                }
+            }
+            catch(std::runtime_error& e)
+            {
+                // We do not know which slices are in use, do not touch the card
+                logError("Could not list MIG instances of card %u: %s. It is not schedulable until the server is restarted.", card.index, e.what());
+                card.healthy = false;
+                device.nodeFault = true;
+                device.path.clear();
+                continue;
+            }
+
+            device.slices = std::move(slices);
+            card.migSlices = std::move(migSlices);
+            for(std::size_t i = 0; i < card.migSlices.size(); ++i)
+            {
+                int owner = card.migSlices[i].reservedByUID;
+                if(owner != 0)
+                    g_claimedByUID[owner]++;
+                else
+                    setSliceOwner(card, device.slices[i], 0);
+            }
+
+            refreshMigCapacity(device);
+
+            logInfo("Card %u is in MIG mode with %lu instances.", card.index, card.migSlices.size());
+            continue;
         }
-        card.name = buf;
 
-        if(auto err = nvmlDeviceGetUUID(dev, buf, sizeof(buf)))
+        // Ownership survives server restarts through the device node. If it
+        // cannot be read, validateOwnership() retries and resets the node.
+        struct stat st{};
+        if(stat(device.path.c_str(), &st) != 0)
         {
-            fprintf(stderr, "Could not get card UUID: %s\n", nvmlErrorString(err));
-            return 1;
+            logError("Could not query owner of %s: %s. Card %u is not schedulable for now.", device.path.c_str(), strerror(errno), card.index);
+            card.healthy = false;
+            device.nodeFault = true;
+            continue;
         }
-        card.uuid = buf;
 
-        nvmlMemory_t mem{};
-        if(auto err = nvmlDeviceGetMemoryInfo(dev, &mem))
+        card.reservedByUID = st.st_uid;
+        if(card.reservedByUID != 0)
+            g_claimedByUID[card.reservedByUID]++;
+
+        // Free cards belong to root:root. Anything else is left over from a
+        // shared claim. Its tenants are restored from the journal if possible.
+        bool sharedBefore = g_journal && g_shareGID >= 0 && static_cast<int>(st.st_gid) == g_shareGID
+            && g_journal->recovered().tenants.contains(card.index);
+        if(card.reservedByUID == 0 && st.st_gid != 0 && !sharedBefore)
         {
-            fprintf(stderr, "Could not get memory info: %s\n", nvmlErrorString(err));
-            return 1;
+            logInfo("Resetting group of free card %u (was GID %d)", card.index, st.st_gid);
+            if(chown(device.path.c_str(), 0, 0) != 0)
+            {
+                // Retried by validateOwnership()
+                logError("Could not set owner of %s to root: %s. Card %u is not schedulable for now.", device.path.c_str(), strerror(errno), card.index);
+                card.healthy = false;
+                device.nodeFault = true;
+                continue;
+            }
         }
-        card.memoryTotal = mem.total;
-
-        card.lastUsageTime = std::chrono::steady_clock::now();
     }
 
-    printf("Initialized with %lu cards.\n", g_cards.size());
+    logInfo("Initialized with %lu cards.", g_cards.size());
 
-    int timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
-    if(timerfd < 0)
+    g_topology = Topology{handles};
+    if(devices > 1)
     {
-        perror("Could not create timer fd");
-        return 1;
+        logInfo("Topology:");
+
+        std::istringstream ss{g_topology.describe()};
+        for(std::string line; std::getline(ss, line);)
+            logInfo("%s", line.c_str());
     }
 
-    {
-        itimerspec spec{};
-        spec.it_interval.tv_sec = 1;
-//         spec.it_interval.tv_nsec = 1000ULL * 1000ULL * 500ULL; // 500ms
-        spec.it_value.tv_sec = 0;
-        spec.it_value.tv_nsec = 1; // Trigger immediately
+    g_generation = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()
+    ).count();
 
-        if(timerfd_settime(timerfd, 0, &spec, nullptr) != 0)
-        {
-            perror("Could not arm timer");
-            return 1;
-        }
+    g_lastOwnershipCheck = std::chrono::steady_clock::now();
+
+    if(g_journal)
+    {
+        restoreState(g_journal->recovered());
+        saveState();
+        g_lastStateSync = std::chrono::steady_clock::now();
     }
 
+    Sampler sampler{devices, sampleInterval};
+
     int epollfd = epoll_create1(EPOLL_CLOEXEC);
     if(epollfd < 0)
     {
-        perror("Could not create epoll fd");
+        logError("Could not create epoll fd: %s", strerror(errno));
         return 1;
     }
 
@@ -531,78 +2527,162 @@ int main(int argc, char** argv)
         ev.data.ptr = &sock;
         if(epoll_ctl(epollfd, EPOLL_CTL_ADD, sock, &ev) != 0)
         {
-            perror("Could not add socket to epoll");
+            logError("Could not add socket to epoll: %s", strerror(errno));
             return 1;
         }
     }
     {
         epoll_event ev{};
         ev.events = EPOLLIN;
-        ev.data.ptr = &timerfd;
-        if(epoll_ctl(epollfd, EPOLL_CTL_ADD, timerfd, &ev) != 0)
+        ev.data.ptr = &sampler;
+        if(epoll_ctl(epollfd, EPOLL_CTL_ADD, sampler.eventFD(), &ev) != 0)
+        {
+            logError("Could not add sampler to epoll: %s", strerror(errno));
+            return 1;
+        }
+    }
+
+    if(vm.count("metrics-port"))
+    {
+        try
+        {
+            g_metrics = std::make_unique<MetricsServer>(vm["metrics-port"].as<unsigned int>());
+        }
+        catch(std::runtime_error& e)
+        {
+            logError("%s", e.what());
+            return 1;
+        }
+
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.ptr = &g_metrics;
+        if(epoll_ctl(epollfd, EPOLL_CTL_ADD, g_metrics->fd(), &ev) != 0)
+        {
+            logError("Could not add metrics server to epoll: %s", strerror(errno));
+            return 1;
+        }
+    }
+
+    if(auto name = vm["status-segment"].as<std::string>(); !name.empty())
+    {
+        try
         {
-            perror("Could not add timer to epoll");
+            g_statusSegment = std::make_unique<StatusSegmentWriter>(name);
+        }
+        catch(std::runtime_error& e)
+        {
+            logError("%s", e.what());
             return 1;
         }
     }
 
-    std::array<epoll_event, 20> events;
+    if(!g_coordinator.empty())
+    {
+        NodeHello hello{g_nodeName, g_generation, {}, g_coordinatorSecret};
+        for(auto& card : g_cards)
+            hello.info.push_back(cardInfo(card));
+
+        g_coordinatorLink = std::make_unique<CoordinatorLink>(g_coordinator, hello, nodeUpdate());
+        g_lastSentToCoordinator = g_cards;
+    }
+
+    std::vector<epoll_event> events(256);
     while(1)
     {
         int nfds = epoll_wait(epollfd, events.data(), events.size(), -1);
         if(nfds <= 0)
         {
-            perror("epoll_wait() failed");
+            logError("epoll_wait() failed: %s", strerror(errno));
             return 1;
         }
 
+        auto iterationStart = std::chrono::steady_clock::now();
+
         for(int i = 0; i < nfds; ++i)
         {
             auto& ev = events[i];
 
             if(ev.data.ptr == &sock)
             {
-                // Main socket
-                int fd = accept(sock, nullptr, nullptr);
-                if(fd < 0)
+                // Main socket. Take everything from the backlog at once.
+                while(true)
                 {
-                    perror("Could not accept client");
-                    sleep(1);
-                    continue;
+                    int fd = accept4(sock, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+                    if(fd < 0)
+                    {
+                        if(errno == EAGAIN || errno == EWOULDBLOCK)
+                            break;
+
+                        logError("Could not accept client: %s", strerror(errno));
+                        sleep(1);
+                        break;
+                    }
+
+                    if(g_maxClients != 0 && g_clients.size() >= g_maxClients)
+                    {
+                        close(fd);
+                        continue;
+                    }
+
+                    Client* client = g_clientPool.create(fd);
+
+                    epoll_event ev;
+                    ev.events = EPOLLIN | EPOLLET;
+                    ev.data.ptr = client;
+
+                    if(epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+                    {
+                        logError("Could not add client to epoll: %s", strerror(errno));
+                        g_clientPool.destroy(client);
+                        continue;
+                    }
+
+                    client->slot = g_clients.size();
+                    g_clients.push_back(client);
+
+                    // Requests sent before the fd was registered do not trigger an edge
+                    if(!client->communicate())
+                        scheduleDelete(client);
                 }
-
-                if(g_clients.size() > 100)
+            }
+            else if(ev.data.ptr == &sampler)
+            {
+                std::uint64_t count = 0;
+                if(read(sampler.eventFD(), &count, sizeof(count)) < 0 && errno != EAGAIN)
                 {
-                    close(fd);
-                    continue;
+                    logError("Could not read from sampler eventfd: %s", strerror(errno));
+                    return 1;
                 }
 
-                auto client = std::make_unique<Client>(fd);
+                if(auto snapshot = sampler.snapshot())
+                    applySnapshot(*snapshot);
 
-                epoll_event ev;
-                ev.events = EPOLLIN;
-                ev.data.ptr = client.get();
+                // The sampler tick doubles as our housekeeping timer
+                auto now = std::chrono::steady_clock::now();
+                reapStaleClients(now);
+                enforceClaimEnd(now);
 
-                if(epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+                if(now - g_lastOwnershipCheck > g_ownershipCheckInterval)
                 {
-                    perror("Could not add client to epoll");
-                    continue;
+                    validateOwnership();
+                    g_lastOwnershipCheck = now;
                 }
 
-                g_clients.push_back(std::move(client));
-            }
-            else if(ev.data.ptr == &timerfd)
-            {
-                std::uint64_t expirations = 0;
-                int ret = read(timerfd, &expirations, sizeof(expirations));
-                if(ret <= 0)
+                if(g_journal && now - g_lastStateSync > g_stateSyncInterval)
                 {
-                    perror("Could not read from timerfd");
-                    return 1;
+                    saveState();
+                    g_lastStateSync = now;
                 }
 
-                periodicUpdate();
+                publishQueueProgress(now);
+
+                // Drops stuck scrapers
+                if(g_metrics)
+                    g_metrics->process(renderMetrics);
             }
+            else if(ev.data.ptr == &g_metrics)
+                g_metrics->process(renderMetrics);
             else
             {
                 // Handle client request
@@ -610,35 +2690,35 @@ int main(int argc, char** argv)
 
                 if(!client->communicate())
                 {
-                    printf("Client::communicate() returned false\n");
-                    deleteList.push_back(client);
+                    logDebug("Client::communicate() returned false");
+                    scheduleDelete(client);
                 }
             }
         }
 
-        // Process client deletion list
-        for(auto& toDelete : deleteList)
-        {
-            auto it = std::find_if(g_clients.begin(), g_clients.end(), [&](auto& client){
-                return client.get() == toDelete;
-            });
-
-            if(it == g_clients.end())
-                continue;
+        processDeleteList(epollfd);
 
-            if(epoll_ctl(epollfd, EPOLL_CTL_DEL, it->get()->fd, nullptr) != 0)
-            {
-                perror("Could not remove client from epoll list");
-            }
+        if(g_scheduleRequested)
+        {
+            g_scheduleRequested = false;
+            schedule();
+            processDeleteList(epollfd);
+        }
 
-            g_jobQueue.remove(it->get()->pid);
+        publishStatus();
+        publishToCoordinator();
 
-            g_clients.erase(it);
+        if(g_statusSegment && g_statusSegmentOutdated)
+        {
+            g_statusSegment->publish(g_cards, g_generation, g_sampleInterval);
+            g_statusSegmentOutdated = false;
         }
-        deleteList.clear();
+
+        g_loopDuration.observe(std::chrono::steady_clock::now() - iterationStart);
     }
 
     nvmlShutdown();
+    stopLogging();
 
     return 0;
 }
@@ -0,0 +1,259 @@
+// Card status in shared memory for local readers
+// Author: Max Schwarz <max.schwarz@ais.uni-bonn.de>
+
+#include "status_segment.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+    constexpr int READ_ATTEMPTS = 100;
+
+    // Readers give up on a segment which has not been updated for this many sample intervals
+    constexpr int STALE_INTERVALS = 5;
+
+    template<std::size_t N>
+    void copyString(char (&dest)[N], const std::string& src)
+    {
+        std::size_t len = std::min(src.size(), N - 1);
+        memcpy(dest, src.data(), len);
+        dest[len] = 0;
+    }
+
+    template<std::size_t N>
+    std::string toString(const char (&src)[N])
+    {
+        return std::string{src, strnlen(src, N)};
+    }
+
+    std::int64_t toMs(const auto& time)
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(time.time_since_epoch()).count();
+    }
+
+    void fill(SegmentCard& out, const Card& card)
+    {
+        out.index = card.index;
+        out.minorID = card.minorID;
+        copyString(out.name, card.name);
+        copyString(out.uuid, card.uuid);
+        out.memoryTotal = card.memoryTotal;
+        out.memoryUsage = card.memoryUsage;
+        out.reservedByUID = card.reservedByUID;
+        out.computeUsagePercent = card.computeUsagePercent;
+        out.healthy = card.healthy;
+        out.lastUsageTime = toMs(card.lastUsageTime);
+
+        out.numProcesses = std::min(card.processes.size(), SEGMENT_MAX_PROCESSES);
+        for(std::size_t i = 0; i < out.numProcesses; ++i)
+        {
+            auto& proc = card.processes[i];
+            out.processes[i] = SegmentProcess{proc.uid, proc.pid, proc.memory};
+        }
+
+        out.numTenants = std::min(card.tenants.size(), SEGMENT_MAX_TENANTS);
+        for(std::size_t i = 0; i < out.numTenants; ++i)
+            out.tenants[i] = SegmentTenant{card.tenants[i].uid, 0, card.tenants[i].memory};
+
+        out.numSlices = std::min(card.migSlices.size(), SEGMENT_MAX_SLICES);
+        for(std::size_t i = 0; i < out.numSlices; ++i)
+        {
+            auto& slice = card.migSlices[i];
+            copyString(out.slices[i].profile, slice.profile);
+            copyString(out.slices[i].uuid, slice.uuid);
+            out.slices[i].reservedByUID = slice.reservedByUID;
+        }
+    }
+
+    // Only the root-owned server may write the segment, otherwise anybody
+    // could publish fake card state
+    bool trusted(int fd)
+    {
+        struct stat st{};
+        return fstat(fd, &st) == 0 && st.st_uid == 0 && (st.st_mode & (S_IWGRP | S_IWOTH)) == 0
+            && static_cast<std::size_t>(st.st_size) >= sizeof(StatusSegment);
+    }
+
+    Card expand(const SegmentCard& in)
+    {
+        Card card;
+        card.index = in.index;
+        card.minorID = in.minorID;
+        card.name = toString(in.name);
+        card.uuid = toString(in.uuid);
+        card.memoryTotal = in.memoryTotal;
+        card.memoryUsage = in.memoryUsage;
+        card.reservedByUID = in.reservedByUID;
+        card.computeUsagePercent = in.computeUsagePercent;
+        card.healthy = in.healthy;
+        card.lastUsageTime = std::chrono::steady_clock::time_point{
+            std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::milliseconds{in.lastUsageTime})
+        };
+
+        for(std::size_t i = 0; i < std::min<std::size_t>(in.numProcesses, SEGMENT_MAX_PROCESSES); ++i)
+            card.processes.push_back(Process{in.processes[i].uid, in.processes[i].pid, in.processes[i].memory});
+
+        for(std::size_t i = 0; i < std::min<std::size_t>(in.numTenants, SEGMENT_MAX_TENANTS); ++i)
+            card.tenants.push_back(Tenant{in.tenants[i].uid, in.tenants[i].memory});
+
+        for(std::size_t i = 0; i < std::min<std::size_t>(in.numSlices, SEGMENT_MAX_SLICES); ++i)
+        {
+            auto& slice = in.slices[i];
+            card.migSlices.push_back(MigSlice{toString(slice.profile), toString(slice.uuid), slice.reservedByUID});
+        }
+
+        return card;
+    }
+}
+
+StatusSegmentWriter::StatusSegmentWriter(const std::string& name)
+ : m_name{name}
+{
+    // Never take over an existing segment, somebody else might have created it
+    if(shm_unlink(name.c_str()) != 0 && errno != ENOENT)
+        throw std::runtime_error{"Could not remove old shared memory segment " + name + ": " + strerror(errno)};
+
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if(fd < 0)
+        throw std::runtime_error{"Could not create shared memory segment " + name + ": " + strerror(errno)};
+
+    // Not subject to the umask
+    if(fchmod(fd, 0644) != 0 || ftruncate(fd, sizeof(StatusSegment)) != 0)
+    {
+        int err = errno;
+        close(fd);
+        throw std::runtime_error{"Could not set up shared memory segment " + name + ": " + strerror(err)};
+    }
+
+    if(!trusted(fd))
+    {
+        close(fd);
+        throw std::runtime_error{"Shared memory segment " + name + " is not owned by root or writable by others"};
+    }
+
+    void* mem = mmap(nullptr, sizeof(StatusSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(mem == MAP_FAILED)
+        throw std::runtime_error{"Could not map shared memory segment " + name + ": " + strerror(errno)};
+
+    m_segment = new (mem) StatusSegment{};
+    m_segment->magic = STATUS_SEGMENT_MAGIC;
+    m_segment->version = STATUS_SEGMENT_VERSION;
+    m_segment->size = sizeof(StatusSegment);
+}
+
+StatusSegmentWriter::~StatusSegmentWriter()
+{
+    // Readers fall back to the socket
+    shm_unlink(m_name.c_str());
+    munmap(m_segment, sizeof(StatusSegment));
+}
+
+void StatusSegmentWriter::publish(const std::vector<Card>& cards, std::uint64_t generation, std::chrono::milliseconds sampleInterval)
+{
+    auto& seq = m_segment->sequence;
+    std::uint64_t start = seq.load(std::memory_order_relaxed);
+
+    // Odd: readers retry
+    seq.store(start + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    auto& data = m_segment->data;
+    data.generation = generation;
+    data.updateTime = toMs(std::chrono::system_clock::now());
+    data.sampleIntervalMs = sampleInterval.count();
+    data.numCards = std::min(cards.size(), SEGMENT_MAX_CARDS);
+    for(std::size_t i = 0; i < data.numCards; ++i)
+        fill(data.cards[i], cards[i]);
+
+    seq.store(start + 2, std::memory_order_release);
+}
+
+StatusSegmentReader::StatusSegmentReader(const std::string& name)
+{
+    int fd = shm_open(name.c_str(), O_RDONLY | O_CLOEXEC, 0);
+    if(fd < 0)
+        return;
+
+    if(!trusted(fd))
+    {
+        close(fd);
+        return;
+    }
+
+    void* mem = mmap(nullptr, sizeof(StatusSegment), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(mem == MAP_FAILED)
+        return;
+
+    auto* segment = static_cast<const StatusSegment*>(mem);
+    if(segment->magic != STATUS_SEGMENT_MAGIC || segment->version != STATUS_SEGMENT_VERSION || segment->size != sizeof(StatusSegment))
+    {
+        munmap(mem, sizeof(StatusSegment));
+        return;
+    }
+
+    m_segment = segment;
+    m_copy = std::make_unique<SegmentData>();
+}
+
+StatusSegmentReader::~StatusSegmentReader()
+{
+    if(m_segment)
+        munmap(const_cast<StatusSegment*>(m_segment), sizeof(StatusSegment));
+}
+
+std::optional<std::vector<Card>> StatusSegmentReader::read()
+{
+    if(!m_segment)
+        return {};
+
+    auto& data = *m_copy;
+    bool consistent = false;
+    for(int attempt = 0; attempt < READ_ATTEMPTS && !consistent; ++attempt)
+    {
+        std::uint64_t before = m_segment->sequence.load(std::memory_order_acquire);
+        if(before & 1)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+
+        // Header first, then only the cards in use
+        memcpy(&data, &m_segment->data, offsetof(SegmentData, cards));
+        std::size_t numCards = std::min<std::size_t>(data.numCards, SEGMENT_MAX_CARDS);
+        memcpy(data.cards, m_segment->data.cards, numCards * sizeof(SegmentCard));
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        consistent = m_segment->sequence.load(std::memory_order_relaxed) == before;
+    }
+
+    // Never written, or left behind by a server which is gone
+    auto age = toMs(std::chrono::system_clock::now()) - data.updateTime;
+    if(!consistent || data.updateTime == 0 || age > STALE_INTERVALS * std::max<std::int64_t>(data.sampleIntervalMs, 1000))
+        return {};
+
+    std::vector<Card> cards;
+    cards.reserve(data.numCards);
+    for(std::size_t i = 0; i < std::min<std::size_t>(data.numCards, SEGMENT_MAX_CARDS); ++i)
+        cards.push_back(expand(data.cards[i]));
+
+    return cards;
+}
+
+std::optional<std::vector<Card>> readStatusSegment(const std::string& name)
+{
+    return StatusSegmentReader{name}.read();
+}
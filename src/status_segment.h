@@ -0,0 +1,147 @@
+// Card status in shared memory for local readers
+// Author: Max Schwarz <max.schwarz@ais.uni-bonn.de>
+
+#ifndef STATUS_SEGMENT_H
+#define STATUS_SEGMENT_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "protocol.h"
+
+// gpu_server publishes the card state in a POSIX shared memory segment with
+// a fixed, versioned layout. Readers copy it out under a seqlock: the
+// sequence is odd while the server writes, and a copy is only consistent if
+// the sequence was even and unchanged before and after it. Readers never
+// block the server and need no syscall besides the initial mapping.
+
+constexpr const char* STATUS_SEGMENT_NAME = "/gpu_claim_status";
+
+constexpr std::uint32_t STATUS_SEGMENT_MAGIC = 0x47505543; // "GPUC"
+constexpr std::uint32_t STATUS_SEGMENT_VERSION = 1;
+
+// Lists beyond these sizes are truncated
+constexpr std::size_t SEGMENT_MAX_CARDS = 64;
+constexpr std::size_t SEGMENT_MAX_PROCESSES = 64;
+constexpr std::size_t SEGMENT_MAX_TENANTS = 32;
+constexpr std::size_t SEGMENT_MAX_SLICES = 8;
+
+struct SegmentProcess
+{
+    std::int32_t uid;
+    std::int32_t pid;
+    std::uint64_t memory;
+};
+
+struct SegmentTenant
+{
+    std::int32_t uid;
+    std::uint32_t reserved;
+    std::uint64_t memory;
+};
+
+struct SegmentSlice
+{
+    char profile[32];
+    char uuid[64];
+    std::int32_t reservedByUID;
+    std::uint32_t reserved;
+};
+
+// Fields as in Card, strings are null-terminated
+struct SegmentCard
+{
+    std::uint32_t index;
+    std::uint32_t minorID;
+    char name[96];
+    char uuid[64];
+    std::uint64_t memoryTotal;
+    std::uint64_t memoryUsage;
+    std::int32_t reservedByUID;
+    std::uint8_t computeUsagePercent;
+    std::uint8_t healthy;
+    std::uint16_t reserved;
+    std::int64_t lastUsageTime; // steady clock, ms
+
+    std::uint32_t numProcesses;
+    std::uint32_t numTenants;
+    std::uint32_t numSlices;
+    std::uint32_t reserved2;
+    SegmentProcess processes[SEGMENT_MAX_PROCESSES];
+    SegmentTenant tenants[SEGMENT_MAX_TENANTS];
+    SegmentSlice slices[SEGMENT_MAX_SLICES];
+};
+
+// The part copied by readers
+struct SegmentData
+{
+    std::uint64_t generation; // see CompactStatusResponse::generation
+    std::int64_t updateTime; // system clock, ms
+    std::uint32_t sampleIntervalMs;
+    std::uint32_t numCards;
+    SegmentCard cards[SEGMENT_MAX_CARDS];
+};
+
+struct StatusSegment
+{
+    std::uint32_t magic;
+    std::uint32_t version;
+    std::uint64_t size; // sizeof(StatusSegment)
+    std::atomic<std::uint64_t> sequence;
+    SegmentData data;
+};
+
+static_assert(std::atomic<std::uint64_t>::is_always_lock_free, "The seqlock needs a lock-free counter");
+
+// Server side. Replaces any existing segment by a fresh one owned by root,
+// readable by everyone.
+class StatusSegmentWriter
+{
+public:
+    // Throws std::runtime_error
+    explicit StatusSegmentWriter(const std::string& name);
+    ~StatusSegmentWriter();
+
+    StatusSegmentWriter(const StatusSegmentWriter&) = delete;
+    StatusSegmentWriter& operator=(const StatusSegmentWriter&) = delete;
+
+    void publish(const std::vector<Card>& cards, std::uint64_t generation, std::chrono::milliseconds sampleInterval);
+
+private:
+    std::string m_name;
+    StatusSegment* m_segment = nullptr;
+};
+
+// Client side. Keep it around when polling, reading is then just a copy.
+class StatusSegmentReader
+{
+public:
+    // Check valid() afterwards
+    explicit StatusSegmentReader(const std::string& name = STATUS_SEGMENT_NAME);
+    ~StatusSegmentReader();
+
+    StatusSegmentReader(const StatusSegmentReader&) = delete;
+    StatusSegmentReader& operator=(const StatusSegmentReader&) = delete;
+
+    // The segment exists, is only writable by root and has the expected layout
+    [[nodiscard]] bool valid() const
+    { return m_segment != nullptr; }
+
+    // Current card state, or nullopt if the segment is invalid, or has not
+    // been updated for several sample intervals (server gone).
+    [[nodiscard]] std::optional<std::vector<Card>> read();
+
+private:
+    const StatusSegment* m_segment = nullptr;
+    std::unique_ptr<SegmentData> m_copy;
+};
+
+// One-shot StatusSegmentReader::read()
+[[nodiscard]] std::optional<std::vector<Card>> readStatusSegment(const std::string& name = STATUS_SEGMENT_NAME);
+
+#endif
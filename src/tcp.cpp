@@ -0,0 +1,306 @@
+// Framed messages over TCP for cluster mode
+// Author: Max Schwarz <max.schwarz@ais.uni-bonn.de>
+
+#include "tcp.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+int connectTCP(const std::string& address, std::chrono::milliseconds timeout)
+{
+    auto colon = address.rfind(':');
+    if(colon == std::string::npos)
+    {
+        fprintf(stderr, "Expected host:port, got '%s'\n", address.c_str());
+        return -1;
+    }
+
+    std::string host = address.substr(0, colon);
+    std::string port = address.substr(colon + 1);
+
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    addrinfo* result = nullptr;
+    if(int err = getaddrinfo(host.c_str(), port.c_str(), &hints, &result))
+    {
+        fprintf(stderr, "Could not resolve %s: %s\n", host.c_str(), gai_strerror(err));
+        return -1;
+    }
+
+    int fd = -1;
+    int lastError = 0;
+    for(addrinfo* ai = result; ai; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK, ai->ai_protocol);
+        if(fd < 0)
+        {
+            lastError = errno;
+            continue;
+        }
+
+        // Do not hang for minutes if the other side is down
+        int err = connect(fd, ai->ai_addr, ai->ai_addrlen) == 0 ? 0 : errno;
+        if(err == EINPROGRESS)
+        {
+            pollfd pfd{fd, POLLOUT, 0};
+            socklen_t len = sizeof(err);
+            if(poll(&pfd, 1, timeout.count()) != 1 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0)
+                err = ETIMEDOUT;
+        }
+
+        if(err == 0)
+            break;
+
+        lastError = err;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(result);
+
+    if(fd < 0)
+    {
+        fprintf(stderr, "Could not connect to %s: %s\n", address.c_str(), strerror(lastError));
+        return -1;
+    }
+
+    // Back to blocking mode, messages are small
+    int flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    // ... but never block forever on a stuck peer
+    timeval tv{};
+    tv.tv_sec = timeout.count() / 1000;
+    tv.tv_usec = (timeout.count() % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    return fd;
+}
+
+int listenTCP(unsigned int port, int backlog, const std::string& address)
+{
+    sockaddr_storage addr{};
+    socklen_t addrLen = sizeof(sockaddr_in6);
+    if(address.empty())
+    {
+        auto& any = reinterpret_cast<sockaddr_in6&>(addr);
+        any.sin6_family = AF_INET6;
+        any.sin6_addr = in6addr_any;
+        any.sin6_port = htons(port);
+    }
+    else
+    {
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST;
+
+        addrinfo* result = nullptr;
+        if(int err = getaddrinfo(address.c_str(), std::to_string(port).c_str(), &hints, &result))
+        {
+            fprintf(stderr, "Invalid listen address '%s': %s\n", address.c_str(), gai_strerror(err));
+            return -1;
+        }
+
+        memcpy(&addr, result->ai_addr, result->ai_addrlen);
+        addrLen = result->ai_addrlen;
+        freeaddrinfo(result);
+    }
+
+    int fd = socket(addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+    {
+        perror("Could not create TCP socket");
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    // Accept IPv4 as well
+    if(addr.ss_family == AF_INET6)
+    {
+        int zero = 0;
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+    }
+
+    if(bind(fd, reinterpret_cast<sockaddr*>(&addr), addrLen) != 0)
+    {
+        fprintf(stderr, "Could not bind to %s port %u: %s\n", address.empty() ? "any address" : address.c_str(), port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if(listen(fd, backlog) != 0)
+    {
+        perror("Could not listen()");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+std::string peerAddress(int fd)
+{
+    sockaddr_storage addr{};
+    socklen_t len = sizeof(addr);
+    if(getpeername(fd, reinterpret_cast<sockaddr*>(&addr), &len) != 0)
+        return {};
+
+    char host[NI_MAXHOST]{};
+    if(getnameinfo(reinterpret_cast<sockaddr*>(&addr), len, host, sizeof(host), nullptr, 0, NI_NUMERICHOST) != 0)
+        return {};
+
+    // IPv4 peers of the dual-stack socket
+    std::string result = host;
+    if(result.starts_with("::ffff:"))
+        result = result.substr(7);
+
+    return result;
+}
+
+void enableKeepAlive(int fd)
+{
+    int one = 1;
+    int idle = 60;
+    int interval = 10;
+    int count = 6;
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+}
+
+std::optional<std::string> readSecret(const std::string& path)
+{
+    std::ifstream file{path};
+    if(!file)
+    {
+        fprintf(stderr, "Could not open secret file %s: %s\n", path.c_str(), strerror(errno));
+        return {};
+    }
+
+    std::string secret{std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{}};
+    while(!secret.empty() && isspace(static_cast<unsigned char>(secret.back())))
+        secret.pop_back();
+
+    if(secret.empty())
+    {
+        fprintf(stderr, "Secret file %s is empty\n", path.c_str());
+        return {};
+    }
+
+    return secret;
+}
+
+bool sendFrame(int fd, std::span<const std::byte> payload)
+{
+    std::uint32_t size = payload.size();
+    std::byte header[4];
+    for(int i = 0; i < 4; ++i)
+        header[i] = static_cast<std::byte>((size >> (8*i)) & 0xFF);
+
+    iovec iov[2] = {
+        {header, sizeof(header)},
+        {const_cast<std::byte*>(payload.data()), payload.size()}
+    };
+
+    std::size_t total = sizeof(header) + payload.size();
+    std::size_t sent = 0;
+    while(sent < total)
+    {
+        msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+
+        ssize_t ret = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if(ret < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return false;
+        }
+
+        sent += ret;
+
+        // Skip what has been written already
+        for(auto& v : iov)
+        {
+            std::size_t skip = std::min<std::size_t>(ret, v.iov_len);
+            v.iov_base = static_cast<std::byte*>(v.iov_base) + skip;
+            v.iov_len -= skip;
+            ret -= skip;
+        }
+    }
+
+    return true;
+}
+
+ssize_t FrameReader::fill(int fd)
+{
+    // Drop consumed frames before reading more
+    if(m_begin != 0)
+    {
+        m_buffer.erase(m_buffer.begin(), m_buffer.begin() + m_begin);
+        m_begin = 0;
+    }
+
+    std::size_t old = m_buffer.size();
+    m_buffer.resize(old + 64 * 1024);
+
+    ssize_t ret = recv(fd, m_buffer.data() + old, m_buffer.size() - old, 0);
+    m_buffer.resize(old + std::max<ssize_t>(ret, 0));
+
+    if(ret > 0 && m_buffer.size() >= 4)
+    {
+        std::uint32_t size = 0;
+        for(int i = 0; i < 4; ++i)
+            size |= static_cast<std::uint32_t>(m_buffer[i]) << (8*i);
+
+        if(size > MAX_FRAME)
+        {
+            fprintf(stderr, "Received frame of %u bytes, closing connection\n", size);
+            return -1;
+        }
+    }
+
+    return ret;
+}
+
+std::optional<std::span<const std::byte>> FrameReader::next()
+{
+    std::size_t available = m_buffer.size() - m_begin;
+    if(available < 4)
+        return {};
+
+    std::uint32_t size = 0;
+    for(int i = 0; i < 4; ++i)
+        size |= static_cast<std::uint32_t>(m_buffer[m_begin + i]) << (8*i);
+
+    if(available < 4 + size)
+        return {};
+
+    std::span<const std::byte> frame{m_buffer.data() + m_begin + 4, size};
+    m_begin += 4 + size;
+    return frame;
+}
@@ -0,0 +1,84 @@
+// Framed messages over TCP for cluster mode
+// Author: Max Schwarz <max.schwarz@ais.uni-bonn.de>
+
+#ifndef TCP_H
+#define TCP_H
+
+#include <chrono>
+#include <cstddef>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+#include <zpp_bits.h>
+
+// Connect to host:port. The timeout also applies to later sends.
+// Returns the socket, or -1 (after printing the reason).
+[[nodiscard]] int connectTCP(const std::string& address, std::chrono::milliseconds timeout);
+
+// Listening socket on the given numeric address (empty: all interfaces),
+// or -1 (after printing the reason)
+[[nodiscard]] int listenTCP(unsigned int port, int backlog, const std::string& address = {});
+
+// Numeric address of the other side (without port), empty on error
+[[nodiscard]] std::string peerAddress(int fd);
+
+// Notice dead peers within a few minutes, even if we never send anything
+void enableKeepAlive(int fd);
+
+// Shared secret for cluster mode: contents of the file without trailing
+// whitespace. nullopt (after printing the reason) if it cannot be read or
+// is empty.
+[[nodiscard]] std::optional<std::string> readSecret(const std::string& path);
+
+// Every message is preceded by its length as 32-bit little endian. Blocks
+// until everything is written, returns false on error.
+[[nodiscard]] bool sendFrame(int fd, std::span<const std::byte> payload);
+
+[[nodiscard]] inline bool sendMessage(int fd, auto&& msg, std::vector<std::byte>& buffer)
+{
+    buffer.clear();
+    zpp::bits::out out{buffer};
+    if(zpp::bits::failure(out(msg)))
+        return false;
+
+    return sendFrame(fd, buffer);
+}
+
+// Reassembles frames from a stream socket
+class FrameReader
+{
+public:
+    // Frames larger than this are a protocol error
+    static constexpr std::size_t MAX_FRAME = 16 * 1024 * 1024;
+
+    // Read what is available. Returns the number of bytes read, 0 on EOF,
+    // -1 on error (including oversized frames).
+    ssize_t fill(int fd);
+
+    // Next complete frame, valid until the next call to fill() or next()
+    [[nodiscard]] std::optional<std::span<const std::byte>> next();
+
+private:
+    std::vector<std::byte> m_buffer;
+    std::size_t m_begin = 0; // start of the first unconsumed frame
+};
+
+// Blocking receive of one framed message
+[[nodiscard]] bool receiveMessage(int fd, auto& msg, FrameReader& reader)
+{
+    while(true)
+    {
+        if(auto frame = reader.next())
+        {
+            zpp::bits::in in{*frame};
+            return !zpp::bits::failure(in(msg));
+        }
+
+        if(reader.fill(fd) <= 0)
+            return false;
+    }
+}
+
+#endif
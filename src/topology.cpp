@@ -0,0 +1,235 @@
+// Interconnect topology for multi-GPU placement
+// Author: Max Schwarz <max.schwarz@ais.uni-bonn.de>
+
+#include "topology.h"
+#include "log.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <utility>
+
+namespace
+{
+    // PCIe paths are always more expensive than NVLink
+    constexpr unsigned int PCIE_BASE = 100;
+
+    unsigned int nvlinkCost(unsigned int links)
+    {
+        return 1 + NVML_NVLINK_MAX_LINKS - std::min<unsigned int>(links, NVML_NVLINK_MAX_LINKS);
+    }
+
+    const char* levelName(unsigned int level)
+    {
+        switch(level)
+        {
+            case NVML_TOPOLOGY_INTERNAL:   return "BRD";
+            case NVML_TOPOLOGY_SINGLE:     return "PIX";
+            case NVML_TOPOLOGY_MULTIPLE:   return "PXB";
+            case NVML_TOPOLOGY_HOSTBRIDGE: return "PHB";
+            case NVML_TOPOLOGY_NODE:       return "NODE";
+            default:                       return "SYS";
+        }
+    }
+}
+
+Topology::Topology(std::span<const nvmlDevice_t> devices)
+ : m_numDevices{devices.size()}
+ , m_cost(m_numDevices * m_numDevices, 0)
+{
+    std::vector<nvmlPciInfo_t> pci(m_numDevices);
+    for(std::size_t i = 0; i < m_numDevices; ++i)
+    {
+        if(auto err = nvmlDeviceGetPciInfo_v3(devices[i], &pci[i]))
+        {
+            logError("Could not get PCI info of device %lu: %s", i, nvmlErrorString(err));
+            pci[i] = {};
+        }
+    }
+
+    // Count active NVLinks between each pair. Links ending somewhere else
+    // (NVSwitch) connect a card to all other cards with switch links.
+    std::vector<unsigned int> links(m_numDevices * m_numDevices, 0);
+    std::vector<unsigned int> switchLinks(m_numDevices, 0);
+    for(std::size_t i = 0; i < m_numDevices; ++i)
+    {
+        for(unsigned int link = 0; link < NVML_NVLINK_MAX_LINKS; ++link)
+        {
+            nvmlEnableState_t active{};
+            if(nvmlDeviceGetNvLinkState(devices[i], link, &active) != NVML_SUCCESS)
+                break; // no (more) NVLinks on this card
+
+            if(active != NVML_FEATURE_ENABLED)
+                continue;
+
+            nvmlPciInfo_t remote{};
+            if(nvmlDeviceGetNvLinkRemotePciInfo_v2(devices[i], link, &remote) != NVML_SUCCESS)
+                continue;
+
+            auto it = std::find_if(pci.begin(), pci.end(), [&](auto& info){
+                return info.busId[0] && strncmp(info.busId, remote.busId, sizeof(remote.busId)) == 0;
+            });
+
+            if(it != pci.end())
+                links[i * m_numDevices + (it - pci.begin())]++;
+            else
+                switchLinks[i]++;
+        }
+    }
+
+    for(std::size_t a = 0; a < m_numDevices; ++a)
+    {
+        for(std::size_t b = a + 1; b < m_numDevices; ++b)
+        {
+            unsigned int nvlinks = std::max(links[a * m_numDevices + b], links[b * m_numDevices + a]);
+            if(nvlinks == 0)
+                nvlinks = std::min(switchLinks[a], switchLinks[b]);
+
+            unsigned int cost = 0;
+            if(nvlinks != 0)
+                cost = nvlinkCost(nvlinks);
+            else
+            {
+                nvmlGpuTopologyLevel_t level = NVML_TOPOLOGY_SYSTEM;
+                if(auto err = nvmlDeviceGetTopologyCommonAncestor(devices[a], devices[b], &level))
+                {
+                    logError("Could not get topology of devices %lu/%lu: %s", a, b, nvmlErrorString(err));
+                    level = NVML_TOPOLOGY_SYSTEM;
+                }
+
+                cost = PCIE_BASE + level;
+            }
+
+            m_cost[a * m_numDevices + b] = cost;
+            m_cost[b * m_numDevices + a] = cost;
+        }
+    }
+}
+
+unsigned int Topology::cost(unsigned int a, unsigned int b) const
+{
+    if(a >= m_numDevices || b >= m_numDevices)
+        return 0;
+
+    return m_cost[a * m_numDevices + b];
+}
+
+std::vector<unsigned int> Topology::select(std::span<const unsigned int> freeCards, std::size_t n) const
+{
+    if(n >= freeCards.size())
+        return {freeCards.begin(), freeCards.end()};
+
+    if(n == 0)
+        return {};
+
+    if(n == 1)
+    {
+        // Card whose nearest free neighbor is the farthest away
+        unsigned int best = freeCards.front();
+        unsigned int bestDistance = 0;
+        for(auto card : freeCards)
+        {
+            unsigned int nearest = UINT_MAX;
+            for(auto other : freeCards)
+            {
+                if(other != card)
+                    nearest = std::min(nearest, cost(card, other));
+            }
+
+            if(nearest > bestDistance)
+            {
+                best = card;
+                bestDistance = nearest;
+            }
+        }
+
+        return {best};
+    }
+
+    // Grow a set greedily from every possible seed card and keep the one with
+    // the best (worst link, total cost) score. Card counts are small, so the
+    // O(F^2 n^2) effort does not matter.
+    using Score = std::pair<unsigned int, unsigned int>;
+
+    std::vector<unsigned int> best;
+    Score bestScore{UINT_MAX, UINT_MAX};
+
+    std::vector<unsigned int> set;
+    for(auto seed : freeCards)
+    {
+        set.assign(1, seed);
+        Score score{0, 0};
+
+        while(set.size() < n)
+        {
+            unsigned int candidate = 0;
+            Score candidateScore{UINT_MAX, UINT_MAX};
+
+            for(auto card : freeCards)
+            {
+                if(std::ranges::find(set, card) != set.end())
+                    continue;
+
+                Score s{score.first, score.second};
+                for(auto member : set)
+                {
+                    s.first = std::max(s.first, cost(card, member));
+                    s.second += cost(card, member);
+                }
+
+                if(s < candidateScore)
+                {
+                    candidate = card;
+                    candidateScore = s;
+                }
+            }
+
+            set.push_back(candidate);
+            score = candidateScore;
+        }
+
+        if(score < bestScore)
+        {
+            best = set;
+            bestScore = score;
+        }
+    }
+
+    std::ranges::sort(best);
+    return best;
+}
+
+std::string Topology::describe() const
+{
+    std::stringstream ss;
+
+    ss << "     ";
+    for(std::size_t b = 0; b < m_numDevices; ++b)
+        ss << " GPU" << b << (b < 10 ? " " : "");
+    ss << "\n";
+
+    for(std::size_t a = 0; a < m_numDevices; ++a)
+    {
+        ss << "GPU" << a << (a < 10 ? " " : "");
+        for(std::size_t b = 0; b < m_numDevices; ++b)
+        {
+            std::string label;
+            auto c = cost(a, b);
+            if(a == b)
+                label = "X";
+            else if(c < PCIE_BASE)
+                label = "NV" + std::to_string(1 + NVML_NVLINK_MAX_LINKS - c);
+            else
+                label = levelName(c - PCIE_BASE);
+
+            ss << " ";
+            ss.width(5);
+            ss << std::left << label;
+        }
+        ss << "\n";
+    }
+
+    return ss.str();
+}
@@ -0,0 +1,39 @@
+// Interconnect topology for multi-GPU placement
+// Author: Max Schwarz <max.schwarz@ais.uni-bonn.de>
+
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <span>
+#include <string>
+#include <vector>
+
+#include <nvml.h>
+
+// Pairwise connection cost between all cards, lower is tighter.
+//
+// Cards connected by NVLink are always cheaper than any PCIe path, more
+// links are cheaper than fewer. PCIe paths are ordered by their common
+// ancestor (same board < PCIe switch < host bridge < CPU socket < system).
+class Topology
+{
+public:
+    Topology() = default;
+    explicit Topology(std::span<const nvmlDevice_t> devices);
+
+    [[nodiscard]] unsigned int cost(unsigned int a, unsigned int b) const;
+
+    // Choose n of the free cards (in index order). Multi-GPU jobs get the
+    // tightest-connected set, single-GPU jobs the card that is worst connected
+    // to the other free ones, so that well-connected groups stay available.
+    [[nodiscard]] std::vector<unsigned int> select(std::span<const unsigned int> freeCards, std::size_t n) const;
+
+    // Human-readable cost matrix for the startup log
+    [[nodiscard]] std::string describe() const;
+
+private:
+    std::size_t m_numDevices = 0;
+    std::vector<unsigned int> m_cost; // m_numDevices x m_numDevices
+};
+
+#endif